@@ -0,0 +1,172 @@
+/*
+ * Compares build and query cost of the AABB tree and the uniform grid on
+ * the collision layers of the bundled maps and on synthetic layers, and
+ * shows which one the broadphase selector picks for each. The synthetic
+ * layers sit on either side of each selector threshold: box count for
+ * sparse and for crowded layers, and spread of box sizes.
+ *
+ * Usage: nostos-broadphase-bench [map.tmx ...]
+ */
+
+#include <stdio.h>
+#include <allegro5/allegro_image.h>
+#include <nostos/broadphase.h>
+#include <nostos/tiled.h>
+#include <nostos/utils.h>
+
+#define NUM_BUILDS 50
+#define NUM_QUERIES 200000
+#define NUM_RUNS 5
+
+static bool count_hit (BOX *box, void *user)
+{
+    (*(int *)user)++;
+    return true;
+}
+
+static void bench (const char *name, BOX *boxes, int num_boxes, VECTOR2D area)
+{
+    float cell_size = 0;
+    int selected = broadphase_select (boxes, num_boxes, &cell_size);
+
+    /* Layers left to the tree still get the grid the selector would build. */
+    if (selected != BROADPHASE_GRID) {
+        double sum = 0;
+        for (int i = 0; i < num_boxes; i++)
+            sum += 2.0 * MAX (boxes[i].extent.x, boxes[i].extent.y);
+        cell_size = 2.0 * sum / num_boxes;
+    }
+
+    BOX *queries = al_malloc (NUM_QUERIES * sizeof (BOX));
+    srand (1);
+    for (int i = 0; i < NUM_QUERIES; i++) {
+        queries[i].center = (VECTOR2D){rand () % (int) area.x, rand () % (int) area.y};
+        queries[i].extent = (VECTOR2D){16, 8};
+    }
+
+    double t = al_get_time ();
+    for (int i = 0; i < NUM_BUILDS; i++)
+        aabb_free (aabb_build_tree_auto (NULL, boxes, num_boxes));
+    double tree_build = (al_get_time () - t) / NUM_BUILDS;
+
+    t = al_get_time ();
+    for (int i = 0; i < NUM_BUILDS; i++)
+        grid_free (grid_build (boxes, num_boxes, cell_size));
+    double grid_build_time = (al_get_time () - t) / NUM_BUILDS;
+
+    AABB_TREE *tree = aabb_build_tree_auto (NULL, boxes, num_boxes);
+    SPATIAL_GRID *grid = grid_build (boxes, num_boxes, cell_size);
+
+    /* Best of NUM_RUNS, the two structures taking turns */
+    int tree_hits = 0, grid_hits = 0;
+    double tree_query = 1e9, grid_query = 1e9;
+    for (int run = 0; run < NUM_RUNS; run++) {
+        tree_hits = 0;
+        t = al_get_time ();
+        for (int i = 0; i < NUM_QUERIES; i++)
+            aabb_query_visit (tree, &queries[i], count_hit, &tree_hits);
+        tree_query = MIN (tree_query, (al_get_time () - t) / NUM_QUERIES);
+
+        grid_hits = 0;
+        t = al_get_time ();
+        for (int i = 0; i < NUM_QUERIES; i++)
+            grid_query_visit (grid, &queries[i], count_hit, &grid_hits);
+        grid_query = MIN (grid_query, (al_get_time () - t) / NUM_QUERIES);
+    }
+
+    printf ("%-22s boxes %6d | build tree %8.3f ms, grid %8.3f ms | "
+            "query tree %7.1f ns, grid %7.1f ns | hits %d/%d | selected %s\n",
+            name, num_boxes, tree_build * 1e3, grid_build_time * 1e3,
+            tree_query * 1e9, grid_query * 1e9, tree_hits, grid_hits,
+            selected == BROADPHASE_GRID ? "grid" : "tree");
+
+    aabb_free (tree);
+    grid_free (grid);
+    al_free (queries);
+}
+
+static void bench_map (const char *filename)
+{
+    char *path = get_resource_path_str (filename);
+    TILED_MAP *map = tiled_load_tmx_file (path);
+    al_free (path);
+
+    if (!map) {
+        fprintf (stderr, "Failed to load map %s.\n", filename);
+        return;
+    }
+
+    int num_boxes;
+    BOX *boxes = aabb_load_boxes (map, "collision", &num_boxes);
+    if (boxes) {
+        VECTOR2D area = {map->width * map->tile_width, map->height * map->tile_height};
+        bench (filename, boxes, num_boxes, area);
+        al_free (boxes);
+    }
+
+    tiled_free_map (map);
+}
+
+/*
+ * Boxes on a grid of tiles, per_mille of the tiles holding one. With
+ * max_span above 1 boxes cover 1, 2, 4, ... up to max_span tiles a side,
+ * like buildings of mixed sizes, instead of one tile each.
+ */
+static void bench_synthetic (const char *label, int width, int height, int tile_size,
+                             int per_mille, int max_span)
+{
+    BOX *boxes = al_malloc (width * height * sizeof (BOX));
+    int num_boxes = 0;
+    int num_spans = 1;
+
+    while ((1 << num_spans) <= max_span)
+        num_spans++;
+
+    srand (2);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            if (rand () % 1000 >= per_mille)
+                continue;
+            float w = tile_size * (1 << (rand () % num_spans));
+            float h = tile_size * (1 << (rand () % num_spans));
+            boxes[num_boxes].extent = (VECTOR2D){w / 2.0f, h / 2.0f};
+            boxes[num_boxes].center = (VECTOR2D){x * tile_size + w / 2.0f, y * tile_size + h / 2.0f};
+            boxes[num_boxes].data = NULL;
+            num_boxes++;
+        }
+    }
+
+    char name[64];
+    snprintf (name, sizeof (name), "%s %dx%d", label, width, height);
+    bench (name, boxes, num_boxes, (VECTOR2D){width * tile_size, height * tile_size});
+    al_free (boxes);
+}
+
+int main (int argc, char *argv[])
+{
+    if (!al_init () || !al_init_image_addon ()) {
+        fprintf (stderr, "Failed to initialize Allegro.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++)
+            bench_map (argv[i]);
+    } else {
+        bench_map ("data/maps/teste.tmx");
+        bench_map ("data/maps/house1.tmx");
+    }
+
+    bench_synthetic ("few", 24, 24, 32, 30, 1);
+    bench_synthetic ("few", 48, 48, 32, 30, 1);
+    bench_synthetic ("crowded", 16, 16, 32, 600, 1);
+    bench_synthetic ("crowded", 24, 24, 32, 600, 1);
+    bench_synthetic ("tiles", 100, 100, 32, 300, 1);
+    bench_synthetic ("tiles", 500, 500, 32, 300, 1);
+    bench_synthetic ("mixed", 500, 500, 32, 10, 128);
+    bench_synthetic ("mixed", 500, 500, 32, 10, 256);
+    bench_synthetic ("sparse", 500, 500, 32, 10, 1);
+    bench_synthetic ("sparse", 1000, 1000, 32, 1, 1);
+
+    return EXIT_SUCCESS;
+}
@@ -5,6 +5,8 @@
 #ifndef _aabbtree_h
 #define _aabbtree_h
 
+#include "debugdraw.h"
+#include "jobs.h"
 #include "screen.h"
 #include "tiled.h"
 #include "utils.h"
@@ -26,12 +28,28 @@ struct AABB_LEAF
     AABB_NODE node;
     BOX *boxes;
     int num_boxes;
+    int capacity;
 };
 
+typedef bool (*AABB_VISIT_FN) (BOX *box, void *user);
+typedef void (*AABB_REFIT_FN) (BOX *box, void *user);
+
+typedef struct AABB_RAY {
+    VECTOR2D from;
+    VECTOR2D to;
+} AABB_RAY;
+
 struct AABB_COLLISIONS
 {
-    LIST *boxes;
+    VECTOR boxes;
+    VECTOR queue;
     BOX query_box;
+    int num_collisions;
+    const AABB_TREE *cache_tree;
+    const AABB_NODE *cache_node;
+    BOX cache_box;
+    int cache_hits;
+    int cache_misses;
 };
 
 struct AABB_TREE
@@ -41,20 +59,38 @@ struct AABB_TREE
     int num_nodes;
     int num_leafs;
     int max_depth;
-    AABB_COLLISIONS *collisions;
-    int num_collisions;
     bool use_cache;
 };
 
 AABB_TREE *aabb_build_tree (BOX *boxes, int num_boxes, int max_depth);
+AABB_TREE *aabb_build_tree_lbvh (JOBS *jobs, BOX *boxes, int num_boxes, int leaf_size);
+AABB_TREE *aabb_build_tree_auto (JOBS *jobs, BOX *boxes, int num_boxes);
+BOX *aabb_load_boxes (TILED_MAP *map, const char *layer_name, int *num_boxes);
+BOX *aabb_load_tile_boxes (TILED_MAP *map, const char *property, int *num_boxes);
 AABB_TREE *aabb_load_tree (TILED_MAP *map, const char *layer_name);
-bool aabb_collide (AABB_TREE *tree, BOX *box);
-bool aabb_collide_with_cache (AABB_TREE *tree, BOX *box, AABB_COLLISIONS *collision);
-void aabb_collide_fill_cache (AABB_TREE *tree, BOX *box, AABB_COLLISIONS *collision);
+bool aabb_collide (const AABB_TREE *tree, const BOX *box);
+bool aabb_collide_with_cache (const AABB_TREE *tree, const BOX *box, AABB_COLLISIONS *collisions);
+void aabb_collide_fill_cache (const AABB_TREE *tree, const BOX *box, AABB_COLLISIONS *collisions);
+void aabb_query_visit (const AABB_TREE *tree, const BOX *box, AABB_VISIT_FN visit, void *user);
+void aabb_query_visit_with_cache (const AABB_TREE *tree, const BOX *box, AABB_COLLISIONS *collisions,
+                                  AABB_VISIT_FN visit, void *user);
+bool aabb_sweep (const AABB_TREE *tree, const BOX *box, VECTOR2D delta, BOX_HIT *hit);
+bool aabb_raycast (const AABB_TREE *tree, VECTOR2D from, VECTOR2D to, BOX_HIT *hit);
+int aabb_raycast_all (const AABB_TREE *tree, VECTOR2D from, VECTOR2D to, AABB_COLLISIONS *collisions);
+bool aabb_line_of_sight (const AABB_TREE *tree, VECTOR2D from, VECTOR2D to);
+void aabb_query_segment (const AABB_TREE *tree, VECTOR2D from, VECTOR2D to, AABB_VISIT_FN visit, void *user);
+void aabb_raycast_batch (const AABB_TREE *tree, const AABB_RAY *rays, int num_rays, BOX_HIT *hits);
+int aabb_query_radius (const AABB_TREE *tree, VECTOR2D center, float radius, AABB_COLLISIONS *collisions);
+int aabb_query_nearest (const AABB_TREE *tree, VECTOR2D point, int k, float max_distance,
+                        AABB_COLLISIONS *collisions);
+void aabb_refit (AABB_TREE *tree, AABB_REFIT_FN refit, void *user);
+void aabb_insert (AABB_TREE *tree, BOX box);
 void aabb_init_collisions (AABB_COLLISIONS *col);
+void aabb_clear_collisions (AABB_COLLISIONS *collisions);
 void aabb_free (AABB_TREE *tree);
 void aabb_free_collisions (AABB_COLLISIONS *col);
 void aabb_draw (AABB_TREE *tree, SCREEN *s, ALLEGRO_COLOR color);
+void aabb_debug_draw (const AABB_TREE *tree, DEBUG_DRAW *dd);
 
 #endif
 
@@ -0,0 +1,76 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+#ifndef _actors_h_
+#define _actors_h_
+
+#include "pool.h"
+#include "sprite.h"
+#include "utils.h"
+
+#define ACTORS_INVALID HANDLE_INVALID
+
+/* How often an actor is simulated, by its distance to the view. */
+enum ACTOR_TIER {
+    ACTOR_TIER_FULL,
+    ACTOR_TIER_REDUCED,
+    ACTOR_TIER_DORMANT
+};
+
+/*
+ * Actor state split into parallel arrays, packed so the live actors are
+ * always 0..num_actors-1. Handles stay valid while actors are removed
+ * around them; slots maps the index part of a handle to the actor's
+ * current index, and generations tells a live handle from a stale one.
+ */
+struct ACTORS
+{
+    int num_actors;
+    int capacity;
+
+    VECTOR2D *position;
+    VECTOR2D *previous;
+    VECTOR2D *movement;
+    VECTOR2D *box_center;
+    VECTOR2D *box_extent;
+    float *anim_time;
+    float *frame_duration;
+    int *animation;
+    int *frame;
+    SPRITE **sprite;
+    void **data;
+    int *handles;
+
+    /*
+     * Scheduling: waiting counts the ticks since an actor was last
+     * simulated, ticks is how many it advances in the next update (0 when
+     * it sits this one out) and due lists the actors up this tick, overdue
+     * ones first, then nearest tier first.
+     */
+    unsigned char *tier;
+    int *waiting;
+    int *ticks;
+    int *due;
+    int *due_scratch;
+    int num_due;
+
+    int *slots;
+    int *generations;
+    int num_slots;
+    int *free_slots;
+    int num_free;
+};
+
+ACTORS *actors_create (int capacity);
+int actors_add (ACTORS *actors, SPRITE *sprite, VECTOR2D position, void *data);
+void actors_remove (ACTORS *actors, int handle);
+bool actors_valid (const ACTORS *actors, int handle);
+int actors_index (const ACTORS *actors, int handle);
+BOX actors_box (const ACTORS *actors, int handle);
+int actors_schedule (ACTORS *actors, BOX view, float near, float far, int rate, unsigned int tick);
+void actors_update_range (ACTORS *actors, int begin, int end, float dt, float t);
+void actors_save_positions (ACTORS *actors);
+void actors_free (ACTORS *actors);
+
+#endif
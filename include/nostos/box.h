@@ -16,15 +16,61 @@ typedef struct BOX {
     void *data;
 } BOX;
 
+typedef struct BOX_HIT {
+    BOX *box;
+    float time;
+    VECTOR2D normal;
+    float penetration;
+} BOX_HIT;
+
+typedef bool (*BOX_SWEEP_FN) (const BOX *box, VECTOR2D delta, BOX_HIT *hit, void *user);
+
+/* Most boxes box_overlap_batch tests per call. */
+#define BOX_BATCH_SIZE 32
+
+static inline VECTOR2D box_get_min (BOX b)
+{
+    return vsub (b.center, b.extent);
+}
+
+static inline VECTOR2D box_get_max (BOX b)
+{
+    return vadd (b.center, b.extent);
+}
+
+static inline bool box_overlap (BOX b1, BOX b2)
+{
+    VECTOR2D t = vabs (vsub (b1.center, b2.center));
+    VECTOR2D ext = vadd (b1.extent, b2.extent);
+    return t.x <= ext.x && t.y <= ext.y;
+}
+
+static inline bool box_inside_vector2d (BOX b, VECTOR2D v)
+{
+    VECTOR2D min = box_get_min (b);
+    VECTOR2D max = box_get_max (b);
+
+    return !(v.x < min.x || v.x > max.x || v.y < min.y || v.y > max.y);
+}
+
+static inline bool box_inside_box (BOX b1, BOX b2)
+{
+    return b1.center.x - b1.extent.x > b2.center.x - b2.extent.x &&
+           b1.center.x + b1.extent.x < b2.center.x + b2.extent.x &&
+           b1.center.y - b1.extent.y > b2.center.y - b2.extent.y &&
+           b1.center.y + b1.extent.y < b2.center.y + b2.extent.y;
+}
+
 BOX box_from_points (VECTOR2D v1, VECTOR2D v2);
 BOX box_scale (BOX b, float f);
-bool box_overlap (BOX b1, BOX b2);
-bool box_inside_vector2d (BOX b, VECTOR2D v);
-bool box_inside_box (BOX b1, BOX b2);
-VECTOR2D box_get_min (BOX b);
-VECTOR2D box_get_max (BOX b);
+BOX box_merge (BOX b1, BOX b2);
+float box_sqdistance (BOX b, VECTOR2D v);
+int box_overlap_batch (BOX b, const BOX *boxes, int num_boxes, int *hits);
 void box_debug (BOX b);
 void box_draw (BOX b, VECTOR2D offset, ALLEGRO_COLOR color);
 bool box_lateral (BOX b1, BOX b2);
+bool box_sweep (BOX b1, VECTOR2D delta, BOX b2, BOX_HIT *hit);
+bool box_sweep_touches (BOX b1, VECTOR2D delta, BOX b2, float max_time);
+VECTOR2D box_slide (BOX b, VECTOR2D delta, BOX_SWEEP_FN sweep, void *user, VECTOR2D *blocked);
 
 #endif
@@ -0,0 +1,42 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+#ifndef _broadphase_h_
+#define _broadphase_h_
+
+#include "aabbtree.h"
+#include "spatialgrid.h"
+
+typedef struct BROADPHASE BROADPHASE;
+
+enum BROADPHASE_TYPE {
+    BROADPHASE_TREE,
+    BROADPHASE_GRID
+};
+
+struct BROADPHASE
+{
+    int type;
+    AABB_TREE *tree;
+    SPATIAL_GRID *grid;
+};
+
+int broadphase_select (const BOX *boxes, int num_boxes, float *cell_size);
+BROADPHASE *broadphase_build (JOBS *jobs, BOX *boxes, int num_boxes);
+BROADPHASE *broadphase_load (TILED_MAP *map, const char *layer_name);
+bool broadphase_collide (const BROADPHASE *bp, const BOX *box);
+void broadphase_collide_fill_cache (const BROADPHASE *bp, const BOX *box, AABB_COLLISIONS *collisions);
+void broadphase_query_visit (const BROADPHASE *bp, const BOX *box, AABB_VISIT_FN visit, void *user);
+void broadphase_query_visit_with_cache (const BROADPHASE *bp, const BOX *box, AABB_COLLISIONS *collisions,
+                                        AABB_VISIT_FN visit, void *user);
+bool broadphase_sweep (const BROADPHASE *bp, const BOX *box, VECTOR2D delta, BOX_HIT *hit);
+VECTOR2D broadphase_slide (const BROADPHASE *bp, const BOX *box, VECTOR2D delta, VECTOR2D *blocked);
+bool broadphase_raycast (const BROADPHASE *bp, VECTOR2D from, VECTOR2D to, BOX_HIT *hit);
+bool broadphase_line_of_sight (const BROADPHASE *bp, VECTOR2D from, VECTOR2D to);
+void broadphase_query_segment (const BROADPHASE *bp, VECTOR2D from, VECTOR2D to, AABB_VISIT_FN visit, void *user);
+void broadphase_free (BROADPHASE *bp);
+void broadphase_draw (BROADPHASE *bp, SCREEN *s, ALLEGRO_COLOR color);
+void broadphase_debug_draw (const BROADPHASE *bp, DEBUG_DRAW *dd);
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+#ifndef _debugdraw_h_
+#define _debugdraw_h_
+
+#include "box.h"
+#include "screen.h"
+#include "utils.h"
+
+#include <allegro5/allegro_primitives.h>
+
+typedef struct DEBUG_DRAW DEBUG_DRAW;
+
+enum DEBUG_DRAW_CATEGORY {
+    DEBUG_DRAW_NODES,
+    DEBUG_DRAW_LEAVES,
+    DEBUG_DRAW_HITS,
+    DEBUG_DRAW_TRIGGERS,
+    DEBUG_DRAW_SHAPES,
+    DEBUG_DRAW_NUM_CATEGORIES
+};
+
+/*
+ * Lines collected during a frame, flushed with one al_draw_prim. Vertices
+ * are kept between frames so a steady frame does not allocate.
+ */
+struct DEBUG_DRAW
+{
+    VECTOR vertices;
+    unsigned int enabled;
+    ALLEGRO_COLOR colors[DEBUG_DRAW_NUM_CATEGORIES];
+    VECTOR2D offset;
+    BOX view;
+    int num_lines;
+};
+
+DEBUG_DRAW *debug_draw_create ();
+void debug_draw_toggle (DEBUG_DRAW *dd, int category);
+bool debug_draw_enabled (const DEBUG_DRAW *dd, int category);
+bool debug_draw_any (const DEBUG_DRAW *dd);
+void debug_draw_begin (DEBUG_DRAW *dd, SCREEN *s);
+void debug_draw_line (DEBUG_DRAW *dd, VECTOR2D p1, VECTOR2D p2, ALLEGRO_COLOR color);
+void debug_draw_box (DEBUG_DRAW *dd, BOX b, ALLEGRO_COLOR color);
+void debug_draw_flush (DEBUG_DRAW *dd);
+void debug_draw_free (DEBUG_DRAW *dd);
+
+#endif
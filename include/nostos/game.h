@@ -5,7 +5,10 @@
 #ifndef _game_h_
 #define _game_h_
 
+#include "debugdraw.h"
+#include "jobs.h"
 #include "sprite.h"
+#include "spritebatch.h"
 #include "scene.h"
 #include "screen.h"
 #include "ui.h"
@@ -17,9 +20,12 @@ typedef struct GAME {
     SCENE *current_scene;
     SPRITES *sprites;
     SPRITE_ACTOR *current_actor;
-    SPRITE_NPC *current_npc;
+    int current_npc;
     SCREEN screen;
     UI *ui;
+    DEBUG_DRAW *debug_draw;
+    SPRITE_BATCH *sprite_batch;
+    JOBS *jobs;
 
     ALLEGRO_DISPLAY	*display;
     ALLEGRO_EVENT_QUEUE	*event_queue;
@@ -33,6 +39,9 @@ typedef struct GAME {
     int rrate;
     int suggest_vsync;
     int force_vsync;
+    int threads;
+    int max_fps;
+    int pipelined;
 } GAME;
 
 GAME * game_init ();
@@ -0,0 +1,62 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+#ifndef _jobs_h_
+#define _jobs_h_
+
+#include "utils.h"
+
+#include <allegro5/allegro.h>
+
+typedef struct JOBS JOBS;
+typedef struct JOB JOB;
+typedef struct JOB_QUEUE JOB_QUEUE;
+
+/* Runs items [begin, end) of a parallel loop. */
+typedef void (*JOB_FN) (void *data, int begin, int end);
+
+struct JOB
+{
+    JOB_FN fn;
+    void *data;
+    int begin;
+    int end;
+};
+
+/*
+ * One per worker. The owner takes from the back, thieves from the front.
+ */
+struct JOB_QUEUE
+{
+    ALLEGRO_MUTEX *mutex;
+    JOB *jobs;
+    int capacity;
+    int front;
+    int back;
+};
+
+/*
+ * Worker threads plus the thread that submits work, which runs jobs from
+ * queue 0 while it waits. queued counts the jobs sitting in queues and
+ * pending the ones not finished yet; both are guarded by mutex.
+ */
+struct JOBS
+{
+    int num_workers;
+    JOB_QUEUE *queues;
+    ALLEGRO_THREAD **threads;
+
+    ALLEGRO_MUTEX *mutex;
+    ALLEGRO_COND *wake;
+    ALLEGRO_COND *done;
+    int queued;
+    int pending;
+    bool stopping;
+};
+
+JOBS *jobs_create (int num_threads);
+void jobs_parallel_for (JOBS *jobs, int count, int grain, JOB_FN fn, void *data);
+void jobs_free (JOBS *jobs);
+
+#endif
@@ -0,0 +1,155 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+#ifndef _pathfind_h_
+#define _pathfind_h_
+
+#include "tiled.h"
+#include "utils.h"
+#include "vector2d.h"
+#include "world.h"
+
+#include <allegro5/allegro.h>
+
+typedef struct PATH PATH;
+typedef struct PATHFINDER PATHFINDER;
+typedef struct PATH_REQUEST PATH_REQUEST;
+typedef struct PATH_CACHE_ENTRY PATH_CACHE_ENTRY;
+typedef struct PATH_NODE PATH_NODE;
+
+enum PATH_STATUS {
+    PATH_NONE,
+    PATH_PENDING,
+    PATH_FOUND,
+    PATH_FAILED
+};
+
+/*
+ * A route as handed to whoever asked for it: waypoints in world
+ * coordinates, the last one being the requested target, and the index of
+ * the one being walked to. owner orders requests made in the same step.
+ *
+ * Long routes come as a corridor of cluster entrances first, and points
+ * only gets the part between corridor[leg - 1] and corridor[leg] appended
+ * once the walker gets close to its end; refining is set meanwhile.
+ */
+struct PATH
+{
+    int status;
+    int owner;
+    VECTOR points;
+    int current;
+    VECTOR corridor;
+    int leg;
+    bool refining;
+};
+
+/* refine marks a leg of a corridor, appended to the path's points. */
+struct PATH_REQUEST
+{
+    PATH *path;
+    int start;
+    int goal;
+    VECTOR2D target;
+    bool refine;
+};
+
+/*
+ * Jump points from start to goal, or with coarse set the entrances
+ * between them, or none when no route exists.
+ */
+struct PATH_CACHE_ENTRY
+{
+    int start;
+    int goal;
+    bool found;
+    bool coarse;
+    unsigned int used;
+    VECTOR cells;
+};
+
+struct PATH_NODE
+{
+    float f;
+    float g;
+    int cell;
+};
+
+/*
+ * Walkability of the map cells plus everything a search needs, kept
+ * between searches: per cell costs and parents stamped with the search
+ * they belong to, the open set as a binary heap of PATH_NODE, the queue of
+ * requests and the cache of recent results.
+ */
+struct PATHFINDER
+{
+    int width;
+    int height;
+    int cell_width;
+    int cell_height;
+    unsigned char *blocked;
+
+    float *g;
+    int *parent;
+    unsigned int *seen;
+    unsigned int *closed;
+    unsigned int search;
+
+    PATH_NODE *heap;
+    int heap_size;
+    int heap_capacity;
+
+    ALLEGRO_MUTEX *mutex;
+    VECTOR requests;
+    int first_request;
+    int num_sorted;
+    PATH_REQUEST active;
+    bool searching;
+
+    PATH_CACHE_ENTRY *cache;
+    int cache_size;
+    unsigned int cache_clock;
+
+    /*
+     * Abstract graph for long routes: the map cut in clusters of
+     * cluster_size cells a side, one node per cell at either side of each
+     * crossing between clusters. The nodes of cluster c are
+     * cluster_nodes[cluster_first[c]] up to cluster_first[c + 1], the edges
+     * of node n go from edge_first[n] to edge_first[n + 1]. The two nodes
+     * after the last are the start and goal of the search under way.
+     */
+    int cluster_size;
+    int clusters_x;
+    int clusters_y;
+    int num_nodes;
+    int *node_cell;
+    int *cluster_first;
+    int *cluster_nodes;
+    int *edge_first;
+    int *edge_to;
+    float *edge_cost;
+
+    float *node_g;
+    int *node_parent;
+    unsigned int *node_seen;
+    unsigned int *node_closed;
+    unsigned int node_search;
+    float *start_cost;
+    float *goal_cost;
+
+    int expansions;
+    int cache_hits;
+};
+
+PATHFINDER *path_create (const WORLD *world, const TILED_MAP *map, unsigned int mask);
+bool path_walkable (const PATHFINDER *paths, int x, int y);
+void path_request (PATHFINDER *paths, PATH *path, VECTOR2D from, VECTOR2D to);
+void path_cancel (PATHFINDER *paths, PATH *path);
+int path_update (PATHFINDER *paths, int budget);
+void path_free (PATHFINDER *paths);
+void path_init (PATH *path, int owner);
+bool path_next (PATHFINDER *paths, PATH *path, VECTOR2D position, float limit, VECTOR2D *waypoint);
+void path_clear (PATH *path);
+
+#endif
@@ -0,0 +1,36 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+#ifndef _pipeline_h_
+#define _pipeline_h_
+
+#include "utils.h"
+
+#include <allegro5/allegro.h>
+
+typedef struct PIPELINE PIPELINE;
+
+typedef void (*PIPELINE_FN) (void *data);
+
+/*
+ * A thread that runs fn once per pipeline_start, while the caller goes
+ * on with other work until pipeline_wait. busy is guarded by mutex.
+ */
+struct PIPELINE
+{
+    ALLEGRO_THREAD *thread;
+    ALLEGRO_MUTEX *mutex;
+    ALLEGRO_COND *cond;
+    PIPELINE_FN fn;
+    void *data;
+    bool busy;
+    bool stopping;
+};
+
+PIPELINE *pipeline_create (PIPELINE_FN fn, void *data);
+void pipeline_start (PIPELINE *pipeline);
+void pipeline_wait (PIPELINE *pipeline);
+void pipeline_free (PIPELINE *pipeline);
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+#ifndef _pool_h_
+#define _pool_h_
+
+#include "utils.h"
+
+#include <stddef.h>
+
+typedef struct POOL POOL;
+
+/*
+ * Handles pack an index in the low HANDLE_INDEX_BITS and the generation
+ * of that index above them. The generation changes every time the index
+ * is released, so a handle kept past its object no longer matches.
+ */
+#define HANDLE_INDEX_BITS 20
+#define HANDLE_INDEX_MASK ((1 << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GENERATION_MASK 0x7FF
+#define HANDLE_INVALID -1
+
+static inline int handle_make (int index, int generation)
+{
+    return ((generation & HANDLE_GENERATION_MASK) << HANDLE_INDEX_BITS) | index;
+}
+
+static inline int handle_index (int handle)
+{
+    return handle & HANDLE_INDEX_MASK;
+}
+
+static inline int handle_generation (int handle)
+{
+    return (handle >> HANDLE_INDEX_BITS) & HANDLE_GENERATION_MASK;
+}
+
+/*
+ * Objects of one size in chunks of chunk_size, never moved once placed.
+ * Released objects go on a free list threaded through their headers.
+ */
+struct POOL
+{
+    size_t item_size;
+    size_t stride;
+    int chunk_size;
+    char **chunks;
+    int num_chunks;
+    int free_head;
+    int num_items;
+};
+
+POOL *pool_create (size_t item_size, int chunk_size);
+void *pool_alloc (POOL *pool, int *handle);
+void pool_release (POOL *pool, void *item);
+void *pool_get (const POOL *pool, int handle);
+int pool_handle (const POOL *pool, const void *item);
+int pool_capacity (const POOL *pool);
+void *pool_at (const POOL *pool, int index);
+void pool_free (POOL *pool);
+
+#endif
@@ -5,10 +5,12 @@
 #ifndef _scene_h_
 #define _scene_h_
 
-#include "aabbtree.h"
+#include "actors.h"
+#include "pathfind.h"
 #include "tiled.h"
 #include "sprite.h"
 #include "utils.h"
+#include "world.h"
 
 typedef struct SCENE SCENE;
 typedef struct SCENES SCENES;
@@ -19,13 +21,15 @@ struct SCENE {
     char *map_filename;
     char *npc_layer_name;
     char *collision_layer_name;
+    char *collision_property;
     char *portal_layer_name;
+    char *trigger_layer_name;
     TILED_MAP *map;
-    LIST *npcs;
+    POOL *npc_pool;
+    ACTORS *actors;
     LIST *portals;
-    AABB_TREE *collision_tree;
-    AABB_TREE *portal_tree;
-    AABB_TREE *npc_tree;
+    WORLD *world;
+    PATHFINDER *paths;
 };
 
 struct SCENES {
@@ -37,16 +41,21 @@ struct SCENES {
 struct SCENE_PORTAL {
     char *name;
     char *destiny_portal;
+    SCENE_PORTAL *destiny;
     SCENE *scene;
     VECTOR2D position;
 };
 
 SCENES *scene_load_file (const char *filename);
 SCENE *scene_get (SCENES *scenes, const char *scene_name);
-SCENE *scene_load (SCENE *scene, SCENES *scenes, SPRITES *sprites);
-void scene_load_scenes (SCENES *scenes, SPRITES *sprites);
+SCENE *scene_load (SCENE *scene, SCENES *scenes, SPRITES *sprites, JOBS *jobs);
+void scene_load_scenes (SCENES *scenes, SPRITES *sprites, JOBS *jobs);
 SCENE *scene_unload (SCENE *scene);
+int scene_spawn_npc (SCENE *scene, SPRITE *sprite, int action, float *points, int num_points);
+void scene_despawn_npc (SCENE *scene, int handle);
+SPRITE_NPC *scene_get_npc (const SCENE *scene, int handle);
 void scene_load_portals (SCENE *scene, SCENES *scenes, const char *layer_name);
+void scene_link_portals (SCENES *scenes);
 SCENE_PORTAL *scene_get_portal (SCENES *scenes, const char *portal_name);
 void scene_free (SCENES *scenes);
 
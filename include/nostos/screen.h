@@ -20,6 +20,7 @@ typedef struct SCREEN {
     float focus_width;
     float focus_height;
     ALLEGRO_COLOR tint;
+    VECTOR2D previous_position;
 } SCREEN;
 
 SCREEN screen_new ();
@@ -27,5 +28,6 @@ void screen_update_size (SCREEN *screen, int width, int height);
 void screen_update (SCREEN *screen, VECTOR2D focus, TILED_MAP *map, float dt);
 void screen_center (SCREEN *screen, VECTOR2D focus, TILED_MAP *map);
 BOX screen_box (SCREEN *screen);
+SCREEN screen_interpolate (const SCREEN *screen, float alpha);
 
 #endif
@@ -0,0 +1,37 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+#ifndef _shape_h_
+#define _shape_h_
+
+#include "box.h"
+#include "debugdraw.h"
+#include "tiled.h"
+
+typedef struct SHAPE SHAPE;
+
+/*
+ * Convex collision shape: a polygon, or a segment with a radius (capsule).
+ * Points and edge normals are stored right after the struct.
+ */
+struct SHAPE
+{
+    VECTOR2D *points;
+    VECTOR2D *normals;
+    int num_points;
+    int num_normals;
+    float radius;
+    BOX bounds;
+    void *data;
+};
+
+SHAPE *shape_polygon (const float *points, int num_points, void *data);
+SHAPE *shape_capsule (VECTOR2D p1, VECTOR2D p2, float radius, void *data);
+SHAPE **shape_load (TILED_MAP *map, const char *layer_name, int *num_shapes);
+bool shape_overlap (const SHAPE *shape, BOX b, BOX_HIT *hit);
+bool shape_sweep (BOX b, VECTOR2D delta, const SHAPE *shape, BOX_HIT *hit);
+void shape_free (SHAPE *shape);
+void shape_debug_draw (const SHAPE *shape, DEBUG_DRAW *dd, ALLEGRO_COLOR color);
+
+#endif
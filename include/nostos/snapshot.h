@@ -0,0 +1,57 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+#ifndef _snapshot_h_
+#define _snapshot_h_
+
+#include "debugdraw.h"
+#include "screen.h"
+#include "sprite.h"
+#include "spritebatch.h"
+#include "tiled.h"
+#include "ui.h"
+#include "utils.h"
+
+typedef struct RENDER_SNAPSHOT RENDER_SNAPSHOT;
+typedef struct SNAPSHOT_SPRITE SNAPSHOT_SPRITE;
+
+struct SNAPSHOT_SPRITE
+{
+    SPRITE *sprite;
+    int animation;
+    int frame;
+    VECTOR2D position;
+};
+
+/*
+ * Everything a frame is drawn from, written by the simulation and read by
+ * the renderer without touching simulation state: the interpolated view,
+ * the map, the visible sprites with their frames, the debug lines, where
+ * the selection arrow points and the last dialog change.
+ */
+struct RENDER_SNAPSHOT
+{
+    SCREEN view;
+    TILED_MAP *map;
+    VECTOR sprites;
+    DEBUG_DRAW *debug_draw;
+
+    bool show_arrow;
+    VECTOR2D arrow;
+
+    bool dialog_changed;
+    ALLEGRO_USTR *dialog_speaker;
+    ALLEGRO_USTR *dialog_text;
+};
+
+void snapshot_init (RENDER_SNAPSHOT *snapshot);
+void snapshot_begin (RENDER_SNAPSHOT *snapshot);
+void snapshot_add_actor (RENDER_SNAPSHOT *snapshot, const SPRITE_ACTOR *actor, float alpha);
+void snapshot_add_npc (RENDER_SNAPSHOT *snapshot, const SPRITE_NPC *npc, float alpha);
+void snapshot_set_dialog (RENDER_SNAPSHOT *snapshot, const char *speaker, const char *text);
+void snapshot_batch (RENDER_SNAPSHOT *snapshot, SPRITE_BATCH *batch);
+void snapshot_apply_ui (RENDER_SNAPSHOT *snapshot, UI *ui);
+void snapshot_free (RENDER_SNAPSHOT *snapshot);
+
+#endif
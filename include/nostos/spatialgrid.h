@@ -0,0 +1,33 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+#ifndef _spatialgrid_h_
+#define _spatialgrid_h_
+
+#include "aabbtree.h"
+#include "box.h"
+
+typedef struct SPATIAL_GRID SPATIAL_GRID;
+
+struct SPATIAL_GRID
+{
+    VECTOR2D origin;
+    float cell_size;
+    int width, height;
+    int *cell_start;
+    int *cell_boxes;
+    BOX *boxes;
+    int num_boxes;
+};
+
+SPATIAL_GRID *grid_build (BOX *boxes, int num_boxes, float cell_size);
+bool grid_collide (const SPATIAL_GRID *grid, const BOX *box);
+void grid_collide_fill (const SPATIAL_GRID *grid, const BOX *box, AABB_COLLISIONS *collisions);
+void grid_query_visit (const SPATIAL_GRID *grid, const BOX *box, AABB_VISIT_FN visit, void *user);
+void grid_query_segment (const SPATIAL_GRID *grid, VECTOR2D from, VECTOR2D to, AABB_VISIT_FN visit, void *user);
+void grid_free (SPATIAL_GRID *grid);
+void grid_debug_draw (const SPATIAL_GRID *grid, DEBUG_DRAW *dd);
+void grid_draw (SPATIAL_GRID *grid, SCREEN *s, ALLEGRO_COLOR color);
+
+#endif
@@ -9,6 +9,9 @@
 #include "screen.h"
 #include "tiled.h"
 #include "box.h"
+#include "jobs.h"
+#include "pathfind.h"
+#include "spritebatch.h"
 #include "utils.h"
 
 enum {
@@ -70,19 +73,36 @@ typedef struct SPRITE_ACTOR {
     float movement_accel;
     float movement_deaccel;
     float movement_max;
+    VECTOR2D previous_position;
 } SPRITE_ACTOR;
 
+typedef struct ACTORS ACTORS;
+
+/*
+ * What an NPC needs to decide where to go. Its position, movement and
+ * animation live in the scene's ACTORS under handle, its box in the
+ * scene's world under proxy. With paths set, trips between random points
+ * follow route; offset goes from the position to the box center, which is
+ * what routes are planned for.
+ */
 typedef struct SPRITE_NPC {
-    SPRITE_ACTOR actor;
+    ACTORS *actors;
+    int handle;
+    int proxy;
     int action;
     float *points;
     int num_points;
     int current_point;
     int next_point;
     int direction;
+    float movement_max;
     bool paused;
     float pause_duration;
     float current_pause_duration;
+    uint32_t random;
+    PATHFINDER *paths;
+    PATH route;
+    VECTOR2D offset;
 } SPRITE_NPC;
 
 typedef struct SPRITES {
@@ -97,14 +117,24 @@ void sprite_move_down (void *sprite, float dt);
 void sprite_move_up (void *sprite, float dt);
 void sprite_move_left (void *sprite, float dt);
 void sprite_move_right (void *sprite, float dt);
+int sprite_select_animation (VECTOR2D movement, int current);
 void sprite_update (SPRITE_ACTOR *actor, float dt, float t);
+int sprite_update_npcs (JOBS *jobs, ACTORS *actors, float dt, float t, double budget);
+void sprite_draw_frame (SPRITE *sprite, int animation, int frame, VECTOR2D position, SCREEN *screen);
+void sprite_batch_frame (SPRITE_BATCH *batch, SPRITE *sprite, int animation, int frame, VECTOR2D position,
+                         SCREEN *screen);
 void sprite_draw (SPRITE_ACTOR *actor, SCREEN *screen);
+void sprite_batch_actor (SPRITE_BATCH *batch, SPRITE_ACTOR *actor, float alpha, SCREEN *screen);
+void sprite_batch_npc (SPRITE_BATCH *batch, const SPRITE_NPC *npc, float alpha, SCREEN *screen);
 SPRITE_ACTOR *sprite_new_actor (SPRITES *sprites, const char *filename);
 SPRITES *sprite_load_sprites (const char *filename);
-LIST *sprite_load_npcs (SPRITES *sprites, TILED_MAP *map, const char *layer_name);
+int sprite_npc_action (const char *name);
+void sprite_init_npc (SPRITE_NPC *npc, ACTORS *actors, SPRITE *sprite, int action, float *points, int num_points);
+void sprite_clear_npc (SPRITE_NPC *npc);
+BOX sprite_npc_box (const SPRITE_NPC *npc);
+VECTOR2D sprite_npc_position (const SPRITE_NPC *npc, float alpha);
 void sprite_center (SPRITE_ACTOR *actor, VECTOR2D *v);
 void sprite_free (SPRITES *sprites);
 void sprite_free_actor (void *value, void *user_data);
-void sprite_free_npc (void *value, void *user_data);
 
 #endif
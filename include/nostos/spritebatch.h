@@ -0,0 +1,41 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+#ifndef _spritebatch_h_
+#define _spritebatch_h_
+
+#include "utils.h"
+
+#include <stdint.h>
+#include <allegro5/allegro.h>
+#include <allegro5/allegro_primitives.h>
+
+typedef struct SPRITE_BATCH SPRITE_BATCH;
+
+/*
+ * Quads collected during a frame with their depth, drawn back to front
+ * when flushed. Consecutive quads on the same texture share one
+ * al_draw_indexed_prim. The counters describe the last flushed frame.
+ */
+struct SPRITE_BATCH
+{
+    VECTOR items;
+    VECTOR vertices;
+    VECTOR indices;
+    int *order;
+    int *scratch;
+    int order_capacity;
+
+    int num_quads;
+    int num_vertices;
+    int num_draw_calls;
+};
+
+SPRITE_BATCH *sprite_batch_create ();
+void sprite_batch_begin (SPRITE_BATCH *batch);
+void sprite_batch_add (SPRITE_BATCH *batch, ALLEGRO_BITMAP *bitmap, const ALLEGRO_VERTEX *quad, float depth);
+void sprite_batch_flush (SPRITE_BATCH *batch);
+void sprite_batch_free (SPRITE_BATCH *batch);
+
+#endif
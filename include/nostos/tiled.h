@@ -6,6 +6,9 @@
 #define _tiled_h_
 
 #include "utils.h"
+#include "spritebatch.h"
+
+#include <stdint.h>
 
 typedef struct TILED_MAP TILED_MAP;
 typedef struct TILED_LAYER TILED_LAYER;
@@ -43,6 +46,17 @@ enum TILED_OBJECT_TYPE {
     OBJECT_TYPE_GEOM,
 };
 
+/* Set on a gid when its tile has the property of the same name. */
+enum TILED_TILE_FLAG {
+    TILE_FLAG_SOLID   = 1 << 0,
+    TILE_FLAG_WATER   = 1 << 1,
+    TILE_FLAG_SLOW    = 1 << 2,
+    TILE_FLAG_TRIGGER = 1 << 3,
+    TILE_FLAG_OPAQUE  = 1 << 4
+};
+
+#define TILED_NUM_FLAGS 5
+
 
 struct TILED_MAP {
     int width;
@@ -57,6 +71,8 @@ struct TILED_MAP {
     LIST *layers_back;
     LIST *layers_fore;
     LIST *strings;
+    unsigned int *tile_flags;
+    int num_gids;
 };
 
 struct TILED_OBJECT {
@@ -99,6 +115,9 @@ struct TILED_LAYER {
 struct TILED_LAYER_TILE {
     TILED_LAYER layer;
     TILED_TILE ***tiles;
+    unsigned int flags;
+    uint32_t *flag_bits;
+    int flag_words;
 };
 
 struct TILED_LAYER_OBJECT {
@@ -138,10 +157,14 @@ struct TILED_TILE {
 
 TILED_MAP* tiled_load_tmx_file (const char *filename);
 TILED_LAYER* tiled_layer_by_name (TILED_MAP *map, const char *name);
+unsigned int tiled_flag_by_name (const char *name);
+unsigned int tiled_cell_flags (TILED_MAP *map, TILED_LAYER *layer, int x, int y);
+unsigned int tiled_rect_flags (TILED_MAP *map, TILED_LAYER *layer, int x, int y, int w, int h);
 void tiled_draw_map (TILED_MAP *map, ALLEGRO_COLOR tint, float sx, float sy, float sw, float sh, float dx, float dy, int flags);
 void tiled_draw_layers (LIST *layers, ALLEGRO_COLOR tint, float sx, float sy, float sw, float sh, float dx, float dy, int flags);
 void tiled_draw_map_back (TILED_MAP *map, ALLEGRO_COLOR tint, float sx, float sy, float sw, float sh, float dx, float dy, int flags);
 void tiled_draw_map_fore (TILED_MAP *map, ALLEGRO_COLOR tint, float sx, float sy, float sw, float sh, float dx, float dy, int flags);
+void tiled_batch_objects (TILED_MAP *map, SPRITE_BATCH *batch, ALLEGRO_COLOR tint, float sx, float sy, float sw, float sh);
 void tiled_free_map (TILED_MAP *map);
 
 #endif
@@ -0,0 +1,47 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+#ifndef _trigger_h_
+#define _trigger_h_
+
+#include "aabbtree.h"
+#include "world.h"
+#include "utils.h"
+
+typedef struct TRIGGER_SET TRIGGER_SET;
+typedef struct TRIGGER_EVENT TRIGGER_EVENT;
+
+enum TRIGGER_EVENT_TYPE {
+    TRIGGER_ENTER,
+    TRIGGER_STAY,
+    TRIGGER_EXIT
+};
+
+struct TRIGGER_EVENT
+{
+    int type;
+    unsigned int category;
+    void *data;
+};
+
+/*
+ * Trigger proxies one actor was overlapping on the last update, sorted by
+ * address, and the events the last update produced.
+ */
+struct TRIGGER_SET
+{
+    VECTOR inside;
+    VECTOR current;
+    VECTOR events;
+    unsigned int mask;
+    bool report_stay;
+};
+
+void trigger_init_set (TRIGGER_SET *set, unsigned int mask, bool report_stay);
+int trigger_update (TRIGGER_SET *set, const AABB_COLLISIONS *collisions);
+void trigger_reset (TRIGGER_SET *set, const AABB_COLLISIONS *collisions);
+TRIGGER_EVENT *trigger_event (TRIGGER_SET *set, int index);
+void trigger_free_set (TRIGGER_SET *set);
+
+#endif
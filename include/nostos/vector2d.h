@@ -5,23 +5,93 @@
 #ifndef _vector2d_h_
 #define _vector2d_h_
 
+#include <math.h>
+
 typedef struct VECTOR2D {
     float x, y;
 } VECTOR2D;
 
-VECTOR2D vadd (VECTOR2D v1, VECTOR2D v2);
-VECTOR2D vsub (VECTOR2D v1, VECTOR2D v2);
-VECTOR2D vmul (VECTOR2D v1, VECTOR2D v2);
-VECTOR2D vmulf (VECTOR2D v1, float f);
-VECTOR2D vdiv (VECTOR2D v1, VECTOR2D v2);
-VECTOR2D vdivf (VECTOR2D v1, float f);
-float vsqlen (VECTOR2D v);
-float vlen (VECTOR2D v);
-float vdot (VECTOR2D v1, VECTOR2D v2);
-VECTOR2D vnormalize (VECTOR2D v);
-VECTOR2D vabs (VECTOR2D v);
-float vdistance (VECTOR2D v1, VECTOR2D v2);
-float vsqdistance (VECTOR2D v1, VECTOR2D v2);
+/*
+ * The arithmetic is defined here so the collision and update loops get it
+ * inlined instead of paying a call per operation.
+ */
+static inline VECTOR2D vadd (VECTOR2D v1, VECTOR2D v2)
+{
+    return (VECTOR2D) { .x = v1.x + v2.x, .y = v1.y + v2.y };
+}
+
+static inline VECTOR2D vsub (VECTOR2D v1, VECTOR2D v2)
+{
+    return (VECTOR2D) { .x = v1.x - v2.x, .y = v1.y - v2.y };
+}
+
+static inline VECTOR2D vmul (VECTOR2D v1, VECTOR2D v2)
+{
+    return (VECTOR2D) { .x = v1.x * v2.x, .y = v1.y * v2.y };
+}
+
+static inline VECTOR2D vmulf (VECTOR2D v1, float f)
+{
+    return (VECTOR2D) { .x = v1.x * f, .y = v1.y * f };
+}
+
+static inline VECTOR2D vdiv (VECTOR2D v1, VECTOR2D v2)
+{
+    return (VECTOR2D) { .x = v1.x / v2.x, .y = v1.y / v2.y };
+}
+
+static inline VECTOR2D vdivf (VECTOR2D v1, float f)
+{
+    float m = 1.0f / f;
+    return (VECTOR2D) { .x = v1.x * m, .y = v1.y * m };
+}
+
+static inline float vsqlen (VECTOR2D v)
+{
+    return v.x * v.x + v.y * v.y;
+}
+
+static inline float vlen (VECTOR2D v)
+{
+    return sqrtf (vsqlen (v));
+}
+
+static inline float vdot (VECTOR2D v1, VECTOR2D v2)
+{
+    return v1.x * v2.x + v1.y * v2.y;
+}
+
+static inline VECTOR2D vnormalize (VECTOR2D v)
+{
+    float len = vlen (v);
+    if (!len) return v;
+
+    float div = 1.0f / len;
+    return (VECTOR2D) { .x = v.x * div, .y = v.y * div };
+}
+
+static inline VECTOR2D vabs (VECTOR2D v)
+{
+    return (VECTOR2D) { .x = fabsf (v.x), .y = fabsf (v.y) };
+}
+
+static inline float vdistance (VECTOR2D v1, VECTOR2D v2)
+{
+    return vlen (vsub (v1, v2));
+}
+
+static inline float vsqdistance (VECTOR2D v1, VECTOR2D v2)
+{
+    return vsqlen (vsub (v1, v2));
+}
+
+/* a at f = 0, b at f = 1. */
+static inline VECTOR2D vlerp (VECTOR2D a, VECTOR2D b, float f)
+{
+    return (VECTOR2D) { .x = a.x + (b.x - a.x) * f, .y = a.y + (b.y - a.y) * f };
+}
+
+void vmuladd_steps_batch (VECTOR2D *out, const VECTOR2D *v, float f, const int *steps, int num);
 void vdebug (VECTOR2D v);
 
 #endif
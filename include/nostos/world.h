@@ -0,0 +1,75 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+#ifndef _world_h_
+#define _world_h_
+
+#include "aabbtree.h"
+#include "broadphase.h"
+#include "pool.h"
+#include "shape.h"
+#include "tiled.h"
+#include "utils.h"
+
+typedef struct WORLD WORLD;
+typedef struct WORLD_PROXY WORLD_PROXY;
+
+enum WORLD_CATEGORY {
+    WORLD_SOLID   = 1 << 0,
+    WORLD_PORTAL  = 1 << 1,
+    WORLD_TRIGGER = 1 << 2,
+    WORLD_NPC     = 1 << 3
+};
+
+#define WORLD_ALL (~0u)
+
+struct WORLD_PROXY
+{
+    unsigned int category;
+    void *data;
+    SHAPE *shape;
+    int handle;
+};
+
+struct WORLD
+{
+    VECTOR pending_static;
+    VECTOR shapes;
+    WORLD_PROXY *proxies;
+    int num_proxies;
+    POOL *dynamic_proxies;
+    int num_removed;
+    int num_built;
+    bool dynamics_dirty;
+    BROADPHASE *statics;
+    AABB_TREE *dynamics;
+    unsigned int static_categories;
+    unsigned int dynamic_categories;
+};
+
+WORLD *world_create ();
+void world_add_boxes (WORLD *world, const BOX *boxes, int num_boxes, unsigned int category, bool dynamic);
+int world_add_layer (WORLD *world, TILED_MAP *map, const char *layer_name, unsigned int category);
+void world_add_shapes (WORLD *world, SHAPE **shapes, int num_shapes, unsigned int category);
+int world_add_tiles (WORLD *world, TILED_MAP *map, const char *property, unsigned int category);
+int world_add_dynamic (WORLD *world, BOX box, unsigned int category, int handle);
+void world_remove_dynamic (WORLD *world, int proxy);
+void world_build (WORLD *world, JOBS *jobs);
+void world_refit (WORLD *world, AABB_REFIT_FN refit, void *user);
+void world_query_visit (const WORLD *world, const BOX *box, unsigned int mask, AABB_COLLISIONS *collisions,
+                        AABB_VISIT_FN visit, void *user);
+int world_collide_fill (const WORLD *world, const BOX *box, unsigned int mask, AABB_COLLISIONS *collisions);
+bool world_sweep (const WORLD *world, const BOX *box, VECTOR2D delta, unsigned int mask, BOX_HIT *hit);
+VECTOR2D world_move (const WORLD *world, const BOX *box, VECTOR2D delta, unsigned int mask,
+                     AABB_COLLISIONS *collisions, VECTOR2D *blocked);
+bool world_line_of_sight (const WORLD *world, VECTOR2D from, VECTOR2D to, unsigned int mask);
+int world_query_nearest (const WORLD *world, VECTOR2D point, int k, float max_distance, unsigned int mask,
+                         AABB_COLLISIONS *collisions);
+void world_free (WORLD *world);
+WORLD_PROXY *world_proxy (const BOX *box);
+void *world_proxy_data (const BOX *box);
+int world_proxy_handle (const BOX *box);
+void world_debug_draw (const WORLD *world, DEBUG_DRAW *dd);
+
+#endif
@@ -7,6 +7,14 @@
 #include "nostos/utils.h"
 
 #include <float.h>
+#include <stdint.h>
+#include <string.h>
+
+#define CACHE_MARGIN 8.0f
+#define LBVH_THRESHOLD 1024
+#define LBVH_GRAIN 1024
+#define RADIX_BLOCK_SIZE 4096
+#define RADIX_MAX_BLOCKS 64
 
 typedef struct AUX_NODE {
     BOX aabb;
@@ -37,13 +45,6 @@ static inline int classify_aabb (BOX *box, int axis, int middle)
         return 1;
 }
 
-static inline void aabb_debug_auxnode (AUX_NODE *node)
-{
-    debug ("AuxNode");
-    box_debug (node->aabb);
-    debug ("Left: %d, Right: %d", node->left, node->right);
-}
-
 static inline void process_node (AUX_NODE *node, VECTOR *auxnodes, int max_depth)
 {
     int size = _al_vector_size (&node->boxes);
@@ -72,7 +73,6 @@ static inline void process_node (AUX_NODE *node, VECTOR *auxnodes, int max_depth
     }
 
     node->aabb = box_from_points (bmin, bmax);
-    box_debug (node->aabb);
 
     VECTOR2D center = node->aabb.center;
     VECTOR2D ext = node->aabb.extent;
@@ -89,11 +89,6 @@ static inline void process_node (AUX_NODE *node, VECTOR *auxnodes, int max_depth
     VECTOR2D bboxmin = vsub (center, ext);
     VECTOR2D bboxmax = vadd (center, ext);
 
-    debug ("BBox Min");
-    vdebug (bboxmin);
-    debug ("BBox Max");
-    vdebug (bboxmax);
-
     AUX_NODE *left = NULL;
     AUX_NODE *right = NULL;
 
@@ -111,43 +106,33 @@ static inline void process_node (AUX_NODE *node, VECTOR *auxnodes, int max_depth
         }
 
         if (res == 0) {
-            debug ("Left");
             if (!left) {
                 left = new_aux_node ();
-                debug ("Dividing");
                 if (axis == 0)
                     left->aabb = box_from_points (bboxmin, (VECTOR2D){(bboxmin.x + bboxmax.x) / 2.0f, bboxmax.y});
                 else
                     left->aabb = box_from_points (bboxmin, (VECTOR2D){bboxmax.x, (bboxmin.y + bboxmax.y) / 2.0f});
-                box_debug (left->aabb);
             }
             BOX aabb = left->aabb;
             if (axis == 0 && max > (aabb.center.x + aabb.extent.x))
                 left->aabb = box_from_points (bboxmin, (VECTOR2D){max, bboxmax.y});
             else if (axis == 1 && max > (aabb.center.y + aabb.extent.y))
                 left->aabb = box_from_points (bboxmin, (VECTOR2D){bboxmax.x, max});
-            debug ("Final");
-            box_debug (left->aabb);
             vector_add (&left->boxes, box);
         }
         else {
-            debug ("Right");
             if (!right) {
                 right = new_aux_node ();
-                debug ("Dividing");
                 if (axis == 0)
                     right->aabb = box_from_points ((VECTOR2D){(bboxmin.x + bboxmax.x) / 2.0f, bboxmin.y}, bboxmax);
                 else
                     right->aabb = box_from_points ((VECTOR2D){bboxmin.x, (bboxmin.y + bboxmax.y) / 2.0f}, bboxmax);
-                box_debug (right->aabb);
             }
             BOX aabb = right->aabb;
             if (axis == 0 && min < (aabb.center.x - aabb.extent.x))
                 right->aabb = box_from_points ((VECTOR2D){min, bboxmin.y}, bboxmax);
             else if (axis == 1 && min < (aabb.center.y - aabb.extent.y))
                 right->aabb = box_from_points ((VECTOR2D){bboxmin.x, min}, bboxmax);
-            debug ("Final");
-            box_debug (right->aabb);
             vector_add (&right->boxes, box);
         }
     }
@@ -206,6 +191,7 @@ AABB_TREE *aabb_build_tree (BOX *boxes, int num_boxes, int max_depth)
 {
     AABB_TREE *tree = al_malloc (sizeof (AABB_TREE));
     tree->max_depth = max_depth;
+    tree->use_cache = true;
 
     debug ("num boxes: %d, max depth: %d", num_boxes, max_depth);
 
@@ -238,14 +224,13 @@ AABB_TREE *aabb_build_tree (BOX *boxes, int num_boxes, int max_depth)
 
     for (int i = 0; i < size; i++) {
         AUX_NODE *node = _al_vector_ref (&auxnodes, i);
-        aabb_debug_auxnode (node);
         if (node->left == -1 && node->right == -1)
             ln[i] = num_leafs++;
         else
             ln[i] = num_nodes++;
     }
 
-    tree->root = al_malloc (num_nodes * sizeof (AABB_NODE));
+    tree->root = al_malloc (MAX (num_nodes, 1) * sizeof (AABB_NODE));
     tree->leafs = al_malloc (num_leafs * sizeof (AABB_LEAF));
     tree->num_nodes = num_nodes;
     tree->num_leafs = num_leafs;
@@ -258,30 +243,22 @@ AABB_TREE *aabb_build_tree (BOX *boxes, int num_boxes, int max_depth)
         if (auxnode->left == -1 && auxnode->right == -1) {
             int i_leaf = ln[i];
             AABB_LEAF *leaf = &tree->leafs[i_leaf];
-            debug ("New leaf");
             leaf->node.aabb = auxnode->aabb;
-            debug ("AABB");
-            box_debug (leaf->node.aabb);
             leaf->node.left = NULL;
             leaf->node.right = NULL;
             leaf->num_boxes = _al_vector_size (&auxnode->boxes);
+            leaf->capacity = leaf->num_boxes;
             leaf->boxes = al_malloc (leaf->num_boxes * sizeof (BOX));
-            debug ("Boxes");
             for (int j = 0; j < leaf->num_boxes; j++) {
                 BOX *box = &leaf->boxes[j];
                 *box = *(BOX *)_al_vector_ref (&auxnode->boxes, j);
-                box_debug (leaf->boxes[j]);
             }
         } else {
             int i_node = ln[i];
             AABB_NODE *node = &tree->root[i_node];
-            debug ("New node");
             node->aabb = auxnode->aabb;
-            debug ("AABB");
-            box_debug (node->aabb);
 
             if (auxnode->left != -1) {
-                debug ("Left OK");
                 AUX_NODE *left_node = _al_vector_ref (&auxnodes, auxnode->left);
                 if (left_node->left == -1 && left_node->right == -1) {
                     node->left = (AABB_NODE*) &tree->leafs[ln[auxnode->left]];
@@ -289,12 +266,10 @@ AABB_TREE *aabb_build_tree (BOX *boxes, int num_boxes, int max_depth)
                     node->left = &tree->root[ln[auxnode->left]];
                 }
             } else {
-                debug ("Left NULL");
                 node->left = NULL;
             }
 
             if (auxnode->right != -1) {
-                debug ("Right OK");
                 AUX_NODE *right_node = _al_vector_ref (&auxnodes, auxnode->right);
                 if (right_node->left == -1 && right_node->right == -1) {
                     node->right = (AABB_NODE*) &tree->leafs[ln[auxnode->right]];
@@ -302,12 +277,24 @@ AABB_TREE *aabb_build_tree (BOX *boxes, int num_boxes, int max_depth)
                     node->right = &tree->root[ln[auxnode->right]];
                 }
             } else {
-                debug ("Right NULL");
                 node->right = NULL;
             }
         }
     }
 
+    /* Everything fit in one leaf, give it an internal node above it. */
+    if (num_nodes == 0) {
+        AABB_LEAF *leaf = &tree->leafs[0];
+        leaf->node.aabb = leaf->boxes[0];
+        for (int j = 1; j < leaf->num_boxes; j++)
+            leaf->node.aabb = box_merge (leaf->node.aabb, leaf->boxes[j]);
+
+        tree->root->aabb = leaf->node.aabb;
+        tree->root->left = (AABB_NODE*) &tree->leafs[0];
+        tree->root->right = NULL;
+        tree->num_nodes = 1;
+    }
+
     for (int i = 0; i < size; i++) {
         auxnode = _al_vector_ref (&auxnodes, i);
         _al_vector_free (&auxnode->boxes);
@@ -319,16 +306,325 @@ AABB_TREE *aabb_build_tree (BOX *boxes, int num_boxes, int max_depth)
     return tree;
 }
 
-AABB_TREE *aabb_load_tree (TILED_MAP *map, const char *layer_name)
+/*
+ * Linear BVH (Karras, "Maximizing Parallelism in the Construction of BVHs,
+ * Octrees, and k-d Trees"). Box centers are mapped to 32 bit Morton codes
+ * and radix sorted, runs of leaf_size boxes become leafs and the internal
+ * nodes are emitted from the sorted codes in linear time.
+ */
+
+typedef struct MORTON_KEY {
+    uint32_t code;
+    int index;
+} MORTON_KEY;
+
+static inline uint32_t expand_bits (uint32_t v)
+{
+    v &= 0x0000ffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+static inline int clz32 (uint32_t v)
+{
+#ifdef __GNUC__
+    return v ? __builtin_clz (v) : 32;
+#else
+    int n = 32;
+    while (v) {
+        v >>= 1;
+        n--;
+    }
+    return n;
+#endif
+}
+
+/*
+ * One pass of the radix sort, keys cut in blocks that count and scatter
+ * their own digits. offsets[b][d] is where block b writes its first key
+ * with digit d, so the scatter stays stable.
+ */
+typedef struct RADIX_PASS {
+    const MORTON_KEY *keys;
+    MORTON_KEY *out;
+    int num_keys;
+    int block_size;
+    int shift;
+    int (*offsets)[256];
+} RADIX_PASS;
+
+static void radix_count (void *data, int begin, int end)
+{
+    RADIX_PASS *pass = data;
+
+    for (int b = begin; b < end; b++) {
+        int *count = pass->offsets[b];
+        int last = MIN ((b + 1) * pass->block_size, pass->num_keys);
+
+        memset (count, 0, 256 * sizeof (int));
+        for (int i = b * pass->block_size; i < last; i++)
+            count[(pass->keys[i].code >> pass->shift) & 0xff]++;
+    }
+}
+
+static void radix_scatter (void *data, int begin, int end)
+{
+    RADIX_PASS *pass = data;
+
+    for (int b = begin; b < end; b++) {
+        int *offset = pass->offsets[b];
+        int last = MIN ((b + 1) * pass->block_size, pass->num_keys);
+
+        for (int i = b * pass->block_size; i < last; i++)
+            pass->out[offset[(pass->keys[i].code >> pass->shift) & 0xff]++] = pass->keys[i];
+    }
+}
+
+static void radix_sort (JOBS *jobs, MORTON_KEY *keys, MORTON_KEY *tmp, int n)
+{
+    int num_blocks = CLAMP (1, (n + RADIX_BLOCK_SIZE - 1) / RADIX_BLOCK_SIZE, RADIX_MAX_BLOCKS);
+    RADIX_PASS pass;
+
+    pass.num_keys = n;
+    pass.block_size = (n + num_blocks - 1) / num_blocks;
+    pass.offsets = al_malloc (num_blocks * sizeof (*pass.offsets));
+
+    for (int shift = 0; shift < 32; shift += 8) {
+        pass.keys = keys;
+        pass.out = tmp;
+        pass.shift = shift;
+
+        jobs_parallel_for (jobs, num_blocks, 1, radix_count, &pass);
+
+        int offset = 0;
+        for (int d = 0; d < 256; d++) {
+            for (int b = 0; b < num_blocks; b++) {
+                int count = pass.offsets[b][d];
+                pass.offsets[b][d] = offset;
+                offset += count;
+            }
+        }
+
+        jobs_parallel_for (jobs, num_blocks, 1, radix_scatter, &pass);
+
+        MORTON_KEY *swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+
+    al_free (pass.offsets);
+}
+
+/* Length of the common prefix of two leaf keys, ties broken by index. */
+static inline int common_prefix (const uint32_t *codes, int n, int i, int j)
+{
+    if (j < 0 || j >= n)
+        return -1;
+
+    if (codes[i] == codes[j])
+        return 32 + clz32 ((uint32_t)(i ^ j));
+
+    return clz32 (codes[i] ^ codes[j]);
+}
+
+static void lbvh_emit_node (AABB_TREE *tree, const uint32_t *codes, int n, int i)
+{
+    int d = common_prefix (codes, n, i, i + 1) - common_prefix (codes, n, i, i - 1) > 0 ? 1 : -1;
+    int min_prefix = common_prefix (codes, n, i, i - d);
+
+    int lmax = 2;
+    while (common_prefix (codes, n, i, i + lmax * d) > min_prefix)
+        lmax *= 2;
+
+    int l = 0;
+    for (int t = lmax / 2; t >= 1; t /= 2) {
+        if (common_prefix (codes, n, i, i + (l + t) * d) > min_prefix)
+            l += t;
+    }
+
+    int j = i + l * d;
+    int node_prefix = common_prefix (codes, n, i, j);
+
+    int split = 0;
+    int t = l;
+    do {
+        t = (t + 1) / 2;
+        if (common_prefix (codes, n, i, i + (split + t) * d) > node_prefix)
+            split += t;
+    } while (t > 1);
+
+    int gamma = i + split * d + MIN (d, 0);
+    AABB_NODE *node = &tree->root[i];
+
+    if (MIN (i, j) == gamma)
+        node->left = (AABB_NODE *) &tree->leafs[gamma];
+    else
+        node->left = &tree->root[gamma];
+
+    if (MAX (i, j) == gamma + 1)
+        node->right = (AABB_NODE *) &tree->leafs[gamma + 1];
+    else
+        node->right = &tree->root[gamma + 1];
+}
+
+static BOX lbvh_fit (AABB_NODE *node)
+{
+    if (!node->left && !node->right)
+        return node->aabb;
+
+    node->aabb = lbvh_fit (node->left);
+    if (node->right)
+        node->aabb = box_merge (node->aabb, lbvh_fit (node->right));
+
+    return node->aabb;
+}
+
+/* What the parallel stages of the LBVH build share. */
+typedef struct LBVH_BUILD {
+    AABB_TREE *tree;
+    const BOX *boxes;
+    MORTON_KEY *keys;
+    uint32_t *codes;
+    VECTOR2D bmin;
+    VECTOR2D scale;
+    int num_boxes;
+    int leaf_size;
+} LBVH_BUILD;
+
+static void lbvh_keys (void *data, int begin, int end)
+{
+    LBVH_BUILD *build = data;
+
+    for (int i = begin; i < end; i++) {
+        uint32_t x = (build->boxes[i].center.x - build->bmin.x) * build->scale.x;
+        uint32_t y = (build->boxes[i].center.y - build->bmin.y) * build->scale.y;
+        build->keys[i].code = expand_bits (x) | (expand_bits (y) << 1);
+        build->keys[i].index = i;
+    }
+}
+
+static void lbvh_leafs (void *data, int begin, int end)
+{
+    LBVH_BUILD *build = data;
+
+    for (int i = begin; i < end; i++) {
+        AABB_LEAF *leaf = &build->tree->leafs[i];
+        int first = i * build->leaf_size;
+
+        leaf->num_boxes = MIN (build->leaf_size, build->num_boxes - first);
+        leaf->capacity = leaf->num_boxes;
+        leaf->boxes = al_malloc (leaf->num_boxes * sizeof (BOX));
+        leaf->node.left = NULL;
+        leaf->node.right = NULL;
+
+        for (int j = 0; j < leaf->num_boxes; j++)
+            leaf->boxes[j] = build->boxes[build->keys[first + j].index];
+
+        leaf->node.aabb = leaf->boxes[0];
+        for (int j = 1; j < leaf->num_boxes; j++)
+            leaf->node.aabb = box_merge (leaf->node.aabb, leaf->boxes[j]);
+
+        build->codes[i] = build->keys[first].code;
+    }
+}
+
+static void lbvh_nodes (void *data, int begin, int end)
+{
+    LBVH_BUILD *build = data;
+
+    for (int i = begin; i < end; i++)
+        lbvh_emit_node (build->tree, build->codes, build->tree->num_leafs, i);
+}
+
+/*
+ * Keys, sort, leafs and internal nodes are split over jobs when given;
+ * only the bounds and the final bottom-up fit run on the calling thread.
+ */
+AABB_TREE *aabb_build_tree_lbvh (JOBS *jobs, BOX *boxes, int num_boxes, int leaf_size)
+{
+    assert (boxes);
+    assert (num_boxes > 0);
+    assert (leaf_size > 0);
+
+    AABB_TREE *tree = al_malloc (sizeof (AABB_TREE));
+    tree->max_depth = leaf_size;
+    tree->use_cache = true;
+
+    VECTOR2D bmin = (VECTOR2D){FLT_MAX, FLT_MAX};
+    VECTOR2D bmax = (VECTOR2D){-FLT_MAX, -FLT_MAX};
+
+    for (int i = 0; i < num_boxes; i++) {
+        bmin.x = MIN (bmin.x, boxes[i].center.x);
+        bmin.y = MIN (bmin.y, boxes[i].center.y);
+        bmax.x = MAX (bmax.x, boxes[i].center.x);
+        bmax.y = MAX (bmax.y, boxes[i].center.y);
+    }
+
+    VECTOR2D size = vsub (bmax, bmin);
+    LBVH_BUILD build;
+
+    build.tree = tree;
+    build.boxes = boxes;
+    build.num_boxes = num_boxes;
+    build.leaf_size = leaf_size;
+    build.bmin = bmin;
+    build.scale = (VECTOR2D){size.x > 0 ? 65535.0f / size.x : 0, size.y > 0 ? 65535.0f / size.y : 0};
+    build.keys = al_malloc (num_boxes * sizeof (MORTON_KEY));
+
+    jobs_parallel_for (jobs, num_boxes, LBVH_GRAIN, lbvh_keys, &build);
+
+    MORTON_KEY *tmp = al_malloc (num_boxes * sizeof (MORTON_KEY));
+    radix_sort (jobs, build.keys, tmp, num_boxes);
+    al_free (tmp);
+
+    int num_leafs = (num_boxes + leaf_size - 1) / leaf_size;
+    int num_nodes = MAX (num_leafs - 1, 1);
+
+    tree->root = al_malloc (num_nodes * sizeof (AABB_NODE));
+    tree->leafs = al_malloc (num_leafs * sizeof (AABB_LEAF));
+    tree->num_nodes = num_nodes;
+    tree->num_leafs = num_leafs;
+
+    build.codes = al_malloc (num_leafs * sizeof (uint32_t));
+    jobs_parallel_for (jobs, num_leafs, LBVH_GRAIN / leaf_size + 1, lbvh_leafs, &build);
+
+    if (num_leafs == 1) {
+        tree->root[0].left = (AABB_NODE *) &tree->leafs[0];
+        tree->root[0].right = NULL;
+    } else {
+        jobs_parallel_for (jobs, num_nodes, LBVH_GRAIN, lbvh_nodes, &build);
+    }
+
+    lbvh_fit (tree->root);
+
+    al_free (build.codes);
+    al_free (build.keys);
+
+    debug ("LBVH boxes: %d, nodes: %d, leafs: %d", num_boxes, num_nodes, num_leafs);
+
+    return tree;
+}
+
+AABB_TREE *aabb_build_tree_auto (JOBS *jobs, BOX *boxes, int num_boxes)
+{
+    if (num_boxes >= LBVH_THRESHOLD)
+        return aabb_build_tree_lbvh (jobs, boxes, num_boxes, 4);
+
+    return aabb_build_tree (boxes, num_boxes, MAX (MIN (num_boxes - 1, 4), 1));
+}
+
+BOX *aabb_load_boxes (TILED_MAP *map, const char *layer_name, int *num_boxes)
 {
     TILED_LAYER_OBJECT *layer = (TILED_LAYER_OBJECT *)tiled_layer_by_name (map, layer_name);
     BOX *boxes = NULL;
-    int num_boxes = 0;
+    *num_boxes = 0;
 
     if (layer && layer->objects) {
         LIST_ITEM *item = _al_list_front (layer->objects);
-        num_boxes = _al_list_size (layer->objects);
-        boxes = al_malloc (num_boxes * sizeof (BOX));
+        boxes = al_malloc (_al_list_size (layer->objects) * sizeof (BOX));
         int i = 0;
 
         while (item) {
@@ -342,48 +638,157 @@ AABB_TREE *aabb_load_tree (TILED_MAP *map, const char *layer_name)
                     boxes[i].data = object_rect;
                     i++;
                     break;
+                case OBJECT_TYPE_GEOM:
+                    /* Polygons and polylines are loaded by shape_load */
+                    break;
                 default:
-                    debug ("FIX: Found unsupported object in box layer. Only rectangles are supported.");
+                    debug ("FIX: Found unsupported object in box layer. Only rectangles and shapes are supported.");
                     break;
             }
             item = _al_list_next (layer->objects, item);
         }
+        *num_boxes = i;
+    }
+
+    if (boxes && *num_boxes == 0) {
+        al_free (boxes);
+        return NULL;
+    }
+
+    return boxes;
+}
+
+/*
+ * Boxes covering every tile that carries property in any tile layer, so
+ * collision can be painted with the tiles instead of drawn by hand. The
+ * property must name one of the tile flags, which the map already read
+ * off the tiles. Tiles are greedy merged: the first unclaimed solid tile in row order grows
+ * right as far as it can, then the whole run grows down while every tile
+ * under it is solid and unclaimed. Box data is NULL.
+ */
+BOX *aabb_load_tile_boxes (TILED_MAP *map, const char *property, int *num_boxes)
+{
+    assert (map);
+    assert (property);
+
+    unsigned int flag = tiled_flag_by_name (property);
+    if (!flag) {
+        debug ("FIX: Tile property %s is not a tile flag; no tile boxes loaded.", property);
+        *num_boxes = 0;
+        return NULL;
+    }
+
+    enum { EMPTY, SOLID, CLAIMED };
+    int width = map->width;
+    int height = map->height;
+    unsigned char *cells = al_calloc (width * height, 1);
+    int num_solid = 0;
+
+    LIST_ITEM *item = _al_list_front (map->layers);
+    while (item) {
+        TILED_LAYER *layer = _al_list_item_data (item);
+        if (layer->type == LAYER_TYPE_TILE && (((TILED_LAYER_TILE *)layer)->flags & flag)) {
+            for (int j = 0; j < MIN (layer->height, height); j++) {
+                for (int i = 0; i < MIN (layer->width, width); i++) {
+                    if (!cells[j * width + i] && (tiled_cell_flags (map, layer, i, j) & flag)) {
+                        cells[j * width + i] = SOLID;
+                        num_solid++;
+                    }
+                }
+            }
+        }
+        item = _al_list_next (map->layers, item);
     }
 
-    if (boxes) {
-        AABB_TREE *tree = aabb_build_tree (boxes, num_boxes, MIN (num_boxes - 1, 4));
-        tree->use_cache = false;
-        tree->collisions = NULL;
-        free (boxes);
-        return tree;
+    VECTOR merged;
+    _al_vector_init (&merged, sizeof (BOX));
+
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            if (cells[j * width + i] != SOLID)
+                continue;
+
+            int w = 1;
+            while (i + w < width && cells[j * width + i + w] == SOLID)
+                w++;
+
+            int h = 1;
+            while (j + h < height) {
+                int k = 0;
+                while (k < w && cells[(j + h) * width + i + k] == SOLID)
+                    k++;
+                if (k < w)
+                    break;
+                h++;
+            }
+
+            for (int y = j; y < j + h; y++)
+                memset (&cells[y * width + i], CLAIMED, w);
+
+            VECTOR2D min = {i * map->tile_width, j * map->tile_height};
+            VECTOR2D max = {(i + w) * map->tile_width, (j + h) * map->tile_height};
+            BOX *box = _al_vector_alloc_back (&merged);
+            *box = box_from_points (min, max);
+            box->data = NULL;
+        }
+    }
+
+    al_free (cells);
+
+    *num_boxes = _al_vector_size (&merged);
+    BOX *boxes = NULL;
+    if (*num_boxes > 0) {
+        boxes = al_malloc (*num_boxes * sizeof (BOX));
+        memcpy (boxes, _al_vector_ref_front (&merged), *num_boxes * sizeof (BOX));
     }
+    _al_vector_free (&merged);
 
-    return NULL;
+    debug ("Merged %d tiles with %s into %d boxes", num_solid, property, *num_boxes);
+
+    return boxes;
+}
+
+AABB_TREE *aabb_load_tree (TILED_MAP *map, const char *layer_name)
+{
+    int num_boxes;
+    BOX *boxes = aabb_load_boxes (map, layer_name, &num_boxes);
+
+    if (!boxes)
+        return NULL;
+
+    AABB_TREE *tree = aabb_build_tree_auto (NULL, boxes, num_boxes);
+    al_free (boxes);
+    return tree;
 }
 
-bool collide (AABB_TREE *tree, AABB_NODE *node, BOX *box)
+/*
+ * Queries never touch the tree, every bit of per-query state lives in the
+ * caller-owned AABB_COLLISIONS. A built tree can then be shared by any
+ * number of threads or nested queries.
+ */
+static bool collide (const AABB_NODE *node, const BOX *box, AABB_COLLISIONS *collisions)
 {
     if (box_overlap (node->aabb, *box)) {
         if (!node->left && !node->right) {
-            AABB_LEAF *leaf = (AABB_LEAF*)node;
-            for (int i = 0; i < leaf->num_boxes; i++) {
-                BOX *leaf_box = &leaf->boxes[i];
-
-                bool overlap = box_overlap (*box, *leaf_box);
-                if (overlap) {
-                    tree->num_collisions++;
-                    if (tree->collisions)
-                        _al_list_push_back (tree->collisions->boxes, leaf_box);
-                    return overlap;
+            const AABB_LEAF *leaf = (const AABB_LEAF*)node;
+            int hits[BOX_BATCH_SIZE];
+            for (int first = 0; first < leaf->num_boxes; first += BOX_BATCH_SIZE) {
+                int count = MIN (BOX_BATCH_SIZE, leaf->num_boxes - first);
+                if (box_overlap_batch (*box, leaf->boxes + first, count, hits) > 0) {
+                    if (collisions) {
+                        collisions->num_collisions++;
+                        *(BOX **)_al_vector_alloc_back (&collisions->boxes) = &leaf->boxes[first + hits[0]];
+                    }
+                    return true;
                 }
             }
         } else {
             if (node->left) {
-                if (collide (tree, node->left, box))
+                if (collide (node->left, box, collisions))
                     return true;
             }
             if (node->right) {
-                if (collide (tree, node->right, box))
+                if (collide (node->right, box, collisions))
                     return true;
             }
         }
@@ -392,91 +797,619 @@ bool collide (AABB_TREE *tree, AABB_NODE *node, BOX *box)
     return false;
 }
 
-void collide_fill (AABB_TREE *tree, AABB_NODE *node, BOX *box)
+static void collide_fill (const AABB_NODE *node, const BOX *box, AABB_COLLISIONS *collisions)
 {
     if (box_overlap (node->aabb, *box)) {
         if (!node->left && !node->right) {
-            AABB_LEAF *leaf = (AABB_LEAF*)node;
-            for (int i = 0; i < leaf->num_boxes; i++) {
-                BOX *leaf_box = &leaf->boxes[i];
-
-                bool overlap = box_overlap (*box, *leaf_box);
-                if (overlap) {
-                    tree->num_collisions++;
-                    if (tree->collisions)
-                        _al_list_push_back (tree->collisions->boxes, leaf_box);
+            const AABB_LEAF *leaf = (const AABB_LEAF*)node;
+            int hits[BOX_BATCH_SIZE];
+            for (int first = 0; first < leaf->num_boxes; first += BOX_BATCH_SIZE) {
+                int count = MIN (BOX_BATCH_SIZE, leaf->num_boxes - first);
+                int num_hits = box_overlap_batch (*box, leaf->boxes + first, count, hits);
+                for (int i = 0; i < num_hits; i++) {
+                    collisions->num_collisions++;
+                    *(BOX **)_al_vector_alloc_back (&collisions->boxes) = &leaf->boxes[first + hits[i]];
                 }
             }
         } else {
             if (node->left) {
-                collide_fill (tree, node->left, box);
+                collide_fill (node->left, box, collisions);
             }
             if (node->right) {
-                collide_fill (tree, node->right, box);
+                collide_fill (node->right, box, collisions);
+            }
+        }
+    }
+}
+
+static bool visit_node (const AABB_NODE *node, const BOX *box, AABB_VISIT_FN visit, void *user)
+{
+    if (!box_overlap (node->aabb, *box))
+        return true;
+
+    if (!node->left && !node->right) {
+        const AABB_LEAF *leaf = (const AABB_LEAF*)node;
+        int hits[BOX_BATCH_SIZE];
+        for (int first = 0; first < leaf->num_boxes; first += BOX_BATCH_SIZE) {
+            int count = MIN (BOX_BATCH_SIZE, leaf->num_boxes - first);
+            int num_hits = box_overlap_batch (*box, leaf->boxes + first, count, hits);
+            for (int i = 0; i < num_hits; i++) {
+                if (!visit (&leaf->boxes[first + hits[i]], user))
+                    return false;
             }
         }
+        return true;
     }
+
+    if (node->left && !visit_node (node->left, box, visit, user))
+        return false;
+    if (node->right && !visit_node (node->right, box, visit, user))
+        return false;
+
+    return true;
 }
 
-bool aabb_collide (AABB_TREE *tree, BOX *box)
+/*
+ * Calls visit for every box overlapping the query box, stopping as soon as
+ * it returns false. Nothing is allocated, results go straight to the caller.
+ */
+void aabb_query_visit (const AABB_TREE *tree, const BOX *box, AABB_VISIT_FN visit, void *user)
 {
     assert (tree);
     assert (box);
-    tree->collisions = NULL;
-    tree->num_collisions = 0;
-    return collide (tree, tree->root, box);
+    assert (visit);
+    visit_node (tree->root, box, visit, user);
 }
 
-void aabb_init_collisions (AABB_COLLISIONS *col)
+/*
+ * Descends while only one child can hold anything overlapping the box.
+ * Sibling volumes may overlap, so the other child must be disjoint from
+ * the box, not merely the chosen one containing it.
+ */
+static const AABB_NODE *find_cache_node (const AABB_NODE *node, const BOX *box)
 {
-    assert (col);
-    col->boxes = _al_list_create ();
+    while (node->left || node->right) {
+        bool left = node->left && box_overlap (node->left->aabb, *box);
+        bool right = node->right && box_overlap (node->right->aabb, *box);
+
+        if (left && !right)
+            node = node->left;
+        else if (right && !left)
+            node = node->right;
+        else
+            break;
+    }
+
+    return node;
+}
+
+/*
+ * Temporal coherence: actors query nearly the same box every tick, so the
+ * node found for a fattened copy of the last query stays valid as long as
+ * the new box remains inside it, and traversal restarts there.
+ */
+static const AABB_NODE *cache_start_node (const AABB_TREE *tree, const BOX *box, AABB_COLLISIONS *collisions)
+{
+    if (!tree->use_cache)
+        return tree->root;
+
+    if (collisions->cache_tree == tree && box_inside_box (*box, collisions->cache_box)) {
+        collisions->cache_hits++;
+        return collisions->cache_node;
+    }
+
+    collisions->cache_misses++;
+    collisions->cache_tree = tree;
+    collisions->cache_box = *box;
+    collisions->cache_box.extent = vadd (box->extent, (VECTOR2D){CACHE_MARGIN, CACHE_MARGIN});
+    collisions->cache_node = find_cache_node (tree->root, &collisions->cache_box);
+
+    return collisions->cache_node;
 }
 
-bool aabb_collide_with_cache (AABB_TREE *tree, BOX *box, AABB_COLLISIONS *collisions)
+void aabb_query_visit_with_cache (const AABB_TREE *tree, const BOX *box, AABB_COLLISIONS *collisions,
+                                  AABB_VISIT_FN visit, void *user)
 {
     assert (tree);
     assert (box);
     assert (collisions);
+    assert (visit);
+    visit_node (cache_start_node (tree, box, collisions), box, visit, user);
+}
 
-    if (tree->use_cache && !_al_list_is_empty (collisions->boxes)) {
-        LIST_ITEM *item = _al_list_front (collisions->boxes);
-        if (box_overlap (*box, *(BOX*)_al_list_item_data (item))) {
-            tree->num_collisions = 1;
-            return true;
+void aabb_clear_collisions (AABB_COLLISIONS *collisions)
+{
+    vector_shrink (&collisions->boxes, _al_vector_size (&collisions->boxes));
+    collisions->num_collisions = 0;
+}
+
+bool aabb_collide (const AABB_TREE *tree, const BOX *box)
+{
+    assert (tree);
+    assert (box);
+    return collide (tree->root, box, NULL);
+}
+
+static void sweep_node (const AABB_NODE *node, const BOX *box, VECTOR2D delta, BOX_HIT *best)
+{
+    if (!box_sweep_touches (*box, delta, node->aabb, best->box ? best->time : 1.0f))
+        return;
+
+    if (!node->left && !node->right) {
+        const AABB_LEAF *leaf = (const AABB_LEAF*)node;
+        for (int i = 0; i < leaf->num_boxes; i++) {
+            BOX_HIT hit;
+            if (!box_sweep (*box, delta, leaf->boxes[i], &hit))
+                continue;
+
+            if (!best->box || hit.time < best->time ||
+                (hit.time == best->time && hit.penetration > best->penetration)) {
+                *best = hit;
+                best->box = &leaf->boxes[i];
+            }
         }
+        return;
     }
 
-    collisions->query_box = *box;
-    if (collisions->boxes)
-        _al_list_clear (collisions->boxes);
-    tree->collisions = collisions;
-    tree->num_collisions = 0;
-
-    return collide (tree, tree->root, box);
+    if (node->left)
+        sweep_node (node->left, box, delta, best);
+    if (node->right)
+        sweep_node (node->right, box, delta, best);
 }
 
-void aabb_collide_fill_cache (AABB_TREE *tree, BOX *box, AABB_COLLISIONS *collisions)
+/*
+ * Continuous query: finds the first box hit by box moving along delta.
+ * Subtrees the swept box cannot reach before the best hit so far are
+ * skipped, so long moves cost about as much as short ones.
+ */
+bool aabb_sweep (const AABB_TREE *tree, const BOX *box, VECTOR2D delta, BOX_HIT *hit)
 {
     assert (tree);
     assert (box);
+    assert (hit);
+
+    hit->box = NULL;
+    sweep_node (tree->root, box, delta, hit);
+    return hit->box != NULL;
+}
+
+/*
+ * Ray queries treat the segment as a zero sized box swept from "from" to
+ * "to", so node and box tests are the same slab tests the sweeps use.
+ * Segments starting inside a box hit it at time 0, segments grazing an
+ * edge do not hit.
+ */
+
+static inline BOX ray_box (VECTOR2D from)
+{
+    return (BOX){from, {0, 0}, NULL};
+}
+
+enum {
+    RAY_CLOSEST,
+    RAY_ANY,
+    RAY_ALL,
+    RAY_VISIT
+};
+
+typedef struct RAY_QUERY {
+    BOX origin;
+    VECTOR2D delta;
+    int mode;
+    BOX_HIT *best;
+    AABB_COLLISIONS *collisions;
+    AABB_VISIT_FN visit;
+    void *user;
+} RAY_QUERY;
+
+static bool ray_node (const AABB_NODE *node, RAY_QUERY *query)
+{
+    float max_time = query->mode == RAY_CLOSEST && query->best->box ? query->best->time : 1.0f;
+
+    if (!box_sweep_touches (query->origin, query->delta, node->aabb, max_time))
+        return true;
+
+    if (!node->left && !node->right) {
+        const AABB_LEAF *leaf = (const AABB_LEAF*)node;
+        for (int i = 0; i < leaf->num_boxes; i++) {
+            BOX_HIT hit;
+            if (!box_sweep (query->origin, query->delta, leaf->boxes[i], &hit))
+                continue;
+
+            if (query->mode == RAY_VISIT) {
+                if (!query->visit (&leaf->boxes[i], query->user))
+                    return false;
+            } else if (query->mode == RAY_ALL) {
+                query->collisions->num_collisions++;
+                *(BOX **)_al_vector_alloc_back (&query->collisions->boxes) = &leaf->boxes[i];
+            } else if (!query->best->box || hit.time < query->best->time) {
+                *query->best = hit;
+                query->best->box = &leaf->boxes[i];
+                if (query->mode == RAY_ANY)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    if (node->left && !ray_node (node->left, query))
+        return false;
+    if (node->right && !ray_node (node->right, query))
+        return false;
+
+    return true;
+}
+
+bool aabb_raycast (const AABB_TREE *tree, VECTOR2D from, VECTOR2D to, BOX_HIT *hit)
+{
+    assert (tree);
+    assert (hit);
+
+    RAY_QUERY query = {ray_box (from), vsub (to, from), RAY_CLOSEST, hit, NULL};
+    hit->box = NULL;
+    ray_node (tree->root, &query);
+    return hit->box != NULL;
+}
+
+int aabb_raycast_all (const AABB_TREE *tree, VECTOR2D from, VECTOR2D to, AABB_COLLISIONS *collisions)
+{
+    assert (tree);
+    assert (collisions);
+
+    BOX_HIT best = {NULL};
+    RAY_QUERY query = {ray_box (from), vsub (to, from), RAY_ALL, &best, collisions};
+    aabb_clear_collisions (collisions);
+    ray_node (tree->root, &query);
+    return collisions->num_collisions;
+}
+
+bool aabb_line_of_sight (const AABB_TREE *tree, VECTOR2D from, VECTOR2D to)
+{
+    assert (tree);
+
+    BOX_HIT hit = {NULL};
+    RAY_QUERY query = {ray_box (from), vsub (to, from), RAY_ANY, &hit, NULL};
+    ray_node (tree->root, &query);
+    return hit.box == NULL;
+}
+
+/*
+ * Calls visit for every box the segment hits, in tree order, until it
+ * returns false. Lets callers filter what blocks a segment while keeping
+ * the pruning of the other ray queries.
+ */
+void aabb_query_segment (const AABB_TREE *tree, VECTOR2D from, VECTOR2D to, AABB_VISIT_FN visit, void *user)
+{
+    assert (tree);
+    assert (visit);
+
+    RAY_QUERY query = {ray_box (from), vsub (to, from), RAY_VISIT, NULL, NULL, visit, user};
+    ray_node (tree->root, &query);
+}
+
+#define RAY_PACKET 32
+
+/*
+ * Packet traversal: up to 32 rays walk the tree together, carrying a mask
+ * of the rays still alive at each node, so every node is fetched once per
+ * packet instead of once per ray.
+ */
+static void ray_packet_node (const AABB_NODE *node, const AABB_RAY *rays, BOX_HIT *hits, uint32_t mask)
+{
+    uint32_t alive = 0;
+
+    for (int r = 0; r < RAY_PACKET; r++) {
+        if (!(mask & (1u << r)))
+            continue;
+        float max_time = hits[r].box ? hits[r].time : 1.0f;
+        if (box_sweep_touches (ray_box (rays[r].from), vsub (rays[r].to, rays[r].from), node->aabb, max_time))
+            alive |= 1u << r;
+    }
+
+    if (!alive)
+        return;
+
+    if (!node->left && !node->right) {
+        const AABB_LEAF *leaf = (const AABB_LEAF*)node;
+        for (int r = 0; r < RAY_PACKET; r++) {
+            if (!(alive & (1u << r)))
+                continue;
+            VECTOR2D delta = vsub (rays[r].to, rays[r].from);
+            for (int i = 0; i < leaf->num_boxes; i++) {
+                BOX_HIT hit;
+                if (box_sweep (ray_box (rays[r].from), delta, leaf->boxes[i], &hit) &&
+                    (!hits[r].box || hit.time < hits[r].time)) {
+                    hits[r] = hit;
+                    hits[r].box = &leaf->boxes[i];
+                }
+            }
+        }
+        return;
+    }
+
+    if (node->left)
+        ray_packet_node (node->left, rays, hits, alive);
+    if (node->right)
+        ray_packet_node (node->right, rays, hits, alive);
+}
+
+void aabb_raycast_batch (const AABB_TREE *tree, const AABB_RAY *rays, int num_rays, BOX_HIT *hits)
+{
+    assert (tree);
+    assert (rays);
+    assert (hits);
+
+    for (int i = 0; i < num_rays; i++)
+        hits[i].box = NULL;
+
+    for (int first = 0; first < num_rays; first += RAY_PACKET) {
+        int count = MIN (RAY_PACKET, num_rays - first);
+        uint32_t mask = count == RAY_PACKET ? 0xffffffffu : (1u << count) - 1;
+        ray_packet_node (tree->root, rays + first, hits + first, mask);
+    }
+}
+
+static void radius_node (const AABB_NODE *node, VECTOR2D center, float sqradius, AABB_COLLISIONS *collisions)
+{
+    if (box_sqdistance (node->aabb, center) > sqradius)
+        return;
+
+    if (!node->left && !node->right) {
+        const AABB_LEAF *leaf = (const AABB_LEAF*)node;
+        for (int i = 0; i < leaf->num_boxes; i++) {
+            if (box_sqdistance (leaf->boxes[i], center) <= sqradius) {
+                collisions->num_collisions++;
+                *(BOX **)_al_vector_alloc_back (&collisions->boxes) = &leaf->boxes[i];
+            }
+        }
+        return;
+    }
+
+    if (node->left)
+        radius_node (node->left, center, sqradius, collisions);
+    if (node->right)
+        radius_node (node->right, center, sqradius, collisions);
+}
+
+/*
+ * Collects every box touching the circle, in no particular order.
+ */
+int aabb_query_radius (const AABB_TREE *tree, VECTOR2D center, float radius, AABB_COLLISIONS *collisions)
+{
+    assert (tree);
+    assert (collisions);
+    assert (radius >= 0);
+
+    aabb_clear_collisions (collisions);
+    radius_node (tree->root, center, radius * radius, collisions);
+    return collisions->num_collisions;
+}
+
+/*
+ * Binary min-heap of nodes and boxes keyed on their squared distance to the
+ * query point, stored in the caller's AABB_COLLISIONS so repeated queries
+ * reuse its memory.
+ */
+typedef struct QUEUE_ITEM {
+    float key;
+    const AABB_NODE *node;
+    BOX *box;
+} QUEUE_ITEM;
+
+static void queue_push (VECTOR *queue, float key, const AABB_NODE *node, BOX *box)
+{
+    int i = _al_vector_size (queue);
+    _al_vector_alloc_back (queue);
+    QUEUE_ITEM *items = _al_vector_ref (queue, 0);
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (items[parent].key <= key)
+            break;
+        items[i] = items[parent];
+        i = parent;
+    }
+
+    items[i] = (QUEUE_ITEM){key, node, box};
+}
+
+static QUEUE_ITEM queue_pop (VECTOR *queue)
+{
+    QUEUE_ITEM *items = _al_vector_ref (queue, 0);
+    QUEUE_ITEM top = items[0];
+    int size = _al_vector_size (queue) - 1;
+    QUEUE_ITEM last = items[size];
+    vector_shrink (queue, 1);
+
+    int i = 0;
+    while (true) {
+        int child = 2 * i + 1;
+        if (child >= size)
+            break;
+        if (child + 1 < size && items[child + 1].key < items[child].key)
+            child++;
+        if (last.key <= items[child].key)
+            break;
+        items[i] = items[child];
+        i = child;
+    }
+
+    if (size > 0)
+        items[i] = last;
+
+    return top;
+}
+
+/*
+ * Best-first search: nodes and boxes share one queue ordered by distance,
+ * so a box coming out of it is closer than anything still unexplored and
+ * results are produced nearest first. Stops after k boxes or once the
+ * closest pending entry lies beyond max_distance.
+ */
+int aabb_query_nearest (const AABB_TREE *tree, VECTOR2D point, int k, float max_distance,
+                        AABB_COLLISIONS *collisions)
+{
+    assert (tree);
     assert (collisions);
+    assert (k > 0);
+
+    float sqmax = max_distance * max_distance;
+    VECTOR *queue = &collisions->queue;
+
+    aabb_clear_collisions (collisions);
+    vector_shrink (queue, _al_vector_size (queue));
+
+    float key = box_sqdistance (tree->root->aabb, point);
+    if (key <= sqmax)
+        queue_push (queue, key, tree->root, NULL);
+
+    while (!_al_vector_is_empty (queue) && collisions->num_collisions < k) {
+        QUEUE_ITEM item = queue_pop (queue);
+
+        if (item.box) {
+            collisions->num_collisions++;
+            *(BOX **)_al_vector_alloc_back (&collisions->boxes) = item.box;
+            continue;
+        }
+
+        const AABB_NODE *node = item.node;
+        if (!node->left && !node->right) {
+            const AABB_LEAF *leaf = (const AABB_LEAF*)node;
+            for (int i = 0; i < leaf->num_boxes; i++) {
+                key = box_sqdistance (leaf->boxes[i], point);
+                if (key <= sqmax)
+                    queue_push (queue, key, NULL, &leaf->boxes[i]);
+            }
+            continue;
+        }
+
+        const AABB_NODE *children[2] = {node->left, node->right};
+        for (int i = 0; i < 2; i++) {
+            if (!children[i])
+                continue;
+            key = box_sqdistance (children[i]->aabb, point);
+            if (key <= sqmax)
+                queue_push (queue, key, children[i], NULL);
+        }
+    }
+
+    return collisions->num_collisions;
+}
+
+static BOX refit_node (AABB_NODE *node, AABB_REFIT_FN refit, void *user)
+{
+    if (!node->left && !node->right) {
+        AABB_LEAF *leaf = (AABB_LEAF *)node;
+        int kept = 0;
+        for (int i = 0; i < leaf->num_boxes; i++) {
+            BOX box = leaf->boxes[i];
+            refit (&box, user);
+            if (!box.data)
+                continue;
+            node->aabb = kept == 0 ? box : box_merge (node->aabb, box);
+            leaf->boxes[kept++] = box;
+        }
+        leaf->num_boxes = kept;
+        return node->aabb;
+    }
+
+    node->aabb = refit_node (node->left, refit, user);
+    if (node->right)
+        node->aabb = box_merge (node->aabb, refit_node (node->right, refit, user));
+
+    return node->aabb;
+}
+
+/*
+ * Lets refit move every box, typically to follow the object in its data
+ * pointer, then recomputes the node bounds bottom up. The hierarchy is
+ * kept, so it degrades as boxes drift away from where they were built but
+ * costs a single linear pass. Boxes whose data refit sets to NULL are
+ * dropped; a leaf left empty keeps its old bounds. Must not run
+ * concurrently with queries.
+ */
+void aabb_refit (AABB_TREE *tree, AABB_REFIT_FN refit, void *user)
+{
+    assert (tree);
+    assert (refit);
+
+    refit_node (tree->root, refit, user);
+}
+
+static inline float box_area (BOX box)
+{
+    return box.extent.x * box.extent.y;
+}
+
+/*
+ * Adds box to the leaf whose bounds grow least, growing the bounds on the
+ * way down. Leaf arrays double when full and never shrink, so once every
+ * leaf has held its peak number of boxes inserting allocates nothing. Like
+ * refit, keeps the hierarchy and must not run concurrently with queries.
+ */
+void aabb_insert (AABB_TREE *tree, BOX box)
+{
+    assert (tree);
 
-    if (tree->use_cache && !_al_list_is_empty (collisions->boxes)) {
-        LIST_ITEM *item = _al_list_front (collisions->boxes);
-        if (box_overlap (*box, *(BOX*)_al_list_item_data (item))) {
-            tree->num_collisions = 1;
-            return;
+    AABB_NODE *node = tree->root;
+
+    while (node->left || node->right) {
+        node->aabb = box_merge (node->aabb, box);
+
+        if (!node->right || !node->left) {
+            node = node->left ? node->left : node->right;
+            continue;
         }
+
+        float left = box_area (box_merge (node->left->aabb, box)) - box_area (node->left->aabb);
+        float right = box_area (box_merge (node->right->aabb, box)) - box_area (node->right->aabb);
+        node = left <= right ? node->left : node->right;
     }
 
+    AABB_LEAF *leaf = (AABB_LEAF *)node;
+    if (leaf->num_boxes == leaf->capacity) {
+        leaf->capacity = MAX (leaf->capacity * 2, 4);
+        leaf->boxes = al_realloc (leaf->boxes, leaf->capacity * sizeof (BOX));
+    }
+
+    node->aabb = leaf->num_boxes == 0 ? box : box_merge (node->aabb, box);
+    leaf->boxes[leaf->num_boxes++] = box;
+}
+
+void aabb_init_collisions (AABB_COLLISIONS *col)
+{
+    assert (col);
+    _al_vector_init (&col->boxes, sizeof (BOX *));
+    _al_vector_init (&col->queue, sizeof (QUEUE_ITEM));
+    col->num_collisions = 0;
+    col->cache_tree = NULL;
+    col->cache_node = NULL;
+    col->cache_hits = 0;
+    col->cache_misses = 0;
+}
+
+bool aabb_collide_with_cache (const AABB_TREE *tree, const BOX *box, AABB_COLLISIONS *collisions)
+{
+    assert (tree);
+    assert (box);
+    assert (collisions);
+
+    collisions->query_box = *box;
+    aabb_clear_collisions (collisions);
+
+    return collide (cache_start_node (tree, box, collisions), box, collisions);
+}
+
+void aabb_collide_fill_cache (const AABB_TREE *tree, const BOX *box, AABB_COLLISIONS *collisions)
+{
+    assert (tree);
+    assert (box);
+    assert (collisions);
+
     collisions->query_box = *box;
-    if (collisions->boxes)
-        _al_list_clear (collisions->boxes);
-    tree->collisions = collisions;
-    tree->num_collisions = 0;
+    aabb_clear_collisions (collisions);
 
-    return collide_fill (tree, tree->root, box);
+    collide_fill (cache_start_node (tree, box, collisions), box, collisions);
 }
 
 void aabb_free (AABB_TREE *tree)
@@ -496,8 +1429,8 @@ void aabb_free (AABB_TREE *tree)
 void aabb_free_collisions (AABB_COLLISIONS *col)
 {
     assert (col);
-    if (col->boxes)
-        _al_list_destroy (col->boxes);
+    _al_vector_free (&col->boxes);
+    _al_vector_free (&col->queue);
 }
 
 void aabb_draw_node (AABB_NODE *node, SCREEN *s, ALLEGRO_COLOR color)
@@ -515,3 +1448,34 @@ void aabb_draw (AABB_TREE *tree, SCREEN *s, ALLEGRO_COLOR color)
     aabb_draw_node (tree->root, s, color);
 }
 
+static void debug_draw_node (const AABB_NODE *node, DEBUG_DRAW *dd, int depth)
+{
+    if (!node || !box_overlap (node->aabb, dd->view))
+        return;
+
+    ALLEGRO_COLOR color = dd->colors[DEBUG_DRAW_NODES];
+    float fade = 1.0f / (1.0f + depth * 0.25f);
+    color.r *= fade;
+    color.g *= fade;
+    color.b *= fade;
+    color.a *= fade;
+
+    debug_draw_box (dd, node->aabb, color);
+    debug_draw_node (node->left, dd, depth + 1);
+    debug_draw_node (node->right, dd, depth + 1);
+}
+
+/*
+ * Node bounds only, fading with depth so the levels can be told apart;
+ * subtrees outside the view are skipped. The boxes themselves are left
+ * to the owner, which knows what they stand for.
+ */
+void aabb_debug_draw (const AABB_TREE *tree, DEBUG_DRAW *dd)
+{
+    assert (tree);
+    assert (dd);
+
+    if (debug_draw_enabled (dd, DEBUG_DRAW_NODES))
+        debug_draw_node (tree->root, dd, 0);
+}
+
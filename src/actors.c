@@ -0,0 +1,337 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+/*
+ * Actor store. The per-tick work on an actor touches its position,
+ * movement, box and animation timer, so those live in their own arrays
+ * instead of inside one struct per actor behind a list node: integration
+ * and the timer advance become straight loops over floats that the
+ * compiler can vectorize, and everything else (sprite, owner) is only
+ * read when a frame actually changes or the actor is drawn.
+ *
+ * Removal moves the last actor into the hole, so indices are not stable;
+ * handles are, through the slots table. Adding and removing are constant
+ * time and only allocate when the store outgrows its capacity, so
+ * short lived actors can come and go every tick.
+ *
+ * Not every actor is simulated every tick. actors_schedule sorts them
+ * into tiers by their distance to the view: near ones run every tick,
+ * farther ones every few ticks with the skipped time folded into one
+ * larger step, and the farthest stay frozen until the view comes back.
+ * The reduced tier is staggered by handle so its cost is spread evenly.
+ * Actors a time budget cut off before their turn was over go to the
+ * front of the next due list, so overload delays everyone a little
+ * instead of starving the same few.
+ */
+
+#include "nostos/actors.h"
+#include "nostos/utils.h"
+
+#include <string.h>
+
+#define ACTORS_MIN_CAPACITY 16
+
+static void grow (ACTORS *actors, int capacity)
+{
+    actors->capacity = capacity;
+    actors->position = al_realloc (actors->position, capacity * sizeof (VECTOR2D));
+    actors->previous = al_realloc (actors->previous, capacity * sizeof (VECTOR2D));
+    actors->movement = al_realloc (actors->movement, capacity * sizeof (VECTOR2D));
+    actors->box_center = al_realloc (actors->box_center, capacity * sizeof (VECTOR2D));
+    actors->box_extent = al_realloc (actors->box_extent, capacity * sizeof (VECTOR2D));
+    actors->anim_time = al_realloc (actors->anim_time, capacity * sizeof (float));
+    actors->frame_duration = al_realloc (actors->frame_duration, capacity * sizeof (float));
+    actors->animation = al_realloc (actors->animation, capacity * sizeof (int));
+    actors->frame = al_realloc (actors->frame, capacity * sizeof (int));
+    actors->sprite = al_realloc (actors->sprite, capacity * sizeof (SPRITE *));
+    actors->data = al_realloc (actors->data, capacity * sizeof (void *));
+    actors->handles = al_realloc (actors->handles, capacity * sizeof (int));
+    actors->tier = al_realloc (actors->tier, capacity * sizeof (unsigned char));
+    actors->waiting = al_realloc (actors->waiting, capacity * sizeof (int));
+    actors->ticks = al_realloc (actors->ticks, capacity * sizeof (int));
+    actors->due = al_realloc (actors->due, capacity * sizeof (int));
+    actors->due_scratch = al_realloc (actors->due_scratch, capacity * sizeof (int));
+
+    /* Every live actor holds one slot and one free entry at most */
+    actors->slots = al_realloc (actors->slots, capacity * sizeof (int));
+    actors->generations = al_realloc (actors->generations, capacity * sizeof (int));
+    actors->free_slots = al_realloc (actors->free_slots, capacity * sizeof (int));
+}
+
+ACTORS *actors_create (int capacity)
+{
+    ACTORS *actors = al_calloc (1, sizeof (ACTORS));
+    grow (actors, MAX (capacity, ACTORS_MIN_CAPACITY));
+    return actors;
+}
+
+/* Adds a standing actor at position and returns its handle. */
+int actors_add (ACTORS *actors, SPRITE *sprite, VECTOR2D position, void *data)
+{
+    assert (actors);
+    assert (sprite);
+
+    if (actors->num_actors == actors->capacity)
+        grow (actors, actors->capacity * 2);
+
+    int slot;
+    if (actors->num_free > 0) {
+        slot = actors->free_slots[--actors->num_free];
+    } else {
+        slot = actors->num_slots++;
+        actors->generations[slot] = 0;
+    }
+
+    int i = actors->num_actors++;
+    int handle = handle_make (slot, actors->generations[slot]);
+    actors->slots[slot] = i;
+    actors->handles[i] = handle;
+
+    actors->position[i] = position;
+    actors->previous[i] = position;
+    actors->movement[i] = (VECTOR2D){0, 0};
+    actors->box_center[i] = vadd (position, sprite->box.center);
+    actors->box_extent[i] = vdivf (sprite->box.extent, 2.0);
+    actors->anim_time[i] = 0;
+    actors->frame_duration[i] = sprite->duration;
+    actors->animation[i] = ANI_STAND_FRONT;
+    actors->frame[i] = 0;
+    actors->sprite[i] = sprite;
+    actors->data[i] = data;
+    actors->tier[i] = ACTOR_TIER_FULL;
+    actors->waiting[i] = 0;
+    actors->ticks[i] = 0;
+
+    return handle;
+}
+
+void actors_remove (ACTORS *actors, int handle)
+{
+    int i = actors_index (actors, handle);
+    int last = --actors->num_actors;
+
+    if (i != last) {
+        actors->position[i] = actors->position[last];
+        actors->previous[i] = actors->previous[last];
+        actors->movement[i] = actors->movement[last];
+        actors->box_center[i] = actors->box_center[last];
+        actors->box_extent[i] = actors->box_extent[last];
+        actors->anim_time[i] = actors->anim_time[last];
+        actors->frame_duration[i] = actors->frame_duration[last];
+        actors->animation[i] = actors->animation[last];
+        actors->frame[i] = actors->frame[last];
+        actors->sprite[i] = actors->sprite[last];
+        actors->data[i] = actors->data[last];
+        actors->handles[i] = actors->handles[last];
+        actors->tier[i] = actors->tier[last];
+        actors->waiting[i] = actors->waiting[last];
+        actors->ticks[i] = actors->ticks[last];
+        actors->slots[handle_index (actors->handles[i])] = i;
+    }
+
+    int slot = handle_index (handle);
+    actors->slots[slot] = ACTORS_INVALID;
+    actors->generations[slot] = (actors->generations[slot] + 1) & HANDLE_GENERATION_MASK;
+    actors->free_slots[actors->num_free++] = slot;
+
+    /* The due list holds indices, which just changed */
+    actors->num_due = 0;
+}
+
+/* False for handles of removed actors, even once their slot is reused. */
+bool actors_valid (const ACTORS *actors, int handle)
+{
+    assert (actors);
+
+    int slot = handle_index (handle);
+    return handle >= 0 && slot < actors->num_slots && actors->slots[slot] != ACTORS_INVALID &&
+           actors->generations[slot] == handle_generation (handle);
+}
+
+int actors_index (const ACTORS *actors, int handle)
+{
+    assert (actors_valid (actors, handle));
+
+    return actors->slots[handle_index (handle)];
+}
+
+BOX actors_box (const ACTORS *actors, int handle)
+{
+    int i = actors_index (actors, handle);
+    return (BOX){actors->box_center[i], actors->box_extent[i], actors->data[i]};
+}
+
+/* Distance from p to the closest point of the view, 0 inside it. */
+static inline float view_distance (BOX view, VECTOR2D p)
+{
+    VECTOR2D d = vsub (vabs (vsub (p, view.center)), view.extent);
+    return vlen ((VECTOR2D){MAX (d.x, 0), MAX (d.y, 0)});
+}
+
+/* Overdue ticks past this many count the same when ordering */
+#define ACTORS_MAX_OVERDUE 15
+
+/*
+ * Stable counting sort of the due list by how many ticks each actor is
+ * overdue, most first: one more than its tier's period means a budget
+ * left it out last time. Ties keep nearest tier first.
+ */
+static inline int overdue (const ACTORS *actors, int i, int rate)
+{
+    int period = actors->tier[i] == ACTOR_TIER_FULL ? 1 : rate;
+    return CLAMP (0, actors->waiting[i] - period, ACTORS_MAX_OVERDUE);
+}
+
+static void order_due (ACTORS *actors, int rate)
+{
+    int counts[ACTORS_MAX_OVERDUE + 1] = {0};
+    int n = actors->num_due;
+
+    for (int j = 0; j < n; j++)
+        counts[overdue (actors, actors->due[j], rate)]++;
+
+    if (counts[0] == n)
+        return;
+
+    int start = 0;
+    for (int k = ACTORS_MAX_OVERDUE; k >= 0; k--) {
+        int count = counts[k];
+        counts[k] = start;
+        start += count;
+    }
+
+    for (int j = 0; j < n; j++) {
+        int i = actors->due[j];
+        actors->due_scratch[counts[overdue (actors, i, rate)]++] = i;
+    }
+
+    memcpy (actors->due, actors->due_scratch, n * sizeof (int));
+}
+
+/*
+ * Assigns the tiers for this tick and fills the due list: every actor
+ * within near of the view, then the ones within far whose turn it is,
+ * one in rate ticks, with the overdue ones moved to the front. Returns
+ * the number of due actors. ticks is cleared; whoever runs the due
+ * actors sets it from waiting.
+ */
+int actors_schedule (ACTORS *actors, BOX view, float near, float far, int rate, unsigned int tick)
+{
+    assert (actors);
+    assert (near <= far);
+    assert (rate > 0);
+
+    int n = actors->num_actors;
+    actors->num_due = 0;
+
+    for (int i = 0; i < n; i++) {
+        float distance = view_distance (view, actors->position[i]);
+        actors->ticks[i] = 0;
+
+        if (distance > far) {
+            actors->tier[i] = ACTOR_TIER_DORMANT;
+            actors->waiting[i] = 0;
+            continue;
+        }
+
+        actors->waiting[i]++;
+        if (distance > near) {
+            actors->tier[i] = ACTOR_TIER_REDUCED;
+        } else {
+            actors->tier[i] = ACTOR_TIER_FULL;
+            actors->due[actors->num_due++] = i;
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (actors->tier[i] == ACTOR_TIER_REDUCED && (tick + handle_index (actors->handles[i])) % rate == 0)
+            actors->due[actors->num_due++] = i;
+    }
+
+    order_due (actors, rate);
+    return actors->num_due;
+}
+
+/*
+ * Same steps sprite_update takes for one actor, one pass per step: pick
+ * the animation from the movement, integrate, advance the timers, then
+ * step the frames whose timer ran out. Each actor advances by its ticks,
+ * so those sitting this update out are left as they are.
+ *
+ * Only actors begin..end-1 are touched, so ranges can run in parallel.
+ */
+void actors_update_range (ACTORS *actors, int begin, int end, float dt, float t)
+{
+    assert (actors);
+    assert (begin >= 0 && end <= actors->num_actors);
+
+    const int *ticks = actors->ticks;
+
+    for (int i = begin; i < end; i++) {
+        if (!ticks[i])
+            continue;
+
+        int animation = sprite_select_animation (actors->movement[i], actors->animation[i]);
+        if (animation != actors->animation[i]) {
+            /* Back to zero once this tick's time is added below */
+            actors->animation[i] = animation;
+            actors->anim_time[i] = -t * ticks[i];
+            actors->frame[i] = 0;
+        }
+    }
+
+    int n = end - begin;
+    vmuladd_steps_batch (actors->position + begin, actors->movement + begin, dt, ticks + begin, n);
+    vmuladd_steps_batch (actors->box_center + begin, actors->movement + begin, dt, ticks + begin, n);
+
+    float *anim_time = actors->anim_time;
+    for (int i = begin; i < end; i++)
+        anim_time[i] += t * ticks[i];
+
+    /* A long step can cover several frames; the leftover carries over. */
+    for (int i = begin; i < end; i++) {
+        float duration = actors->frame_duration[i];
+        if (ticks[i] && anim_time[i] > duration) {
+            SPRITE_ANIMATION *anim = &actors->sprite[i]->animations[actors->animation[i]];
+            int frames = duration > 0 ? (int)(anim_time[i] / duration) : 1;
+            anim_time[i] = duration > 0 ? anim_time[i] - frames * duration : 0;
+            actors->frame[i] = (actors->frame[i] + frames) % anim->num_frames;
+        }
+    }
+}
+
+/* Keeps the positions before a simulation step, to draw between steps. */
+void actors_save_positions (ACTORS *actors)
+{
+    assert (actors);
+    memcpy (actors->previous, actors->position, actors->num_actors * sizeof (VECTOR2D));
+}
+
+void actors_free (ACTORS *actors)
+{
+    if (!actors)
+        return;
+
+    al_free (actors->position);
+    al_free (actors->previous);
+    al_free (actors->movement);
+    al_free (actors->box_center);
+    al_free (actors->box_extent);
+    al_free (actors->anim_time);
+    al_free (actors->frame_duration);
+    al_free (actors->animation);
+    al_free (actors->frame);
+    al_free (actors->sprite);
+    al_free (actors->data);
+    al_free (actors->handles);
+    al_free (actors->tier);
+    al_free (actors->waiting);
+    al_free (actors->ticks);
+    al_free (actors->due);
+    al_free (actors->due_scratch);
+    al_free (actors->slots);
+    al_free (actors->generations);
+    al_free (actors->free_slots);
+    al_free (actors);
+}
@@ -10,6 +10,14 @@
 
 #include <allegro5/allegro_primitives.h>
 
+#if defined(__SSE2__) && !defined(NOSTOS_NO_SIMD)
+#include <emmintrin.h>
+#define BOX_SSE2
+#endif
+
+#define SLIDE_ITERATIONS 3
+#define SLIDE_SKIN 0.01f
+#define SWEEP_EPSILON 1e-3f
 
 BOX box_from_points (VECTOR2D v1, VECTOR2D v2)
 {
@@ -25,40 +33,66 @@ BOX box_scale (BOX b, float f)
     return b;
 }
 
-bool box_overlap (BOX b1, BOX b2)
-{
-    VECTOR2D t = vabs (vsub (b1.center, b2.center));
-    VECTOR2D ext = vadd (b1.extent, b2.extent);
-    return t.x <= ext.x && t.y <= ext.y;
-}
-
-bool box_inside_vector2d (BOX b, VECTOR2D v)
-{
-    VECTOR2D min = box_get_min (b);
-    VECTOR2D max = box_get_max (b);
-
-    if (v.x < min.x || v.x > max.x || v.y < min.y || v.y > max.y)
-        return false;
-
-    return true;
-}
-
-bool box_inside_box (BOX b1, BOX b2)
+BOX box_merge (BOX b1, BOX b2)
 {
-    return b1.center.x - b1.extent.x > b2.center.x - b2.extent.x &&
-           b1.center.x + b1.extent.x < b2.center.x + b2.extent.x &&
-           b1.center.y - b1.extent.y > b2.center.y - b2.extent.y &&
-           b1.center.y + b1.extent.y < b2.center.y + b2.extent.y;
+    VECTOR2D bmin = {MIN (b1.center.x - b1.extent.x, b2.center.x - b2.extent.x),
+                     MIN (b1.center.y - b1.extent.y, b2.center.y - b2.extent.y)};
+    VECTOR2D bmax = {MAX (b1.center.x + b1.extent.x, b2.center.x + b2.extent.x),
+                     MAX (b1.center.y + b1.extent.y, b2.center.y + b2.extent.y)};
+    b1.center = vmulf (vadd (bmin, bmax), 0.5f);
+    b1.extent = vmulf (vsub (bmax, bmin), 0.5f);
+    return b1;
 }
 
-VECTOR2D box_get_min (BOX b)
+/*
+ * Squared distance from a point to the closest point of the box, zero when
+ * the point is inside.
+ */
+float box_sqdistance (BOX b, VECTOR2D v)
 {
-    return vsub (b.center, b.extent);
+    float dx = MAX (fabsf (v.x - b.center.x) - b.extent.x, 0.0f);
+    float dy = MAX (fabsf (v.y - b.center.y) - b.extent.y, 0.0f);
+    return dx * dx + dy * dy;
 }
 
-VECTOR2D box_get_max (BOX b)
+/*
+ * Tests up to BOX_BATCH_SIZE boxes against b and writes the indices of the
+ * overlapping ones to hits, in order. Same rule as box_overlap: touching
+ * counts. With SSE2 two boxes go through each comparison; center and
+ * extent sit next to each other in BOX, so each box is one unaligned load.
+ */
+int box_overlap_batch (BOX b, const BOX *boxes, int num_boxes, int *hits)
 {
-    return vadd (b.center, b.extent);
+    assert (num_boxes <= BOX_BATCH_SIZE);
+
+    int num_hits = 0;
+    int i = 0;
+
+#ifdef BOX_SSE2
+    __m128 center = _mm_setr_ps (b.center.x, b.center.y, b.center.x, b.center.y);
+    __m128 extent = _mm_setr_ps (b.extent.x, b.extent.y, b.extent.x, b.extent.y);
+    __m128 sign = _mm_set1_ps (-0.0f);
+
+    for (; i + 2 <= num_boxes; i += 2) {
+        __m128 b0 = _mm_loadu_ps (&boxes[i].center.x);
+        __m128 b1 = _mm_loadu_ps (&boxes[i + 1].center.x);
+        __m128 t = _mm_andnot_ps (sign, _mm_sub_ps (_mm_movelh_ps (b0, b1), center));
+        __m128 ext = _mm_add_ps (_mm_movehl_ps (b1, b0), extent);
+        int mask = _mm_movemask_ps (_mm_cmple_ps (t, ext));
+
+        if ((mask & 3) == 3)
+            hits[num_hits++] = i;
+        if ((mask & 12) == 12)
+            hits[num_hits++] = i + 1;
+    }
+#endif
+
+    for (; i < num_boxes; i++) {
+        if (box_overlap (b, boxes[i]))
+            hits[num_hits++] = i;
+    }
+
+    return num_hits;
 }
 
 void box_debug (BOX b)
@@ -82,3 +116,139 @@ bool box_lateral (BOX b1, BOX b2)
         return false;
 }
 
+
+/*
+ * Swept test of b1 moving by delta against a static b2, done as a ray
+ * against b2 grown by b1's extent. Time is the fraction of delta at first
+ * contact and normal points out of b2. Boxes already overlapping at the
+ * start hit at time 0 with the normal and depth of the shallowest axis.
+ * Touching is not overlapping, so sliding along a wall is free.
+ */
+bool box_sweep (BOX b1, VECTOR2D delta, BOX b2, BOX_HIT *hit)
+{
+    VECTOR2D ext = vadd (b1.extent, b2.extent);
+    VECTOR2D d = vsub (b1.center, b2.center);
+    VECTOR2D pen = vsub (ext, vabs (d));
+
+    /* Overlaps below float resolution at map coordinates are contacts,
+       pushing out of them would not move the box at all. */
+    if (pen.x > SWEEP_EPSILON && pen.y > SWEEP_EPSILON) {
+        hit->time = 0;
+        if (pen.x < pen.y) {
+            hit->normal = (VECTOR2D){d.x < 0 ? -1 : 1, 0};
+            hit->penetration = pen.x;
+        } else {
+            hit->normal = (VECTOR2D){0, d.y < 0 ? -1 : 1};
+            hit->penetration = pen.y;
+        }
+        return true;
+    }
+
+    float enter_x = -INFINITY, exit_x = INFINITY;
+    float enter_y = -INFINITY, exit_y = INFINITY;
+
+    if (delta.x != 0) {
+        float t1 = (-ext.x - d.x) / delta.x;
+        float t2 = (ext.x - d.x) / delta.x;
+        enter_x = MIN (t1, t2);
+        exit_x = MAX (t1, t2);
+    } else if (pen.x <= 0) {
+        return false;
+    }
+
+    if (delta.y != 0) {
+        float t1 = (-ext.y - d.y) / delta.y;
+        float t2 = (ext.y - d.y) / delta.y;
+        enter_y = MIN (t1, t2);
+        exit_y = MAX (t1, t2);
+    } else if (pen.y <= 0) {
+        return false;
+    }
+
+    float enter = MAX (enter_x, enter_y);
+    float exit = MIN (exit_x, exit_y);
+
+    if (enter >= exit || enter < 0 || enter >= 1)
+        return false;
+
+    hit->time = enter;
+    hit->penetration = 0;
+    if (enter_x > enter_y)
+        hit->normal = (VECTOR2D){delta.x > 0 ? -1 : 1, 0};
+    else
+        hit->normal = (VECTOR2D){0, delta.y > 0 ? -1 : 1};
+
+    return true;
+}
+
+/* Conservative version for pruning: does the swept box touch b2 before max_time? */
+bool box_sweep_touches (BOX b1, VECTOR2D delta, BOX b2, float max_time)
+{
+    VECTOR2D ext = vadd (b1.extent, b2.extent);
+    VECTOR2D d = vsub (b1.center, b2.center);
+    float enter = 0, exit = max_time;
+
+    if (delta.x != 0) {
+        float t1 = (-ext.x - d.x) / delta.x;
+        float t2 = (ext.x - d.x) / delta.x;
+        enter = MAX (enter, MIN (t1, t2));
+        exit = MIN (exit, MAX (t1, t2));
+    } else if (fabs (d.x) > ext.x) {
+        return false;
+    }
+
+    if (delta.y != 0) {
+        float t1 = (-ext.y - d.y) / delta.y;
+        float t2 = (ext.y - d.y) / delta.y;
+        enter = MAX (enter, MIN (t1, t2));
+        exit = MIN (exit, MAX (t1, t2));
+    } else if (fabs (d.y) > ext.y) {
+        return false;
+    }
+
+    return enter <= exit;
+}
+
+/*
+ * Moves box by delta, stopping at the first contact reported by sweep and
+ * sliding the rest of the move along the contact plane. Boxes that start
+ * inside a wall are pushed out along the shallowest axis. Returns the
+ * displacement actually allowed; blocked gets the normals of every contact
+ * (zero when free).
+ */
+VECTOR2D box_slide (BOX b, VECTOR2D delta, BOX_SWEEP_FN sweep, void *user, VECTOR2D *blocked)
+{
+    assert (sweep);
+
+    VECTOR2D moved = {0, 0};
+    VECTOR2D normals = {0, 0};
+
+    for (int i = 0; i < SLIDE_ITERATIONS && (delta.x || delta.y); i++) {
+        BOX_HIT hit;
+
+        if (!sweep (&b, delta, &hit, user)) {
+            moved = vadd (moved, delta);
+            break;
+        }
+
+        float time = MAX (hit.time - SLIDE_SKIN / vlen (delta), 0.0f);
+        VECTOR2D step = vadd (vmulf (delta, time), vmulf (hit.normal, hit.penetration));
+        moved = vadd (moved, step);
+        b.center = vadd (b.center, step);
+
+        if (hit.normal.x)
+            normals.x = hit.normal.x;
+        if (hit.normal.y)
+            normals.y = hit.normal.y;
+
+        delta = vmulf (delta, 1.0f - time);
+        float into = vdot (delta, hit.normal);
+        if (into < 0)
+            delta = vsub (delta, vmulf (hit.normal, into));
+    }
+
+    if (blocked)
+        *blocked = normals;
+
+    return moved;
+}
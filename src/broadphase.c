@@ -0,0 +1,274 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+#include "nostos/broadphase.h"
+#include "nostos/utils.h"
+
+#include <math.h>
+
+/*
+ * Crossovers measured with examples/broadphase_bench.c. The box count
+ * where the grid starts answering faster grows with the share of the
+ * layer the boxes cover: about 25 boxes at 3%, 50 at 10%, 120 at 30% and
+ * 190 at 60%. The grid keeps winning until box sizes spread to a CV
+ * between 1.3 and 1.4. Empty cells cost memory, not query time, so they
+ * are only bounded by a budget for the cell array.
+ */
+#define GRID_MIN_BOXES 20
+#define GRID_BOXES_PER_COVERAGE 300
+#define GRID_MAX_SIZE_CV 1.35f
+#define GRID_MAX_CELL_MEMORY (4 << 20)
+
+/*
+ * Picks the structure for a layer from box size statistics. Layers with
+ * enough boxes for how densely they cover the map are served best by a
+ * uniform grid with cells about twice the mean box size, however sparse.
+ * Small or crowded layers, sizes spread so far that the largest boxes
+ * cover hundreds of cells, and layers whose cells would not fit the
+ * memory budget go to the tree.
+ */
+int broadphase_select (const BOX *boxes, int num_boxes, float *cell_size)
+{
+    if (num_boxes < GRID_MIN_BOXES)
+        return BROADPHASE_TREE;
+
+    double sum_w = 0, sum_h = 0, sq_w = 0, sq_h = 0, area = 0;
+    VECTOR2D bmin = box_get_min (boxes[0]);
+    VECTOR2D bmax = box_get_max (boxes[0]);
+
+    for (int i = 0; i < num_boxes; i++) {
+        double w = boxes[i].extent.x * 2.0;
+        double h = boxes[i].extent.y * 2.0;
+        sum_w += w;
+        sum_h += h;
+        sq_w += w * w;
+        sq_h += h * h;
+        area += w * h;
+
+        VECTOR2D min = box_get_min (boxes[i]);
+        VECTOR2D max = box_get_max (boxes[i]);
+        bmin.x = MIN (bmin.x, min.x);
+        bmin.y = MIN (bmin.y, min.y);
+        bmax.x = MAX (bmax.x, max.x);
+        bmax.y = MAX (bmax.y, max.y);
+    }
+
+    double mean_w = sum_w / num_boxes;
+    double mean_h = sum_h / num_boxes;
+    double cv_w = sqrt (MAX (sq_w / num_boxes - mean_w * mean_w, 0)) / mean_w;
+    double cv_h = sqrt (MAX (sq_h / num_boxes - mean_h * mean_h, 0)) / mean_h;
+
+    double coverage = area / MAX ((bmax.x - bmin.x) * (bmax.y - bmin.y), 1.0);
+
+    if (num_boxes < GRID_MIN_BOXES + GRID_BOXES_PER_COVERAGE * MIN (coverage, 1.0))
+        return BROADPHASE_TREE;
+
+    if (cv_w > GRID_MAX_SIZE_CV || cv_h > GRID_MAX_SIZE_CV)
+        return BROADPHASE_TREE;
+
+    float size = 2.0f * MAX (mean_w, mean_h);
+    double cells = ceil ((bmax.x - bmin.x) / size) * ceil ((bmax.y - bmin.y) / size);
+
+    if (cells * sizeof (int) > GRID_MAX_CELL_MEMORY)
+        return BROADPHASE_TREE;
+
+    if (cell_size)
+        *cell_size = size;
+
+    return BROADPHASE_GRID;
+}
+
+BROADPHASE *broadphase_build (JOBS *jobs, BOX *boxes, int num_boxes)
+{
+    assert (boxes);
+    assert (num_boxes > 0);
+
+    BROADPHASE *bp = al_calloc (1, sizeof (BROADPHASE));
+    float cell_size = 0;
+
+    bp->type = broadphase_select (boxes, num_boxes, &cell_size);
+
+    if (bp->type == BROADPHASE_GRID)
+        bp->grid = grid_build (boxes, num_boxes, cell_size);
+    else
+        bp->tree = aabb_build_tree_auto (jobs, boxes, num_boxes);
+
+    debug ("Broadphase: %s for %d boxes", bp->type == BROADPHASE_GRID ? "grid" : "tree", num_boxes);
+
+    return bp;
+}
+
+BROADPHASE *broadphase_load (TILED_MAP *map, const char *layer_name)
+{
+    int num_boxes;
+    BOX *boxes = aabb_load_boxes (map, layer_name, &num_boxes);
+
+    if (!boxes)
+        return NULL;
+
+    BROADPHASE *bp = broadphase_build (NULL, boxes, num_boxes);
+    al_free (boxes);
+    return bp;
+}
+
+bool broadphase_collide (const BROADPHASE *bp, const BOX *box)
+{
+    assert (bp);
+
+    if (bp->type == BROADPHASE_GRID)
+        return grid_collide (bp->grid, box);
+
+    return aabb_collide (bp->tree, box);
+}
+
+void broadphase_collide_fill_cache (const BROADPHASE *bp, const BOX *box, AABB_COLLISIONS *collisions)
+{
+    assert (bp);
+
+    if (bp->type == BROADPHASE_GRID)
+        grid_collide_fill (bp->grid, box, collisions);
+    else
+        aabb_collide_fill_cache (bp->tree, box, collisions);
+}
+
+void broadphase_query_visit (const BROADPHASE *bp, const BOX *box, AABB_VISIT_FN visit, void *user)
+{
+    assert (bp);
+
+    if (bp->type == BROADPHASE_GRID)
+        grid_query_visit (bp->grid, box, visit, user);
+    else
+        aabb_query_visit (bp->tree, box, visit, user);
+}
+
+void broadphase_query_visit_with_cache (const BROADPHASE *bp, const BOX *box, AABB_COLLISIONS *collisions,
+                                        AABB_VISIT_FN visit, void *user)
+{
+    assert (bp);
+
+    if (bp->type == BROADPHASE_GRID)
+        grid_query_visit (bp->grid, box, visit, user);
+    else
+        aabb_query_visit_with_cache (bp->tree, box, collisions, visit, user);
+}
+
+typedef struct SWEEP_QUERY {
+    BOX box;
+    VECTOR2D delta;
+    BOX_HIT *best;
+} SWEEP_QUERY;
+
+static bool sweep_visit (BOX *box, void *user)
+{
+    SWEEP_QUERY *query = user;
+    BOX_HIT hit;
+
+    if (box_sweep (query->box, query->delta, *box, &hit)) {
+        BOX_HIT *best = query->best;
+        if (!best->box || hit.time < best->time ||
+            (hit.time == best->time && hit.penetration > best->penetration)) {
+            *best = hit;
+            best->box = box;
+        }
+    }
+
+    return true;
+}
+
+bool broadphase_sweep (const BROADPHASE *bp, const BOX *box, VECTOR2D delta, BOX_HIT *hit)
+{
+    assert (bp);
+    assert (hit);
+
+    if (bp->type == BROADPHASE_TREE)
+        return aabb_sweep (bp->tree, box, delta, hit);
+
+    BOX end = *box;
+    end.center = vadd (end.center, delta);
+
+    SWEEP_QUERY query = {*box, delta, hit};
+    BOX bounds = box_merge (*box, end);
+
+    hit->box = NULL;
+    grid_query_visit (bp->grid, &bounds, sweep_visit, &query);
+    return hit->box != NULL;
+}
+
+static bool slide_sweep (const BOX *box, VECTOR2D delta, BOX_HIT *hit, void *user)
+{
+    return broadphase_sweep (user, box, delta, hit);
+}
+
+VECTOR2D broadphase_slide (const BROADPHASE *bp, const BOX *box, VECTOR2D delta, VECTOR2D *blocked)
+{
+    assert (bp);
+    assert (box);
+
+    return box_slide (*box, delta, slide_sweep, (void *)bp, blocked);
+}
+
+bool broadphase_raycast (const BROADPHASE *bp, VECTOR2D from, VECTOR2D to, BOX_HIT *hit)
+{
+    assert (bp);
+
+    if (bp->type == BROADPHASE_TREE)
+        return aabb_raycast (bp->tree, from, to, hit);
+
+    BOX point = {from, {0, 0}, NULL};
+    return broadphase_sweep (bp, &point, vsub (to, from), hit);
+}
+
+void broadphase_query_segment (const BROADPHASE *bp, VECTOR2D from, VECTOR2D to, AABB_VISIT_FN visit, void *user)
+{
+    assert (bp);
+
+    if (bp->type == BROADPHASE_TREE)
+        aabb_query_segment (bp->tree, from, to, visit, user);
+    else
+        grid_query_segment (bp->grid, from, to, visit, user);
+}
+
+static bool blocks_sight (BOX *box, void *user)
+{
+    *(bool *)user = true;
+    return false;
+}
+
+bool broadphase_line_of_sight (const BROADPHASE *bp, VECTOR2D from, VECTOR2D to)
+{
+    assert (bp);
+
+    if (bp->type == BROADPHASE_TREE)
+        return aabb_line_of_sight (bp->tree, from, to);
+
+    bool blocked = false;
+    grid_query_segment (bp->grid, from, to, blocks_sight, &blocked);
+    return !blocked;
+}
+
+void broadphase_free (BROADPHASE *bp)
+{
+    if (!bp)
+        return;
+
+    aabb_free (bp->tree);
+    grid_free (bp->grid);
+    al_free (bp);
+}
+
+void broadphase_draw (BROADPHASE *bp, SCREEN *s, ALLEGRO_COLOR color)
+{
+    if (bp->type == BROADPHASE_GRID)
+        grid_draw (bp->grid, s, color);
+    else
+        aabb_draw (bp->tree, s, color);
+}
+
+void broadphase_debug_draw (const BROADPHASE *bp, DEBUG_DRAW *dd)
+{
+    if (bp->type == BROADPHASE_GRID)
+        grid_debug_draw (bp->grid, dd);
+    else
+        aabb_debug_draw (bp->tree, dd);
+}
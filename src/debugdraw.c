@@ -0,0 +1,108 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+/*
+ * Debug drawing: box_draw costs one al_draw_rectangle per box, which on a
+ * dense map means thousands of draw calls per frame. Here every line goes
+ * into a vertex array and the whole frame is drawn as one line list.
+ * Boxes outside the view are dropped before they cost any vertices, and
+ * each category can be switched on and off while the game runs.
+ */
+
+#include "nostos/debugdraw.h"
+
+static const char *category_names[DEBUG_DRAW_NUM_CATEGORIES] = {
+    "tree nodes", "leaves", "hits", "triggers", "shapes"
+};
+
+DEBUG_DRAW *debug_draw_create ()
+{
+    DEBUG_DRAW *dd = al_calloc (1, sizeof (DEBUG_DRAW));
+
+    _al_vector_init (&dd->vertices, sizeof (ALLEGRO_VERTEX));
+    dd->enabled = 0;
+    dd->colors[DEBUG_DRAW_NODES] = al_map_rgba_f (0, 0, 0.8, 0.8);
+    dd->colors[DEBUG_DRAW_LEAVES] = al_map_rgb_f (0, 0.8, 0);
+    dd->colors[DEBUG_DRAW_HITS] = al_map_rgb_f (1, 0, 0);
+    dd->colors[DEBUG_DRAW_TRIGGERS] = al_map_rgb_f (1, 0.8, 0);
+    dd->colors[DEBUG_DRAW_SHAPES] = al_map_rgb_f (0, 0.8, 0.8);
+
+    return dd;
+}
+
+void debug_draw_toggle (DEBUG_DRAW *dd, int category)
+{
+    assert (dd);
+    assert (category >= 0 && category < DEBUG_DRAW_NUM_CATEGORIES);
+
+    dd->enabled ^= 1u << category;
+    debug ("Debug draw %s: %s", category_names[category], debug_draw_enabled (dd, category) ? "on" : "off");
+}
+
+bool debug_draw_enabled (const DEBUG_DRAW *dd, int category)
+{
+    return dd && (dd->enabled & (1u << category));
+}
+
+bool debug_draw_any (const DEBUG_DRAW *dd)
+{
+    return dd && dd->enabled;
+}
+
+/* Starts a frame seen through the screen; lines are in map coordinates. */
+void debug_draw_begin (DEBUG_DRAW *dd, SCREEN *s)
+{
+    assert (dd);
+    assert (s);
+
+    vector_shrink (&dd->vertices, _al_vector_size (&dd->vertices));
+    dd->offset = s->position;
+    dd->view = screen_box (s);
+    dd->num_lines = 0;
+}
+
+void debug_draw_line (DEBUG_DRAW *dd, VECTOR2D p1, VECTOR2D p2, ALLEGRO_COLOR color)
+{
+    ALLEGRO_VERTEX *v = _al_vector_alloc_back (&dd->vertices);
+    *v = (ALLEGRO_VERTEX){p1.x - dd->offset.x, p1.y - dd->offset.y, 0, 0, 0, color};
+
+    v = _al_vector_alloc_back (&dd->vertices);
+    *v = (ALLEGRO_VERTEX){p2.x - dd->offset.x, p2.y - dd->offset.y, 0, 0, 0, color};
+
+    dd->num_lines++;
+}
+
+void debug_draw_box (DEBUG_DRAW *dd, BOX b, ALLEGRO_COLOR color)
+{
+    if (!box_overlap (b, dd->view))
+        return;
+
+    VECTOR2D bmin = box_get_min (b);
+    VECTOR2D bmax = box_get_max (b);
+
+    debug_draw_line (dd, bmin, (VECTOR2D){bmax.x, bmin.y}, color);
+    debug_draw_line (dd, (VECTOR2D){bmax.x, bmin.y}, bmax, color);
+    debug_draw_line (dd, bmax, (VECTOR2D){bmin.x, bmax.y}, color);
+    debug_draw_line (dd, (VECTOR2D){bmin.x, bmax.y}, bmin, color);
+}
+
+void debug_draw_flush (DEBUG_DRAW *dd)
+{
+    assert (dd);
+
+    int num_vertices = _al_vector_size (&dd->vertices);
+    if (num_vertices > 0)
+        al_draw_prim (_al_vector_ref_front (&dd->vertices), NULL, NULL, 0, num_vertices, ALLEGRO_PRIM_LINE_LIST);
+
+    vector_shrink (&dd->vertices, num_vertices);
+}
+
+void debug_draw_free (DEBUG_DRAW *dd)
+{
+    if (!dd)
+        return;
+
+    _al_vector_free (&dd->vertices);
+    al_free (dd);
+}
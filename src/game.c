@@ -14,6 +14,9 @@
 #include "nostos/sprite.h"
 #include "nostos/aabbtree.h"
 #include "nostos/screen.h"
+#include "nostos/pipeline.h"
+#include "nostos/snapshot.h"
+#include "nostos/trigger.h"
 #include "nostos/ui.h"
 #include "nostos/utils.h"
 
@@ -21,9 +24,35 @@
 #include <math.h>
 #include <time.h>
 
-#define FPS 80
+/*
+ * The simulation advances in fixed steps of 1 / SIM_RATE seconds; speeds
+ * are given in pixels per step. Frames are drawn as fast as the display
+ * allows, or max_fps, between the last two steps. After a stall no more
+ * than MAX_STEPS are run to catch up and the rest of the time is dropped.
+ */
+#define SIM_RATE 80
+#define STEP_TIME (1.0 / SIM_RATE)
+#define MAX_STEPS 8
 #define NTIMES 10
 #define TRANS_TIME 0.3f
+#define NPC_DISTANCE 128.0f
+#define NPC_CANDIDATES 4
+
+/*
+ * NPCs within NPC_NEAR_DISTANCE of the screen run every tick, those up to
+ * NPC_FAR_DISTANCE every NPC_REDUCED_RATE ticks and the rest not at all.
+ * NPC_AI_BUDGET caps the seconds spent on their decisions per tick.
+ */
+#define NPC_NEAR_DISTANCE 256.0f
+#define NPC_FAR_DISTANCE 1024.0f
+#define NPC_REDUCED_RATE 4
+#define NPC_AI_BUDGET 0.002
+
+/* Cells a tick may scan answering NPC route requests */
+#define PATH_BUDGET 4096
+
+/* Sprites reach past their collision boxes by up to this much */
+#define VIEW_MARGIN 64.0f
 
 GAME * game_init ()
 {
@@ -68,8 +97,13 @@ GAME * game_init ()
     game->rrate = 60;
     game->suggest_vsync = 1;
     game->force_vsync = 0;
+    game->threads = -1;
+    game->max_fps = 0;
+    game->pipelined = 0;
 
-    game->current_npc = NULL;
+    game->current_npc = HANDLE_INVALID;
+    game->debug_draw = debug_draw_create ();
+    game->sprite_batch = sprite_batch_create ();
 
     game->screen = screen_new ();
 
@@ -104,6 +138,9 @@ GAME * game_init ()
         set_config_i (gconfig, "display", "refreshrate", game->rrate);
         set_config_i (gconfig, "display", "suggest_vsync", game->suggest_vsync);
         set_config_i (gconfig, "display", "force_vsync", game->force_vsync);
+        set_config_i (gconfig, "engine", "threads", game->threads);
+        set_config_i (gconfig, "engine", "max_fps", game->max_fps);
+        set_config_i (gconfig, "engine", "pipelined", game->pipelined);
     } else {
         get_config_i (gconfig, "display", "width", &game->screen.width);
         get_config_i (gconfig, "display", "height", &game->screen.height);
@@ -112,6 +149,9 @@ GAME * game_init ()
         get_config_i (gconfig, "display", "refreshrate", &game->rrate);
         get_config_i (gconfig, "display", "suggest_vsync", &game->suggest_vsync);
         get_config_i (gconfig, "display", "force_vsync", &game->force_vsync);
+        get_config_i (gconfig, "engine", "threads", &game->threads);
+        get_config_i (gconfig, "engine", "max_fps", &game->max_fps);
+        get_config_i (gconfig, "engine", "pipelined", &game->pipelined);
     }
 
     al_save_config_file (gcpath_str, gconfig);
@@ -130,7 +170,6 @@ GAME * game_init ()
         flags |= ALLEGRO_WINDOWED;
 
     al_set_new_display_option (ALLEGRO_VSYNC, game->suggest_vsync, ALLEGRO_SUGGEST);
-    al_set_new_display_option (ALLEGRO_DEPTH_SIZE, 8, ALLEGRO_SUGGEST);
 
     al_set_new_display_flags (flags);
     al_set_new_display_refresh_rate (game->rrate);
@@ -143,11 +182,15 @@ GAME * game_init ()
 
     al_set_new_bitmap_flags (ALLEGRO_VIDEO_BITMAP);
 
-    game->timer = al_create_timer (1.0 / FPS);
-    if (!game->timer) {
-        fprintf (stderr, "Failed to create timer.\n");
-        al_free (game);
-        return NULL;
+    /* Only paces the frames; without it they follow vsync or run free */
+    game->timer = NULL;
+    if (game->max_fps > 0) {
+        game->timer = al_create_timer (1.0 / game->max_fps);
+        if (!game->timer) {
+            fprintf (stderr, "Failed to create timer.\n");
+            al_free (game);
+            return NULL;
+        }
     }
 
     game->screen.width = al_get_display_width (game->display);
@@ -164,10 +207,10 @@ GAME * game_init ()
     }
 
     al_register_event_source (game->event_queue, al_get_display_event_source (game->display));
-    al_register_event_source (game->event_queue, al_get_timer_event_source (game->timer));
+    if (game->timer)
+        al_register_event_source (game->event_queue, al_get_timer_event_source (game->timer));
 
-    al_set_render_state (ALLEGRO_ALPHA_FUNCTION, ALLEGRO_RENDER_EQUAL);
-    al_set_render_state (ALLEGRO_ALPHA_TEST_VALUE, 1);
+    game->jobs = jobs_create (game->threads);
 
     filename = get_resource_path_str ("data/sprites.ini");
     game->sprites = sprite_load_sprites (filename);
@@ -175,7 +218,7 @@ GAME * game_init ()
 
     filename = get_resource_path_str ("data/scenes.ini");
     game->scenes = scene_load_file (filename);
-    scene_load_scenes (game->scenes, game->sprites);
+    scene_load_scenes (game->scenes, game->sprites, game->jobs);
     al_free (filename);
 
     str = al_get_config_value (game_config, "", "scene");
@@ -205,6 +248,7 @@ static bool game_enter_portal (GAME *game, SCENE_PORTAL *portal)
     if (portal) {
         debug ("Going to portal %s", portal->name);
         game->current_scene = portal->scene;
+        game->current_npc = HANDLE_INVALID;
         sprite_center (game->current_actor, &portal->position);
         screen_center (&game->screen, portal->position, game->current_scene->map);
         return true;
@@ -213,268 +257,366 @@ static bool game_enter_portal (GAME *game, SCENE_PORTAL *portal)
     return false;
 }
 
+static void refit_npc (BOX *box, void *user)
+{
+    BOX npc_box = sprite_npc_box (scene_get_npc (user, world_proxy_handle (box)));
+    box->center = npc_box.center;
+    box->extent = npc_box.extent;
+}
+
+/*
+ * Simulation state carried from one step to the next, together with the
+ * snapshot the current frame writes. In pipelined mode the frame thread
+ * owns all of it between pipeline_start and pipeline_wait.
+ */
+typedef struct GAME_STATE {
+    GAME *game;
+    AABB_COLLISIONS actor_collisions;
+    AABB_COLLISIONS npc_collisions;
+    AABB_COLLISIONS visible_npcs;
+    TRIGGER_SET actor_triggers;
+    ALLEGRO_KEYBOARD_STATE last_keyboard_state;
+    float fadeout_duration;
+    float fadein_duration;
+    SCENE_PORTAL *dest_portal;
+    unsigned int tick;
+    double accumulator;
+    double frame_time;
+    bool quit;
+    RENDER_SNAPSHOT *snapshot;
+} GAME_STATE;
+
+static void game_step (GAME_STATE *state)
+{
+    GAME *game = state->game;
+    SCENE *scene = game->current_scene;
+    SPRITE_ACTOR *actor = game->current_actor;
+    ALLEGRO_KEYBOARD_STATE keyboard_state;
+    const float dt = 1.0f;
+
+    actor->previous_position = actor->position;
+    game->screen.previous_position = game->screen.position;
+    actors_save_positions (scene->actors);
+
+    if (state->fadeout_duration > 0.0f) {
+        float fadef = state->fadeout_duration / TRANS_TIME;
+        game->screen.tint = al_map_rgba_f (fadef, fadef, fadef, 1.0);
+        state->fadeout_duration -= STEP_TIME;
+        if (state->fadeout_duration <= 0.0f) {
+            state->fadein_duration = TRANS_TIME;
+            state->fadeout_duration = 0.0f;
+            game_enter_portal (game, state->dest_portal);
+            actors_save_positions (game->current_scene->actors);
+            world_collide_fill (game->current_scene->world, &actor->box,
+                                WORLD_PORTAL | WORLD_TRIGGER, &state->actor_collisions);
+            trigger_reset (&state->actor_triggers, &state->actor_collisions);
+        }
+    }
+
+    if (state->fadein_duration > 0.0f) {
+        float fadef = 1.0 - state->fadein_duration / TRANS_TIME;
+        game->screen.tint = al_map_rgba_f (fadef, fadef, fadef, 1.0);
+        state->fadein_duration -= STEP_TIME;
+        if (state->fadein_duration <= 0.0f) {
+            game->paused = false;
+            state->fadein_duration = 0.0f;
+        }
+    }
+
+    if (game->paused)
+        return;
+
+    al_get_keyboard_state (&keyboard_state);
+
+    for (int j = 0; j < DEBUG_DRAW_NUM_CATEGORIES; j++) {
+        if (al_key_down (&keyboard_state, ALLEGRO_KEY_F1 + j) &&
+            !al_key_down (&state->last_keyboard_state, ALLEGRO_KEY_F1 + j))
+            debug_draw_toggle (game->debug_draw, j);
+    }
+    state->last_keyboard_state = keyboard_state;
+
+    if (al_key_down (&keyboard_state, ALLEGRO_KEY_ESCAPE)) {
+        state->quit = true;
+        return;
+    }
+
+    if (al_key_down (&keyboard_state, ALLEGRO_KEY_ENTER)) {
+        snapshot_set_dialog (state->snapshot, NULL, NULL);
+    }
+
+    if (al_key_down (&keyboard_state, ALLEGRO_KEY_RIGHT)) {
+        actor->event->move_right (actor, dt);
+    }
+    if (al_key_down (&keyboard_state, ALLEGRO_KEY_LEFT)) {
+        actor->event->move_left (actor, dt);
+    }
+    if (al_key_down (&keyboard_state, ALLEGRO_KEY_UP)) {
+        actor->event->move_up (actor, dt);
+    }
+    if (al_key_down (&keyboard_state, ALLEGRO_KEY_DOWN)) {
+        actor->event->move_down (actor, dt);
+    }
+
+    VECTOR2D blocked;
+    VECTOR2D move = world_move (scene->world, &actor->box, vmulf (actor->movement, dt),
+                                WORLD_SOLID | WORLD_PORTAL | WORLD_TRIGGER, &state->actor_collisions, &blocked);
+    if (blocked.x)
+        actor->movement.x = move.x / dt;
+    if (blocked.y)
+        actor->movement.y = move.y / dt;
+
+    int num_events = trigger_update (&state->actor_triggers, &state->actor_collisions);
+    for (int j = 0; j < num_events; j++) {
+        TRIGGER_EVENT *trigger = trigger_event (&state->actor_triggers, j);
+        if (trigger->type != TRIGGER_ENTER)
+            continue;
+
+        if (trigger->category & WORLD_PORTAL) {
+            SCENE_PORTAL *portal = trigger->data;
+            if (portal->destiny) {
+                state->dest_portal = portal->destiny;
+                state->fadeout_duration = TRANS_TIME;
+                game->paused = true;
+                actor->movement = (VECTOR2D){0, 0};
+                snapshot_set_dialog (state->snapshot, "Speaker:", "Entering portal.");
+                break;
+            }
+        } else {
+            TILED_OBJECT *obj = trigger->data;
+            const char *message = aa_search (obj->properties, "message", charcmp);
+            debug ("Entered trigger %s", obj->name);
+            if (message)
+                snapshot_set_dialog (state->snapshot, obj->name, message);
+        }
+    }
+
+    game->current_npc = HANDLE_INVALID;
+    world_refit (scene->world, refit_npc, scene);
+    world_query_nearest (scene->world, actor->box.center, NPC_CANDIDATES, NPC_DISTANCE,
+                         WORLD_NPC, &state->npc_collisions);
+    for (int j = 0; j < state->npc_collisions.num_collisions; j++) {
+        BOX *colbox = *(BOX **)_al_vector_ref (&state->npc_collisions.boxes, j);
+        int handle = world_proxy_handle (colbox);
+        SPRITE_NPC *npc = scene_get_npc (scene, handle);
+        if (npc && world_line_of_sight (scene->world, actor->box.center, sprite_npc_box (npc).center, WORLD_SOLID)) {
+            game->current_npc = handle;
+            break;
+        }
+    }
+
+    screen_update (&game->screen, actor->position, scene->map, dt);
+    sprite_update (actor, dt, STEP_TIME);
+
+    path_update (scene->paths, PATH_BUDGET);
+    actors_schedule (scene->actors, screen_box (&game->screen), NPC_NEAR_DISTANCE, NPC_FAR_DISTANCE,
+                     NPC_REDUCED_RATE, state->tick++);
+    sprite_update_npcs (game->jobs, scene->actors, dt, STEP_TIME, NPC_AI_BUDGET);
+}
+
+/* Copies out what is drawn alpha of the way past the last step. */
+static void game_capture (GAME_STATE *state, RENDER_SNAPSHOT *snapshot, float alpha)
+{
+    GAME *game = state->game;
+    SCENE *scene = game->current_scene;
+
+    snapshot->view = screen_interpolate (&game->screen, alpha);
+    snapshot->map = scene->map;
+
+    snapshot_add_actor (snapshot, game->current_actor, alpha);
+
+    BOX view_box = screen_box (&snapshot->view);
+    view_box.extent = vadd (view_box.extent, (VECTOR2D){VIEW_MARGIN, VIEW_MARGIN});
+    world_collide_fill (scene->world, &view_box, WORLD_NPC, &state->visible_npcs);
+    for (int j = 0; j < state->visible_npcs.num_collisions; j++) {
+        BOX *npc_box = *(BOX **)_al_vector_ref (&state->visible_npcs.boxes, j);
+        SPRITE_NPC *npc = scene_get_npc (scene, world_proxy_handle (npc_box));
+        if (npc)
+            snapshot_add_npc (snapshot, npc, alpha);
+    }
+
+    SPRITE_NPC *current_npc = scene_get_npc (scene, game->current_npc);
+    if (current_npc) {
+        BOX npc_box = sprite_npc_box (current_npc);
+        VECTOR2D offset = vsub (sprite_npc_position (current_npc, alpha),
+                                sprite_npc_position (current_npc, 1.0f));
+        snapshot->show_arrow = true;
+        snapshot->arrow = (VECTOR2D){npc_box.center.x + offset.x,
+                                     npc_box.center.y + offset.y - npc_box.extent.y * 3.0f};
+    }
+
+    DEBUG_DRAW *dd = snapshot->debug_draw;
+    dd->enabled = game->debug_draw->enabled;
+    debug_draw_begin (dd, &snapshot->view);
+    if (debug_draw_any (dd)) {
+        world_debug_draw (scene->world, dd);
+        if (debug_draw_enabled (dd, DEBUG_DRAW_HITS)) {
+            debug_draw_box (dd, game->current_actor->box, dd->colors[DEBUG_DRAW_HITS]);
+            for (int j = 0; j < state->actor_collisions.num_collisions; j++) {
+                BOX *box = *(BOX **)_al_vector_ref (&state->actor_collisions.boxes, j);
+                debug_draw_box (dd, *box, dd->colors[DEBUG_DRAW_HITS]);
+            }
+        }
+    }
+}
+
+/*
+ * Runs the steps the elapsed frame time allows and captures the result
+ * into the state's snapshot. This is the part a pipelined frame hands to
+ * the frame thread.
+ */
+static void game_frame (void *data)
+{
+    GAME_STATE *state = data;
+
+    snapshot_begin (state->snapshot);
+
+    state->accumulator = MIN (state->accumulator + state->frame_time, MAX_STEPS * STEP_TIME);
+    while (state->accumulator >= STEP_TIME && !state->quit) {
+        state->accumulator -= STEP_TIME;
+        game_step (state);
+    }
+
+    game_capture (state, state->snapshot, state->accumulator / STEP_TIME);
+}
+
+/* Draws a snapshot; touches nothing the simulation writes. */
+static void game_render (GAME *game, RENDER_SNAPSHOT *snapshot, ALLEGRO_FONT *font, ALLEGRO_BITMAP *sel_arrow,
+                         double curfps)
+{
+    SCREEN *view = &snapshot->view;
+
+    snapshot_apply_ui (snapshot, game->ui);
+
+    tiled_draw_map_back (snapshot->map, view->tint, view->position.x, view->position.y,
+                         view->width, view->height, 0, 0, 0);
+
+    al_draw_textf (font, al_map_rgba_f (0.9, 0, 0, 1), 5, 5, 0, "FPS: %.2f", curfps);
+    al_draw_textf (font, al_map_rgba_f (0.9, 0, 0, 1), 5, 20, 0, "Sprites: %d, %d vertices, %d draw calls",
+                   game->sprite_batch->num_quads, game->sprite_batch->num_vertices,
+                   game->sprite_batch->num_draw_calls);
+
+    sprite_batch_begin (game->sprite_batch);
+    snapshot_batch (snapshot, game->sprite_batch);
+    tiled_batch_objects (snapshot->map, game->sprite_batch, view->tint, view->position.x, view->position.y,
+                         view->width, view->height);
+    sprite_batch_flush (game->sprite_batch);
+
+    tiled_draw_map_fore (snapshot->map, view->tint, view->position.x, view->position.y,
+                         view->width, view->height, 0, 0, 0);
+
+    debug_draw_flush (snapshot->debug_draw);
+
+    if (snapshot->show_arrow) {
+        float dx = snapshot->arrow.x - view->position.x - al_get_bitmap_width (sel_arrow) * 0.5f;
+        float dy = snapshot->arrow.y - view->position.y;
+        al_draw_bitmap (sel_arrow, dx, dy, 0);
+    }
+
+    ui_draw (game->ui, view);
+    if (game->force_vsync)
+        al_wait_for_vsync ();
+
+    al_flip_display ();
+}
 
 void game_loop (GAME *game)
 {
     if (!game)
         return;
 
-    ALLEGRO_KEYBOARD_STATE keyboard_state;
     ALLEGRO_EVENT event;
     ALLEGRO_FONT *font = al_load_font ("data/fixed_font.tga", 0, 0);
-    SCENE *scene;
-    SPRITE_ACTOR *actor;
-    LIST_ITEM *item;
 
-    AABB_COLLISIONS collisions;
-    aabb_init_collisions (&collisions);
+    GAME_STATE state = {0};
+    state.game = game;
+    aabb_init_collisions (&state.actor_collisions);
+    aabb_init_collisions (&state.npc_collisions);
+    aabb_init_collisions (&state.visible_npcs);
+    trigger_init_set (&state.actor_triggers, WORLD_PORTAL | WORLD_TRIGGER, false);
 
-    AABB_COLLISIONS portal_collisions;
-    aabb_init_collisions (&portal_collisions);
+    /* Pipelined, one is drawn while the frame thread writes the other */
+    RENDER_SNAPSHOT snapshots[2];
+    snapshot_init (&snapshots[0]);
+    snapshot_init (&snapshots[1]);
+    int drawn = 0;
 
-    AABB_COLLISIONS npc_collisions;
-    aabb_init_collisions (&npc_collisions);
+    PIPELINE *pipeline = game->pipelined ? pipeline_create (game_frame, &state) : NULL;
+    debug ("Frames %s.", pipeline ? "pipelined" : "in sequence");
 
     int i = 0;
-    bool redraw = true;
     float times[NTIMES] = {0};
 
     double frame_time, current_time, new_time, mean_frame_time;
-    double fixed_dt = 1.0 / FPS, dt;
     double curfps = 0.0;
 
-    current_time = al_get_time ();
-    al_start_timer (game->timer);
-
-    float fadeout_duration = 0;
-    float fadein_duration = 0;
-    SCENE_PORTAL *dest_portal = NULL;
-
     char *arrow_path = get_resource_path_str ("data/ui/smallarrow_down.png");
     ALLEGRO_BITMAP *sel_arrow = al_load_bitmap (arrow_path);
 
-    while (game->running) {
-        scene = game->current_scene;
-        actor = game->current_actor;
-
-        if (redraw) {
-            al_clear_depth_buffer (0);
-            tiled_draw_map_back (scene->map, game->screen.tint,
-                                 game->screen.position.x, game->screen.position.y,
-                                 game->screen.width, game->screen.height, 0, 0, 0);
-
-            al_draw_textf (font, al_map_rgba_f (0.9, 0, 0, 1), 5, 5, 0, "FPS: %.2f", curfps);
-
-            al_set_render_state (ALLEGRO_ALPHA_TEST, true);
-            al_set_render_state (ALLEGRO_DEPTH_TEST, true);
-            al_set_render_state (ALLEGRO_DEPTH_FUNCTION, ALLEGRO_RENDER_GREATER);
-
-            al_hold_bitmap_drawing (true);
-            sprite_draw (actor, &game->screen);
-            item = _al_list_front (scene->npcs);
-            while (item) {
-                SPRITE_ACTOR *npc_actor = (SPRITE_ACTOR *)_al_list_item_data (item);
-                sprite_draw (npc_actor, &game->screen);
-                item = _al_list_next (scene->npcs, item);
-            }
-            al_hold_bitmap_drawing (false);
+    /* Nothing to simulate yet, but the first pipelined frame draws this */
+    state.snapshot = &snapshots[0];
+    game_frame (&state);
 
-            al_set_render_state (ALLEGRO_DEPTH_TEST, false);
-            al_set_render_state (ALLEGRO_ALPHA_TEST, false);
-
-            if (false) {
-                item = _al_list_front (portal_collisions.boxes);
-                while (item) {
-                    BOX *box = _al_list_item_data (item);
-                    box_draw (*box, game->screen.position, al_map_rgb_f (1, 0, 0));
-                    item = _al_list_next (portal_collisions.boxes, item);
-                }
-
-                aabb_draw (scene->portal_tree, &game->screen, al_map_rgb_f (0, 0, 1));
-            }
+    current_time = al_get_time ();
+    if (game->timer)
+        al_start_timer (game->timer);
 
-            tiled_draw_map_fore (scene->map, game->screen.tint,
-                                 game->screen.position.x, game->screen.position.y,
-                                 game->screen.width, game->screen.height, 0, 0, 0);
+    while (game->running) {
+        if (game->timer)
+            al_wait_for_event (game->event_queue, NULL);
 
-            if (game->current_npc) {
-                float dx = game->current_npc->actor.box.center.x - game->screen.position.x;
-                float dy = game->current_npc->actor.box.center.y - game->screen.position.y;
-                dx -= al_get_bitmap_width (sel_arrow) * 0.5f;
-                dy -= game->current_npc->actor.box.extent.y * 3.0f;
-                al_draw_bitmap (sel_arrow, dx, dy, 0);
+        while (al_get_next_event (game->event_queue, &event)) {
+            switch (event.type) {
+                case ALLEGRO_EVENT_TIMER:
+                    break;
+                case ALLEGRO_EVENT_DISPLAY_CLOSE:
+                    game->running = false;
+                    break;
+                default:
+                    fprintf (stderr, "Unsupported event received: %d\n", event.type);
+                    break;
             }
+        }
 
-            ui_draw (game->ui, &game->screen);
-            if (game->force_vsync)
-                al_wait_for_vsync ();
-
-            al_flip_display ();
-            redraw = false;
+        new_time = al_get_time ();
+        frame_time = new_time - current_time;
+        current_time = new_time;
+
+        times[i] = frame_time;
+        i = (i + 1) % NTIMES;
+
+        mean_frame_time = 0.0;
+        for (int j = 0; j < NTIMES; j++)
+            mean_frame_time += times[j];
+
+        mean_frame_time /= NTIMES;
+        curfps = 1.0 / mean_frame_time;
+
+        state.frame_time = frame_time;
+        if (pipeline) {
+            state.snapshot = &snapshots[1 - drawn];
+            pipeline_start (pipeline);
+            game_render (game, &snapshots[drawn], font, sel_arrow, curfps);
+            pipeline_wait (pipeline);
+            drawn = 1 - drawn;
+        } else {
+            game_frame (&state);
+            game_render (game, state.snapshot, font, sel_arrow, curfps);
         }
 
-        al_wait_for_event (game->event_queue, &event);
-
-        switch (event.type) {
-            case ALLEGRO_EVENT_TIMER:
-                new_time = al_get_time ();
-                frame_time = new_time - current_time;
-                current_time = new_time;
-
-                times[i] = frame_time;
-                i = (i + 1) % NTIMES;
-
-                mean_frame_time = 0.0;
-                for (int j = 0; j < NTIMES; j++)
-                    mean_frame_time += times[j];
-
-                mean_frame_time /= NTIMES;
-                curfps = 1.0 / mean_frame_time;
-
-                dt = mean_frame_time / fixed_dt;
-
-                if (fadeout_duration > 0.0f) {
-                    float fadef = fadeout_duration / TRANS_TIME;
-                    game->screen.tint = al_map_rgba_f (fadef, fadef, fadef, 1.0);
-                    fadeout_duration -= mean_frame_time;
-                    if (fadeout_duration <= 0.0f) {
-                        fadein_duration = TRANS_TIME;
-                        fadeout_duration = 0.0f;
-                        game_enter_portal (game, dest_portal);
-                    }
-                }
-
-                if (fadein_duration > 0.0f) {
-                    float fadef = 1.0 - fadein_duration / TRANS_TIME;
-                    game->screen.tint = al_map_rgba_f (fadef, fadef, fadef, 1.0);
-                    fadein_duration -= mean_frame_time;
-                    if (fadein_duration <= 0.0f) {
-                        game->paused = false;
-                        fadein_duration = 0.0f;
-                    }
-                }
-
-                if (game->paused) {
-                    redraw = true;
-                    break;
-                }
+        if (state.quit)
+            game->running = false;
+    }
 
-                al_get_keyboard_state (&keyboard_state);
+    pipeline_free (pipeline);
 
-                if (al_key_down (&keyboard_state, ALLEGRO_KEY_ESCAPE)) {
-                    game->running = false;
-                    continue;
-                }
-
-                if (al_key_down (&keyboard_state, ALLEGRO_KEY_ENTER)) {
-                    ui_show_dialog (game->ui, NULL, NULL);
-                }
-
-                if (al_key_down (&keyboard_state, ALLEGRO_KEY_RIGHT)) {
-                    actor->event->move_right (actor, dt);
-                }
-                if (al_key_down (&keyboard_state, ALLEGRO_KEY_LEFT)) {
-                    actor->event->move_left (actor, dt);
-                }
-                if (al_key_down (&keyboard_state, ALLEGRO_KEY_UP)) {
-                    actor->event->move_up (actor, dt);
-                }
-                if (al_key_down (&keyboard_state, ALLEGRO_KEY_DOWN)) {
-                    actor->event->move_down (actor, dt);
-                }
-
-                BOX box = actor->box;
-                box.center.x += actor->movement.x * dt;
-                box.center.y += actor->movement.y * dt;
-
-                aabb_collide_fill_cache (scene->collision_tree, &box, &collisions);
-                if (scene->collision_tree->num_collisions > 0) {
-                    item = _al_list_front (collisions.boxes);
-                    while (item) {
-                        if (box_lateral (*(BOX *)_al_list_item_data (item), actor->box))
-                            actor->movement.x = 0;
-                        else
-                            actor->movement.y = 0;
-                        item = _al_list_next (collisions.boxes, item);
-                    }
-                }
-
-                aabb_collide_fill_cache (scene->portal_tree, &box, &portal_collisions);
-                if (scene->portal_tree->num_collisions > 0) {
-                    item = _al_list_front (portal_collisions.boxes);
-                    while (item) {
-                        BOX *colbox = _al_list_item_data (item);
-                        TILED_OBJECT *obj = colbox->data;
-                        SCENE_PORTAL *portal = scene_get_portal (game->scenes, obj->name);
-                        if (portal && portal->destiny_portal) {
-                            dest_portal = scene_get_portal (game->scenes, portal->destiny_portal);
-                            if (dest_portal) {
-                                fadeout_duration = TRANS_TIME;
-                                game->paused = true;
-                                actor->movement = (VECTOR2D){0, 0};
-                                ui_show_dialog_cstr (game->ui, "Speaker:", "Entering portal.");
-                                break;
-                            }
-                        }
-                        item = _al_list_next (portal_collisions.boxes, item);
-                    }
-                }
-
-                box = screen_box (&game->screen);
-
-                game->current_npc = NULL;
-                item = _al_list_front (scene->npcs);
-                float max_dist = 0;
-                while (item) {
-                    SPRITE_NPC *npc = _al_list_item_data (item);
-                    float dist = vsqdistance (npc->actor.box.center, game->current_actor->box.center);
-                    if (dist < 128.0f * 128.0f && dist > max_dist) {
-                        game->current_npc = npc;
-                        max_dist = dist;
-                    }
-                    item = _al_list_next (scene->npcs, item);
-                }
-
-                //aabb_collide_fill_cache (scene->npc_tree, &box, &npc_collisions);
-                //if (scene->npc_tree->num_collisions > 0) {
-                //    item = _al_list_front (npc_collisions.boxes);
-                //    float max_dist = 0;
-                //    while (item) {
-                //        BOX *colbox = _al_list_item_data (item);
-                //        SPRITE_NPC *npc = colbox->data;
-                //        float dist = vsqdistance (npc->actor.box.center, game->current_actor->box.center);
-                //        if (dist < 128.0f * 128.0f && dist > max_dist) {
-                //            game->current_npc = npc;
-                //            max_dist = dist;
-                //        }
-                //        item = _al_list_next (npc_collisions.boxes, item);
-                //    }
-                //}
-
-                screen_update (&game->screen, actor->position, scene->map, dt);
-                sprite_update (actor, dt, mean_frame_time);
-
-                item = _al_list_front (scene->npcs);
-                while (item) {
-                    SPRITE_ACTOR *npc_actor = (SPRITE_ACTOR *)_al_list_item_data (item);
-                    sprite_update (npc_actor, dt, mean_frame_time);
-                    item = _al_list_next (scene->npcs, item);
-                }
-
-                redraw = true;
-                break;
-            case ALLEGRO_EVENT_DISPLAY_CLOSE:
-                game->running = false;
-                break;
-            default:
-                fprintf (stderr, "Unsupported event received: %d\n", event.type);
-                break;
-        }
-    }
+    debug ("Actor cache: %d hits, %d misses", state.actor_collisions.cache_hits, state.actor_collisions.cache_misses);
 
-    aabb_free_collisions (&collisions);
-    aabb_free_collisions (&portal_collisions);
-    aabb_free_collisions (&npc_collisions);
+    aabb_free_collisions (&state.actor_collisions);
+    aabb_free_collisions (&state.npc_collisions);
+    aabb_free_collisions (&state.visible_npcs);
+    trigger_free_set (&state.actor_triggers);
+    snapshot_free (&snapshots[0]);
+    snapshot_free (&snapshots[1]);
 }
 
 void game_destroy (GAME *game)
@@ -482,9 +624,14 @@ void game_destroy (GAME *game)
     if (game) {
         al_destroy_display (game->display);
         al_destroy_event_queue (game->event_queue);
+        if (game->timer)
+            al_destroy_timer (game->timer);
         scene_free (game->scenes);
         sprite_free (game->sprites);
         sprite_free_actor (game->current_actor, NULL);
+        debug_draw_free (game->debug_draw);
+        sprite_batch_free (game->sprite_batch);
+        jobs_free (game->jobs);
         al_free (game);
     }
 }
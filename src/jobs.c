@@ -0,0 +1,230 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+/*
+ * Job system. Work is submitted as a parallel loop: the range is cut into
+ * chunks, the chunks are dealt round robin over the workers' queues and
+ * the call returns once every chunk ran. A worker that empties its own
+ * queue steals from the front of the others', so uneven chunks even out
+ * without a shared queue everyone fights over.
+ *
+ * Loops are submitted by one thread at a time, not necessarily the one
+ * that created the system; jobs must not submit loops themselves. Chunks run in no
+ * particular order and on any thread, so a job may only write the items
+ * of its own range.
+ *
+ * Queues are locked arrays rather than lock free deques: a loop is cut
+ * into a few dozen chunks at most, so the locks are taken a few dozen
+ * times per loop.
+ */
+
+#include "nostos/jobs.h"
+
+typedef struct WORKER {
+    JOBS *jobs;
+    int index;
+} WORKER;
+
+static void queue_push (JOB_QUEUE *queue, JOB job)
+{
+    al_lock_mutex (queue->mutex);
+
+    if (queue->front == queue->back)
+        queue->front = queue->back = 0;
+
+    if (queue->back == queue->capacity) {
+        queue->capacity = MAX (16, queue->capacity * 2);
+        queue->jobs = al_realloc (queue->jobs, queue->capacity * sizeof (JOB));
+    }
+
+    queue->jobs[queue->back++] = job;
+    al_unlock_mutex (queue->mutex);
+}
+
+static bool queue_pop_back (JOB_QUEUE *queue, JOB *job)
+{
+    bool found = false;
+
+    al_lock_mutex (queue->mutex);
+    if (queue->front < queue->back) {
+        *job = queue->jobs[--queue->back];
+        found = true;
+    }
+    al_unlock_mutex (queue->mutex);
+
+    return found;
+}
+
+static bool queue_pop_front (JOB_QUEUE *queue, JOB *job)
+{
+    bool found = false;
+
+    al_lock_mutex (queue->mutex);
+    if (queue->front < queue->back) {
+        *job = queue->jobs[queue->front++];
+        found = true;
+    }
+    al_unlock_mutex (queue->mutex);
+
+    return found;
+}
+
+/* Own queue first, then the others starting from the next worker. */
+static bool jobs_take (JOBS *jobs, int index, JOB *job)
+{
+    bool found = queue_pop_back (&jobs->queues[index], job);
+
+    for (int i = 1; !found && i < jobs->num_workers; i++)
+        found = queue_pop_front (&jobs->queues[(index + i) % jobs->num_workers], job);
+
+    if (found) {
+        al_lock_mutex (jobs->mutex);
+        jobs->queued--;
+        al_unlock_mutex (jobs->mutex);
+    }
+
+    return found;
+}
+
+static void jobs_run (JOBS *jobs, JOB *job)
+{
+    job->fn (job->data, job->begin, job->end);
+
+    al_lock_mutex (jobs->mutex);
+    if (--jobs->pending == 0)
+        al_broadcast_cond (jobs->done);
+    al_unlock_mutex (jobs->mutex);
+}
+
+static void *worker_thread (ALLEGRO_THREAD *thread, void *arg)
+{
+    WORKER *worker = arg;
+    JOBS *jobs = worker->jobs;
+    JOB job;
+
+    while (true) {
+        if (jobs_take (jobs, worker->index, &job)) {
+            jobs_run (jobs, &job);
+            continue;
+        }
+
+        al_lock_mutex (jobs->mutex);
+        while (jobs->queued == 0 && !jobs->stopping)
+            al_wait_cond (jobs->wake, jobs->mutex);
+        bool stopping = jobs->stopping;
+        al_unlock_mutex (jobs->mutex);
+
+        if (stopping)
+            break;
+    }
+
+    al_free (worker);
+    return NULL;
+}
+
+/*
+ * Starts num_threads workers besides the calling thread, or one less than
+ * the number of cores when num_threads is negative.
+ */
+JOBS *jobs_create (int num_threads)
+{
+    if (num_threads < 0)
+        num_threads = MAX (al_get_cpu_count () - 1, 0);
+
+    JOBS *jobs = al_calloc (1, sizeof (JOBS));
+    jobs->num_workers = num_threads + 1;
+    jobs->queues = al_calloc (jobs->num_workers, sizeof (JOB_QUEUE));
+    jobs->threads = al_calloc (num_threads, sizeof (ALLEGRO_THREAD *));
+    jobs->mutex = al_create_mutex ();
+    jobs->wake = al_create_cond ();
+    jobs->done = al_create_cond ();
+
+    for (int i = 0; i < jobs->num_workers; i++)
+        jobs->queues[i].mutex = al_create_mutex ();
+
+    for (int i = 0; i < num_threads; i++) {
+        WORKER *worker = al_malloc (sizeof (WORKER));
+        worker->jobs = jobs;
+        worker->index = i + 1;
+
+        jobs->threads[i] = al_create_thread (worker_thread, worker);
+        if (!jobs->threads[i]) {
+            debug ("Failed to create job thread %d, running with %d.", i + 1, i);
+            al_free (worker);
+            jobs->num_workers = i + 1;
+            break;
+        }
+        al_start_thread (jobs->threads[i]);
+    }
+
+    debug ("Job system running on %d threads.", jobs->num_workers);
+    return jobs;
+}
+
+/*
+ * Calls fn over [0, count) in chunks of grain items and waits for all of
+ * them. With no jobs, a single worker or a single chunk, fn just runs here.
+ */
+void jobs_parallel_for (JOBS *jobs, int count, int grain, JOB_FN fn, void *data)
+{
+    assert (fn);
+    assert (grain > 0);
+
+    if (count <= 0)
+        return;
+
+    if (!jobs || jobs->num_workers == 1 || count <= grain) {
+        fn (data, 0, count);
+        return;
+    }
+
+    int num_chunks = (count + grain - 1) / grain;
+    for (int i = 0; i < num_chunks; i++) {
+        JOB job = {fn, data, i * grain, MIN ((i + 1) * grain, count)};
+        queue_push (&jobs->queues[i % jobs->num_workers], job);
+    }
+
+    al_lock_mutex (jobs->mutex);
+    jobs->queued += num_chunks;
+    jobs->pending += num_chunks;
+    al_broadcast_cond (jobs->wake);
+    al_unlock_mutex (jobs->mutex);
+
+    JOB job;
+    while (jobs_take (jobs, 0, &job))
+        jobs_run (jobs, &job);
+
+    al_lock_mutex (jobs->mutex);
+    while (jobs->pending > 0)
+        al_wait_cond (jobs->done, jobs->mutex);
+    al_unlock_mutex (jobs->mutex);
+}
+
+void jobs_free (JOBS *jobs)
+{
+    if (!jobs)
+        return;
+
+    al_lock_mutex (jobs->mutex);
+    jobs->stopping = true;
+    al_broadcast_cond (jobs->wake);
+    al_unlock_mutex (jobs->mutex);
+
+    for (int i = 0; i < jobs->num_workers - 1; i++) {
+        al_join_thread (jobs->threads[i], NULL);
+        al_destroy_thread (jobs->threads[i]);
+    }
+
+    for (int i = 0; i < jobs->num_workers; i++) {
+        al_destroy_mutex (jobs->queues[i].mutex);
+        al_free (jobs->queues[i].jobs);
+    }
+
+    al_destroy_cond (jobs->done);
+    al_destroy_cond (jobs->wake);
+    al_destroy_mutex (jobs->mutex);
+    al_free (jobs->threads);
+    al_free (jobs->queues);
+    al_free (jobs);
+}
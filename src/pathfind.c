@@ -0,0 +1,1060 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+/*
+ * Pathfinding over the map cells. A cell is blocked when something in the
+ * world mask overlaps it, sampled once when the pathfinder is created, so
+ * routes follow the same walls world_move stops actors at.
+ *
+ * Searches are A* with jump point search pruning on an eight connected
+ * grid where diagonal steps may not cut corners. Instead of opening every
+ * neighbour, a search scans along straight and diagonal lines and only
+ * stops on cells where the route could turn, so open areas cost a few
+ * nodes instead of every cell in them. The jump points found are also the
+ * waypoints: the segments between them are straight and clear.
+ *
+ * Requests are queued and served by path_update under a budget of work
+ * per call, counted in cells scanned and nodes expanded. A search that
+ * runs out of budget is resumed on the next call, so hundreds of callers
+ * asking at once spread over frames instead of stalling one. Everything a
+ * search uses is allocated once: per cell state is valid only when
+ * stamped with the current search number, so nothing is cleared between
+ * searches. Recent results, failures included, are kept in a small least
+ * recently used cache, since the same few trips get asked for again and
+ * again.
+ *
+ * Long trips are planned in two levels (HPA*). At creation the grid is cut
+ * in clusters, every open stretch of border between two clusters gets a
+ * crossing with a node on either side, and the cost between each pair of
+ * nodes within a cluster is found once. A long request links its two ends
+ * to the nodes of their clusters and searches that graph, a few nodes per
+ * cluster crossed instead of every cell on the way, and hands back the
+ * entrances passed as a corridor. The cells between consecutive entrances
+ * are only searched when the walker gets there, as short requests of their
+ * own that mostly come out of the cache.
+ *
+ * Requests may come from any thread; path_update and path_free must not
+ * run at the same time as them.
+ */
+
+#include "nostos/pathfind.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PATH_CACHE_SIZE 64
+#define DIAGONAL_COST 1.41421356f
+
+/* Cells a cluster side, and border stretches that get two crossings */
+#define CLUSTER_SIZE 16
+#define ENTRANCE_SPLIT 6
+
+/* Requests farther apart than this go through the clusters */
+#define COARSE_DISTANCE (2 * CLUSTER_SIZE)
+
+/* Refined waypoints left when the next leg of a corridor is asked for */
+#define REFINE_AHEAD 2
+
+/* Cells overlapping a wall by less than this are left walkable */
+#define CELL_MARGIN 1.0f
+
+typedef struct BLOCK_QUERY {
+    bool blocked;
+} BLOCK_QUERY;
+
+typedef struct GRAPH_EDGE {
+    int from;
+    int to;
+    float cost;
+} GRAPH_EDGE;
+
+static void build_graph (PATHFINDER *paths);
+
+static bool block_visit (BOX *box, void *user)
+{
+    BLOCK_QUERY *query = user;
+    query->blocked = true;
+    return false;
+}
+
+PATHFINDER *path_create (const WORLD *world, const TILED_MAP *map, unsigned int mask)
+{
+    assert (world);
+    assert (map);
+
+    PATHFINDER *paths = al_calloc (1, sizeof (PATHFINDER));
+    paths->width = map->width;
+    paths->height = map->height;
+    paths->cell_width = map->tile_width;
+    paths->cell_height = map->tile_height;
+
+    int num_cells = paths->width * paths->height;
+    paths->blocked = al_malloc (MAX (num_cells, 1));
+    paths->g = al_malloc (MAX (num_cells, 1) * sizeof (float));
+    paths->parent = al_malloc (MAX (num_cells, 1) * sizeof (int));
+    paths->seen = al_calloc (MAX (num_cells, 1), sizeof (unsigned int));
+    paths->closed = al_calloc (MAX (num_cells, 1), sizeof (unsigned int));
+
+    VECTOR2D extent = {paths->cell_width / 2.0f - CELL_MARGIN, paths->cell_height / 2.0f - CELL_MARGIN};
+    for (int y = 0; y < paths->height; y++) {
+        for (int x = 0; x < paths->width; x++) {
+            BOX cell = {{(x + 0.5f) * paths->cell_width, (y + 0.5f) * paths->cell_height}, extent, NULL};
+            BLOCK_QUERY query = {false};
+            world_query_visit (world, &cell, mask, NULL, block_visit, &query);
+            paths->blocked[y * paths->width + x] = query.blocked;
+        }
+    }
+
+    paths->mutex = al_create_mutex ();
+    _al_vector_init (&paths->requests, sizeof (PATH_REQUEST));
+
+    paths->cache = al_calloc (PATH_CACHE_SIZE, sizeof (PATH_CACHE_ENTRY));
+    for (int i = 0; i < PATH_CACHE_SIZE; i++)
+        _al_vector_init (&paths->cache[i].cells, sizeof (int));
+
+    build_graph (paths);
+    debug ("Pathfinder: %d x %d cells, %d cluster nodes", paths->width, paths->height, paths->num_nodes);
+
+    return paths;
+}
+
+bool path_walkable (const PATHFINDER *paths, int x, int y)
+{
+    return x >= 0 && y >= 0 && x < paths->width && y < paths->height && !paths->blocked[y * paths->width + x];
+}
+
+static inline int cell_at (const PATHFINDER *paths, VECTOR2D p)
+{
+    int x = CLAMP (0, (int) floorf (p.x / paths->cell_width), paths->width - 1);
+    int y = CLAMP (0, (int) floorf (p.y / paths->cell_height), paths->height - 1);
+    return y * paths->width + x;
+}
+
+static inline VECTOR2D cell_center (const PATHFINDER *paths, int cell)
+{
+    return (VECTOR2D){(cell % paths->width + 0.5f) * paths->cell_width,
+                      (cell / paths->width + 0.5f) * paths->cell_height};
+}
+
+/* Cost of the cheapest unobstructed route, straight and diagonal steps. */
+static inline float octile (const PATHFINDER *paths, int a, int b)
+{
+    int dx = abs (a % paths->width - b % paths->width);
+    int dy = abs (a / paths->width - b / paths->width);
+    return (dx + dy) + (DIAGONAL_COST - 2) * MIN (dx, dy);
+}
+
+static void heap_push (PATHFINDER *paths, PATH_NODE node)
+{
+    if (paths->heap_size == paths->heap_capacity) {
+        paths->heap_capacity = MAX (64, paths->heap_capacity * 2);
+        paths->heap = al_realloc (paths->heap, paths->heap_capacity * sizeof (PATH_NODE));
+    }
+
+    PATH_NODE *heap = paths->heap;
+    int i = paths->heap_size++;
+    while (i > 0) {
+        int up = (i - 1) / 2;
+        if (heap[up].f <= node.f)
+            break;
+        heap[i] = heap[up];
+        i = up;
+    }
+    heap[i] = node;
+}
+
+static PATH_NODE heap_pop (PATHFINDER *paths)
+{
+    PATH_NODE *heap = paths->heap;
+    PATH_NODE top = heap[0];
+    PATH_NODE last = heap[--paths->heap_size];
+    int n = paths->heap_size;
+
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= n)
+            break;
+        if (child + 1 < n && heap[child + 1].f < heap[child].f)
+            child++;
+        if (last.f <= heap[child].f)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (n > 0)
+        heap[i] = last;
+
+    return top;
+}
+
+/*
+ * Scans from (x, y) along a straight line, returning the first cell where
+ * a route could turn (a wall beside it just ended) or the goal, -1 when it
+ * runs into a wall first.
+ */
+static int jump_straight (PATHFINDER *paths, int x, int y, int dx, int dy, int goal, int *work)
+{
+    for (;;) {
+        (*work)++;
+
+        if (!path_walkable (paths, x, y))
+            return -1;
+
+        int cell = y * paths->width + x;
+        if (cell == goal)
+            return cell;
+
+        if (dx) {
+            if ((path_walkable (paths, x, y - 1) && !path_walkable (paths, x - dx, y - 1)) ||
+                (path_walkable (paths, x, y + 1) && !path_walkable (paths, x - dx, y + 1)))
+                return cell;
+        } else {
+            if ((path_walkable (paths, x - 1, y) && !path_walkable (paths, x - 1, y - dy)) ||
+                (path_walkable (paths, x + 1, y) && !path_walkable (paths, x + 1, y - dy)))
+                return cell;
+        }
+
+        x += dx;
+        y += dy;
+    }
+}
+
+/*
+ * Same along a diagonal, which also stops where either straight line
+ * leaving the cell forward finds something. Diagonal steps need both cells
+ * beside them open.
+ */
+static int jump (PATHFINDER *paths, int x, int y, int dx, int dy, int goal, int *work)
+{
+    if (!dx || !dy)
+        return jump_straight (paths, x, y, dx, dy, goal, work);
+
+    for (;;) {
+        (*work)++;
+
+        if (!path_walkable (paths, x, y))
+            return -1;
+
+        int cell = y * paths->width + x;
+        if (cell == goal)
+            return cell;
+
+        if (jump_straight (paths, x + dx, y, dx, 0, goal, work) >= 0 ||
+            jump_straight (paths, x, y + dy, 0, dy, goal, work) >= 0)
+            return cell;
+
+        if (!path_walkable (paths, x + dx, y) || !path_walkable (paths, x, y + dy))
+            return -1;
+
+        x += dx;
+        y += dy;
+    }
+}
+
+/* Directions worth scanning from cell, given the one it was reached by. */
+static int prune (const PATHFINDER *paths, int cell, int *dirs)
+{
+    int x = cell % paths->width, y = cell / paths->width;
+    int n = 0;
+
+    if (paths->parent[cell] < 0) {
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                if ((!dx && !dy) || !path_walkable (paths, x + dx, y + dy))
+                    continue;
+                if (dx && dy && (!path_walkable (paths, x + dx, y) || !path_walkable (paths, x, y + dy)))
+                    continue;
+                dirs[n++] = dx;
+                dirs[n++] = dy;
+            }
+        }
+        return n / 2;
+    }
+
+    int parent = paths->parent[cell];
+    int dx = x - parent % paths->width, dy = y - parent / paths->width;
+    dx = (dx > 0) - (dx < 0);
+    dy = (dy > 0) - (dy < 0);
+
+    if (dx && dy) {
+        bool vertical = path_walkable (paths, x, y + dy);
+        bool horizontal = path_walkable (paths, x + dx, y);
+        if (vertical) {
+            dirs[n++] = 0;
+            dirs[n++] = dy;
+        }
+        if (horizontal) {
+            dirs[n++] = dx;
+            dirs[n++] = 0;
+        }
+        if (vertical && horizontal) {
+            dirs[n++] = dx;
+            dirs[n++] = dy;
+        }
+    } else {
+        /* Sideways steps are kept, which also covers the corners left behind */
+        int sx = dy, sy = dx;
+        bool ahead = path_walkable (paths, x + dx, y + dy);
+        bool left = path_walkable (paths, x - sx, y - sy);
+        bool right = path_walkable (paths, x + sx, y + sy);
+
+        if (ahead) {
+            dirs[n++] = dx;
+            dirs[n++] = dy;
+            if (left) {
+                dirs[n++] = dx - sx;
+                dirs[n++] = dy - sy;
+            }
+            if (right) {
+                dirs[n++] = dx + sx;
+                dirs[n++] = dy + sy;
+            }
+        }
+        if (left) {
+            dirs[n++] = -sx;
+            dirs[n++] = -sy;
+        }
+        if (right) {
+            dirs[n++] = sx;
+            dirs[n++] = sy;
+        }
+    }
+
+    return n / 2;
+}
+
+static unsigned int next_search (PATHFINDER *paths)
+{
+    if (++paths->search == 0) {
+        /* Stamps wrapped around, old ones could match again */
+        int num_cells = paths->width * paths->height;
+        memset (paths->seen, 0, num_cells * sizeof (unsigned int));
+        memset (paths->closed, 0, num_cells * sizeof (unsigned int));
+        paths->search = 1;
+    }
+    return paths->search;
+}
+
+static void search_begin (PATHFINDER *paths, const PATH_REQUEST *request)
+{
+    next_search (paths);
+
+    paths->active = *request;
+    paths->searching = true;
+    paths->heap_size = 0;
+
+    int start = request->start;
+    paths->g[start] = 0;
+    paths->parent[start] = -1;
+    paths->seen[start] = paths->search;
+    heap_push (paths, (PATH_NODE){octile (paths, start, request->goal), 0, start});
+}
+
+/* Runs the active search until it ends or work reaches budget. */
+static int search_run (PATHFINDER *paths, int *work, int budget)
+{
+    int goal = paths->active.goal;
+    unsigned int search = paths->search;
+
+    while (*work < budget) {
+        if (paths->heap_size == 0)
+            return PATH_FAILED;
+
+        PATH_NODE node = heap_pop (paths);
+        int cell = node.cell;
+        if (paths->closed[cell] == search || node.g > paths->g[cell])
+            continue;
+
+        paths->closed[cell] = search;
+        paths->expansions++;
+        (*work)++;
+
+        if (cell == goal)
+            return PATH_FOUND;
+
+        int dirs[16];
+        int num_dirs = prune (paths, cell, dirs);
+        int x = cell % paths->width, y = cell / paths->width;
+
+        for (int d = 0; d < num_dirs; d++) {
+            int dx = dirs[2 * d], dy = dirs[2 * d + 1];
+            int next = jump (paths, x + dx, y + dy, dx, dy, goal, work);
+            if (next < 0 || paths->closed[next] == search)
+                continue;
+
+            float g = node.g + octile (paths, cell, next);
+            if (paths->seen[next] != search || g < paths->g[next]) {
+                paths->seen[next] = search;
+                paths->g[next] = g;
+                paths->parent[next] = cell;
+                heap_push (paths, (PATH_NODE){g + octile (paths, next, goal), g, next});
+            }
+        }
+    }
+
+    return PATH_PENDING;
+}
+
+static inline int cluster_of (const PATHFINDER *paths, int cell)
+{
+    int size = paths->cluster_size;
+    return (cell / paths->width / size) * paths->clusters_x + cell % paths->width / size;
+}
+
+/*
+ * Dijkstra from start over the cells of its cluster, without leaving it.
+ * The costs are left in g for cluster_cost to read.
+ */
+static void cluster_search (PATHFINDER *paths, int start, int *work)
+{
+    unsigned int search = next_search (paths);
+    int size = paths->cluster_size;
+    int x0 = start % paths->width / size * size, y0 = start / paths->width / size * size;
+    int x1 = MIN (x0 + size, paths->width), y1 = MIN (y0 + size, paths->height);
+
+    paths->heap_size = 0;
+    paths->g[start] = 0;
+    paths->seen[start] = search;
+    heap_push (paths, (PATH_NODE){0, 0, start});
+
+    while (paths->heap_size > 0) {
+        PATH_NODE node = heap_pop (paths);
+        int cell = node.cell;
+        if (paths->closed[cell] == search || node.g > paths->g[cell])
+            continue;
+
+        paths->closed[cell] = search;
+        (*work)++;
+
+        int x = cell % paths->width, y = cell / paths->width;
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                int nx = x + dx, ny = y + dy;
+                if ((!dx && !dy) || nx < x0 || ny < y0 || nx >= x1 || ny >= y1 || !path_walkable (paths, nx, ny))
+                    continue;
+                if (dx && dy && (!path_walkable (paths, nx, y) || !path_walkable (paths, x, ny)))
+                    continue;
+
+                int next = ny * paths->width + nx;
+                float g = node.g + (dx && dy ? DIAGONAL_COST : 1);
+                if (paths->seen[next] != search || g < paths->g[next]) {
+                    paths->seen[next] = search;
+                    paths->g[next] = g;
+                    heap_push (paths, (PATH_NODE){g, g, next});
+                }
+            }
+        }
+    }
+}
+
+static inline float cluster_cost (const PATHFINDER *paths, int cell)
+{
+    return paths->closed[cell] == paths->search ? paths->g[cell] : INFINITY;
+}
+
+static int graph_node (int *cell_node, VECTOR *cells, int cell)
+{
+    if (cell_node[cell] < 0) {
+        cell_node[cell] = _al_vector_size (cells);
+        *(int *)_al_vector_alloc_back (cells) = cell;
+    }
+    return cell_node[cell];
+}
+
+static void add_edge (VECTOR *edges, int from, int to, float cost)
+{
+    *(GRAPH_EDGE *)_al_vector_alloc_back (edges) = (GRAPH_EDGE){from, to, cost};
+}
+
+/*
+ * Crossings along one cluster border: the cells (x, y) + i * (dx, dy) for
+ * i below length, each paired with the cell (ox, oy) away from it across
+ * the border. Every run of open pairs gets a crossing in its middle, long
+ * runs one at either end instead.
+ */
+static void add_border (PATHFINDER *paths, int *cell_node, VECTOR *cells, VECTOR *edges,
+                        int x, int y, int dx, int dy, int ox, int oy, int length)
+{
+    int run = 0;
+
+    for (int i = 0; i <= length; i++) {
+        int cx = x + i * dx, cy = y + i * dy;
+        if (i < length && path_walkable (paths, cx, cy) && path_walkable (paths, cx + ox, cy + oy)) {
+            run++;
+            continue;
+        }
+
+        if (run == 0)
+            continue;
+
+        int crossings[2] = {i - run, i - 1};
+        int num_crossings = 2;
+        if (run < ENTRANCE_SPLIT) {
+            crossings[0] = i - (run + 1) / 2;
+            num_crossings = 1;
+        }
+
+        for (int k = 0; k < num_crossings; k++) {
+            int a = (y + crossings[k] * dy) * paths->width + x + crossings[k] * dx;
+            int b = a + oy * paths->width + ox;
+            int na = graph_node (cell_node, cells, a);
+            int nb = graph_node (cell_node, cells, b);
+            add_edge (edges, na, nb, 1);
+            add_edge (edges, nb, na, 1);
+        }
+
+        run = 0;
+    }
+}
+
+/* Finds the crossings and the costs between nodes sharing a cluster. */
+static void build_graph (PATHFINDER *paths)
+{
+    int size = paths->cluster_size = CLUSTER_SIZE;
+    paths->clusters_x = (paths->width + size - 1) / size;
+    paths->clusters_y = (paths->height + size - 1) / size;
+
+    int num_cells = paths->width * paths->height;
+    int num_clusters = paths->clusters_x * paths->clusters_y;
+    int *cell_node = al_malloc (MAX (num_cells, 1) * sizeof (int));
+    for (int i = 0; i < num_cells; i++)
+        cell_node[i] = -1;
+
+    VECTOR cells, edges;
+    _al_vector_init (&cells, sizeof (int));
+    _al_vector_init (&edges, sizeof (GRAPH_EDGE));
+
+    for (int cy = 0; cy < paths->clusters_y; cy++) {
+        for (int cx = 0; cx < paths->clusters_x; cx++) {
+            int x0 = cx * size, y0 = cy * size;
+            if (cx + 1 < paths->clusters_x)
+                add_border (paths, cell_node, &cells, &edges, x0 + size - 1, y0, 0, 1, 1, 0,
+                            MIN (size, paths->height - y0));
+            if (cy + 1 < paths->clusters_y)
+                add_border (paths, cell_node, &cells, &edges, x0, y0 + size - 1, 1, 0, 0, 1,
+                            MIN (size, paths->width - x0));
+        }
+    }
+
+    int n = paths->num_nodes = _al_vector_size (&cells);
+    paths->node_cell = al_malloc (MAX (n, 1) * sizeof (int));
+    for (int i = 0; i < n; i++)
+        paths->node_cell[i] = *(int *)_al_vector_ref (&cells, i);
+
+    /* Nodes bucketed by cluster */
+    paths->cluster_first = al_calloc (num_clusters + 1, sizeof (int));
+    paths->cluster_nodes = al_malloc (MAX (n, 1) * sizeof (int));
+    for (int i = 0; i < n; i++)
+        paths->cluster_first[cluster_of (paths, paths->node_cell[i]) + 1]++;
+    for (int c = 0; c < num_clusters; c++)
+        paths->cluster_first[c + 1] += paths->cluster_first[c];
+    for (int i = 0; i < n; i++)
+        paths->cluster_nodes[paths->cluster_first[cluster_of (paths, paths->node_cell[i])]++] = i;
+    for (int c = num_clusters; c > 0; c--)
+        paths->cluster_first[c] = paths->cluster_first[c - 1];
+    paths->cluster_first[0] = 0;
+
+    int work = 0;
+    for (int c = 0; c < num_clusters; c++) {
+        for (int i = paths->cluster_first[c]; i < paths->cluster_first[c + 1]; i++) {
+            int from = paths->cluster_nodes[i];
+            cluster_search (paths, paths->node_cell[from], &work);
+
+            for (int j = paths->cluster_first[c]; j < paths->cluster_first[c + 1]; j++) {
+                int to = paths->cluster_nodes[j];
+                float cost = cluster_cost (paths, paths->node_cell[to]);
+                if (to != from && cost < INFINITY)
+                    add_edge (&edges, from, to, cost);
+            }
+        }
+    }
+
+    /* Edges bucketed by the node they leave */
+    int num_edges = _al_vector_size (&edges);
+    paths->edge_first = al_calloc (n + 1, sizeof (int));
+    paths->edge_to = al_malloc (MAX (num_edges, 1) * sizeof (int));
+    paths->edge_cost = al_malloc (MAX (num_edges, 1) * sizeof (float));
+    for (int e = 0; e < num_edges; e++)
+        paths->edge_first[((GRAPH_EDGE *)_al_vector_ref (&edges, e))->from + 1]++;
+    for (int i = 0; i < n; i++)
+        paths->edge_first[i + 1] += paths->edge_first[i];
+    for (int e = 0; e < num_edges; e++) {
+        GRAPH_EDGE *edge = _al_vector_ref (&edges, e);
+        int slot = paths->edge_first[edge->from]++;
+        paths->edge_to[slot] = edge->to;
+        paths->edge_cost[slot] = edge->cost;
+    }
+    for (int i = n; i > 0; i--)
+        paths->edge_first[i] = paths->edge_first[i - 1];
+    paths->edge_first[0] = 0;
+
+    paths->node_g = al_malloc ((n + 2) * sizeof (float));
+    paths->node_parent = al_malloc ((n + 2) * sizeof (int));
+    paths->node_seen = al_calloc (n + 2, sizeof (unsigned int));
+    paths->node_closed = al_calloc (n + 2, sizeof (unsigned int));
+    paths->start_cost = al_malloc (MAX (n, 1) * sizeof (float));
+    paths->goal_cost = al_malloc (MAX (n, 1) * sizeof (float));
+
+    _al_vector_free (&cells);
+    _al_vector_free (&edges);
+    al_free (cell_node);
+}
+
+static inline bool is_coarse (const PATHFINDER *paths, const PATH_REQUEST *request)
+{
+    return !request->refine && paths->num_nodes > 0 &&
+           cluster_of (paths, request->start) != cluster_of (paths, request->goal) &&
+           octile (paths, request->start, request->goal) > COARSE_DISTANCE;
+}
+
+static void coarse_relax (PATHFINDER *paths, int from, int to, int cell, int goal, float cost)
+{
+    unsigned int search = paths->node_search;
+    float g = paths->node_g[from] + cost;
+
+    if (paths->node_closed[to] == search || (paths->node_seen[to] == search && g >= paths->node_g[to]))
+        return;
+
+    paths->node_seen[to] = search;
+    paths->node_g[to] = g;
+    paths->node_parent[to] = from;
+    heap_push (paths, (PATH_NODE){g + octile (paths, cell, goal), g, to});
+}
+
+/*
+ * A* over the cluster graph, with the request's cells joined to the nodes
+ * their clusters reach. Leaves the entrances passed in entry and runs
+ * whole, adding what it did to work.
+ */
+static int coarse_search (PATHFINDER *paths, const PATH_REQUEST *request, PATH_CACHE_ENTRY *entry, int *work)
+{
+    int n = paths->num_nodes, start = n, goal = n + 1;
+    int start_cluster = cluster_of (paths, request->start);
+    int goal_cluster = cluster_of (paths, request->goal);
+
+    cluster_search (paths, request->start, work);
+    for (int i = paths->cluster_first[start_cluster]; i < paths->cluster_first[start_cluster + 1]; i++) {
+        int node = paths->cluster_nodes[i];
+        paths->start_cost[node] = cluster_cost (paths, paths->node_cell[node]);
+    }
+
+    cluster_search (paths, request->goal, work);
+    for (int i = paths->cluster_first[goal_cluster]; i < paths->cluster_first[goal_cluster + 1]; i++) {
+        int node = paths->cluster_nodes[i];
+        paths->goal_cost[node] = cluster_cost (paths, paths->node_cell[node]);
+    }
+
+    if (++paths->node_search == 0) {
+        memset (paths->node_seen, 0, (n + 2) * sizeof (unsigned int));
+        memset (paths->node_closed, 0, (n + 2) * sizeof (unsigned int));
+        paths->node_search = 1;
+    }
+    unsigned int search = paths->node_search;
+
+    paths->heap_size = 0;
+    paths->node_g[start] = 0;
+    paths->node_parent[start] = -1;
+    paths->node_seen[start] = search;
+    heap_push (paths, (PATH_NODE){octile (paths, request->start, request->goal), 0, start});
+
+    while (paths->heap_size > 0) {
+        PATH_NODE node = heap_pop (paths);
+        int u = node.cell;
+        if (paths->node_closed[u] == search || node.g > paths->node_g[u])
+            continue;
+
+        paths->node_closed[u] = search;
+        (*work)++;
+
+        if (u == goal) {
+            int num = 0;
+            for (int v = paths->node_parent[goal]; v != start; v = paths->node_parent[v])
+                num++;
+
+            for (int i = 0; i < num; i++)
+                _al_vector_alloc_back (&entry->cells);
+
+            int *cells = _al_vector_ref_front (&entry->cells);
+            for (int v = paths->node_parent[goal]; v != start; v = paths->node_parent[v])
+                cells[--num] = paths->node_cell[v];
+
+            return PATH_FOUND;
+        }
+
+        if (u == start) {
+            for (int i = paths->cluster_first[start_cluster]; i < paths->cluster_first[start_cluster + 1]; i++) {
+                int v = paths->cluster_nodes[i];
+                if (paths->start_cost[v] < INFINITY)
+                    coarse_relax (paths, u, v, paths->node_cell[v], request->goal, paths->start_cost[v]);
+            }
+            continue;
+        }
+
+        for (int e = paths->edge_first[u]; e < paths->edge_first[u + 1]; e++) {
+            int v = paths->edge_to[e];
+            coarse_relax (paths, u, v, paths->node_cell[v], request->goal, paths->edge_cost[e]);
+        }
+
+        if (cluster_of (paths, paths->node_cell[u]) == goal_cluster && paths->goal_cost[u] < INFINITY)
+            coarse_relax (paths, u, goal, request->goal, request->goal, paths->goal_cost[u]);
+    }
+
+    return PATH_FAILED;
+}
+
+static PATH_CACHE_ENTRY *cache_find (PATHFINDER *paths, int start, int goal)
+{
+    for (int i = 0; i < paths->cache_size; i++) {
+        PATH_CACHE_ENTRY *entry = &paths->cache[i];
+        if (entry->start == start && entry->goal == goal) {
+            entry->used = ++paths->cache_clock;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* A free entry while there is one, else the least recently used. */
+static PATH_CACHE_ENTRY *cache_insert (PATHFINDER *paths, int start, int goal, bool found)
+{
+    PATH_CACHE_ENTRY *entry;
+
+    if (paths->cache_size < PATH_CACHE_SIZE) {
+        entry = &paths->cache[paths->cache_size++];
+    } else {
+        entry = &paths->cache[0];
+        for (int i = 1; i < PATH_CACHE_SIZE; i++) {
+            if (paths->cache[i].used < entry->used)
+                entry = &paths->cache[i];
+        }
+    }
+
+    entry->start = start;
+    entry->goal = goal;
+    entry->found = found;
+    entry->coarse = false;
+    entry->used = ++paths->cache_clock;
+    vector_shrink (&entry->cells, _al_vector_size (&entry->cells));
+    return entry;
+}
+
+/* Jump points of the finished search, start first. */
+static void search_store (PATHFINDER *paths, PATH_CACHE_ENTRY *entry)
+{
+    int num = 0;
+    for (int cell = paths->active.goal; cell >= 0; cell = paths->parent[cell])
+        num++;
+
+    for (int i = 0; i < num; i++)
+        _al_vector_alloc_back (&entry->cells);
+
+    int *cells = _al_vector_ref_front (&entry->cells);
+    for (int cell = paths->active.goal; cell >= 0; cell = paths->parent[cell])
+        cells[--num] = cell;
+}
+
+static void queue_request (PATHFINDER *paths, const PATH_REQUEST *request)
+{
+    al_lock_mutex (paths->mutex);
+    *(PATH_REQUEST *)_al_vector_alloc_back (&paths->requests) = *request;
+    al_unlock_mutex (paths->mutex);
+}
+
+/* Queues the next leg of the corridor, to be appended to the points. */
+static void request_leg (PATHFINDER *paths, PATH *path)
+{
+    VECTOR2D from = *(VECTOR2D *)_al_vector_ref (&path->corridor, path->leg);
+    VECTOR2D to = *(VECTOR2D *)_al_vector_ref (&path->corridor, path->leg + 1);
+    PATH_REQUEST request = {path, cell_at (paths, from), cell_at (paths, to), to, true};
+
+    path->leg++;
+    path->refining = true;
+    queue_request (paths, &request);
+}
+
+/*
+ * Hands the route over, with the start cell left out and the target last.
+ * A corridor waits for its first leg before the path reads as found.
+ */
+static void deliver (PATHFINDER *paths, const PATH_REQUEST *request, const PATH_CACHE_ENTRY *entry)
+{
+    PATH *path = request->path;
+
+    if (!request->refine) {
+        vector_shrink (&path->points, _al_vector_size (&path->points));
+        vector_shrink (&path->corridor, _al_vector_size (&path->corridor));
+        path->current = 0;
+        path->leg = 0;
+    }
+    path->refining = false;
+
+    if (!entry->found) {
+        path->status = PATH_FAILED;
+        return;
+    }
+
+    int num_cells = _al_vector_size (&entry->cells);
+
+    if (entry->coarse) {
+        *(VECTOR2D *)_al_vector_alloc_back (&path->corridor) = cell_center (paths, request->start);
+        for (int i = 0; i < num_cells; i++) {
+            int cell = *(int *)_al_vector_ref (&entry->cells, i);
+            *(VECTOR2D *)_al_vector_alloc_back (&path->corridor) = cell_center (paths, cell);
+        }
+        *(VECTOR2D *)_al_vector_alloc_back (&path->corridor) = request->target;
+
+        path->status = PATH_PENDING;
+        request_leg (paths, path);
+        return;
+    }
+
+    for (int i = 1; i < num_cells - 1; i++) {
+        int cell = *(int *)_al_vector_ref (&entry->cells, i);
+        *(VECTOR2D *)_al_vector_alloc_back (&path->points) = cell_center (paths, cell);
+    }
+    *(VECTOR2D *)_al_vector_alloc_back (&path->points) = request->target;
+
+    path->status = PATH_FOUND;
+}
+
+static int compare_owner (const void *a, const void *b)
+{
+    const PATH_REQUEST *ra = a, *rb = b;
+    int oa = ra->path ? ra->path->owner : -1;
+    int ob = rb->path ? rb->path->owner : -1;
+    return (oa > ob) - (oa < ob);
+}
+
+/*
+ * Next request to serve, or false when the queue is empty. Requests that
+ * came in since the last call are served by owner, so the order does not
+ * depend on which threads made them first.
+ */
+static bool take_request (PATHFINDER *paths, PATH_REQUEST *request)
+{
+    bool found = false;
+
+    al_lock_mutex (paths->mutex);
+
+    int size = _al_vector_size (&paths->requests);
+    if (paths->num_sorted < size) {
+        PATH_REQUEST *unsorted = _al_vector_ref (&paths->requests, paths->num_sorted);
+        qsort (unsorted, size - paths->num_sorted, sizeof (PATH_REQUEST), compare_owner);
+        paths->num_sorted = size;
+    }
+
+    while (paths->first_request < size && !found) {
+        *request = *(PATH_REQUEST *)_al_vector_ref (&paths->requests, paths->first_request++);
+        found = request->path != NULL;
+    }
+
+    if (paths->first_request == size) {
+        vector_shrink (&paths->requests, size);
+        paths->first_request = paths->num_sorted = 0;
+    }
+
+    al_unlock_mutex (paths->mutex);
+    return found;
+}
+
+/*
+ * Queues a route from one point to another for path. The path reads
+ * PATH_PENDING until a path_update fills it in; asking again before that
+ * replaces the earlier request.
+ */
+void path_request (PATHFINDER *paths, PATH *path, VECTOR2D from, VECTOR2D to)
+{
+    assert (paths);
+    assert (path);
+
+    if (path->status == PATH_PENDING || path->refining)
+        path_cancel (paths, path);
+
+    PATH_REQUEST request = {path, cell_at (paths, from), cell_at (paths, to), to, false};
+    path->status = PATH_PENDING;
+    queue_request (paths, &request);
+}
+
+/* Forgets any request for path, which must be done before it goes away. */
+void path_cancel (PATHFINDER *paths, PATH *path)
+{
+    assert (paths);
+
+    al_lock_mutex (paths->mutex);
+
+    int size = _al_vector_size (&paths->requests);
+    for (int i = paths->first_request; i < size; i++) {
+        PATH_REQUEST *request = _al_vector_ref (&paths->requests, i);
+        if (request->path == path)
+            request->path = NULL;
+    }
+
+    if (paths->active.path == path)
+        paths->active.path = NULL;
+
+    al_unlock_mutex (paths->mutex);
+
+    path->refining = false;
+    if (path->status == PATH_PENDING)
+        path->status = PATH_NONE;
+}
+
+/*
+ * Serves queued requests until budget work is spent, carrying an
+ * unfinished search over to the next call. Searches through the clusters
+ * are short and run whole, so the last one may overshoot the budget a
+ * little. Returns the work done.
+ */
+int path_update (PATHFINDER *paths, int budget)
+{
+    assert (paths);
+
+    int work = 0;
+
+    while (work < budget) {
+        if (!paths->searching) {
+            PATH_REQUEST request;
+            if (!take_request (paths, &request))
+                break;
+
+            PATH_CACHE_ENTRY *entry = cache_find (paths, request.start, request.goal);
+            if (entry) {
+                paths->cache_hits++;
+                deliver (paths, &request, entry);
+                work++;
+                continue;
+            }
+
+            if (paths->blocked[request.start] || paths->blocked[request.goal]) {
+                deliver (paths, &request, cache_insert (paths, request.start, request.goal, false));
+                work++;
+                continue;
+            }
+
+            if (is_coarse (paths, &request)) {
+                entry = cache_insert (paths, request.start, request.goal, false);
+                entry->coarse = true;
+                entry->found = coarse_search (paths, &request, entry, &work) == PATH_FOUND;
+                deliver (paths, &request, entry);
+                continue;
+            }
+
+            search_begin (paths, &request);
+        }
+
+        int status = search_run (paths, &work, budget);
+        if (status == PATH_PENDING)
+            break;
+
+        PATH_CACHE_ENTRY *entry = cache_insert (paths, paths->active.start, paths->active.goal,
+                                                status == PATH_FOUND);
+        if (status == PATH_FOUND)
+            search_store (paths, entry);
+
+        /* Cancelled while searching: the result still goes to the cache */
+        if (paths->active.path)
+            deliver (paths, &paths->active, entry);
+        paths->searching = false;
+    }
+
+    return work;
+}
+
+void path_free (PATHFINDER *paths)
+{
+    if (!paths)
+        return;
+
+    for (int i = 0; i < PATH_CACHE_SIZE; i++)
+        _al_vector_free (&paths->cache[i].cells);
+    al_free (paths->cache);
+
+    _al_vector_free (&paths->requests);
+    al_destroy_mutex (paths->mutex);
+
+    al_free (paths->blocked);
+    al_free (paths->g);
+    al_free (paths->parent);
+    al_free (paths->seen);
+    al_free (paths->closed);
+    al_free (paths->heap);
+
+    al_free (paths->node_cell);
+    al_free (paths->cluster_first);
+    al_free (paths->cluster_nodes);
+    al_free (paths->edge_first);
+    al_free (paths->edge_to);
+    al_free (paths->edge_cost);
+    al_free (paths->node_g);
+    al_free (paths->node_parent);
+    al_free (paths->node_seen);
+    al_free (paths->node_closed);
+    al_free (paths->start_cost);
+    al_free (paths->goal_cost);
+    al_free (paths);
+}
+
+void path_init (PATH *path, int owner)
+{
+    assert (path);
+
+    path->status = PATH_NONE;
+    path->owner = owner;
+    path->current = 0;
+    path->leg = 0;
+    path->refining = false;
+    _al_vector_init (&path->points, sizeof (VECTOR2D));
+    _al_vector_init (&path->corridor, sizeof (VECTOR2D));
+}
+
+static inline bool reached (const PATH *path, int i, VECTOR2D position, float limit)
+{
+    VECTOR2D diff = vabs (vsub (*(VECTOR2D *)_al_vector_ref (&path->points, i), position));
+    return diff.x < limit && diff.y < limit;
+}
+
+/*
+ * The waypoint to head for from position, moving past the ones already
+ * within limit. Asks for the next leg of a corridor as the end of the
+ * refined part comes near, and turns the path back to PATH_PENDING if the
+ * walker gets there first. False when path holds no route to follow now.
+ */
+bool path_next (PATHFINDER *paths, PATH *path, VECTOR2D position, float limit, VECTOR2D *waypoint)
+{
+    assert (path);
+    assert (waypoint);
+
+    int num = _al_vector_size (&path->points);
+    if (path->status != PATH_FOUND || num == 0)
+        return false;
+
+    while (path->current < num - 1 && reached (path, path->current, position, limit))
+        path->current++;
+
+    bool more = path->leg < (int)_al_vector_size (&path->corridor) - 1;
+    if (more && !path->refining && num - path->current <= REFINE_AHEAD)
+        request_leg (paths, path);
+
+    if (path->refining && path->current == num - 1 && reached (path, path->current, position, limit)) {
+        path->status = PATH_PENDING;
+        return false;
+    }
+
+    *waypoint = *(VECTOR2D *)_al_vector_ref (&path->points, path->current);
+    return true;
+}
+
+void path_clear (PATH *path)
+{
+    assert (path);
+
+    _al_vector_free (&path->points);
+    _al_vector_free (&path->corridor);
+    path->status = PATH_NONE;
+    path->current = 0;
+    path->leg = 0;
+    path->refining = false;
+}
@@ -0,0 +1,100 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+/*
+ * Pipeline stage: one thread kept alive for a recurring task, so a frame
+ * can hand off its simulation and render meanwhile. Starting and waiting
+ * go through the mutex, which also makes everything the task wrote
+ * visible to the caller once pipeline_wait returns.
+ */
+
+#include "nostos/pipeline.h"
+
+static void *pipeline_thread (ALLEGRO_THREAD *thread, void *arg)
+{
+    PIPELINE *pipeline = arg;
+
+    al_lock_mutex (pipeline->mutex);
+    while (true) {
+        while (!pipeline->busy && !pipeline->stopping)
+            al_wait_cond (pipeline->cond, pipeline->mutex);
+
+        if (pipeline->stopping)
+            break;
+
+        al_unlock_mutex (pipeline->mutex);
+        pipeline->fn (pipeline->data);
+        al_lock_mutex (pipeline->mutex);
+
+        pipeline->busy = false;
+        al_broadcast_cond (pipeline->cond);
+    }
+    al_unlock_mutex (pipeline->mutex);
+
+    return NULL;
+}
+
+/* Returns NULL when the thread cannot be created. */
+PIPELINE *pipeline_create (PIPELINE_FN fn, void *data)
+{
+    assert (fn);
+
+    PIPELINE *pipeline = al_calloc (1, sizeof (PIPELINE));
+    pipeline->fn = fn;
+    pipeline->data = data;
+    pipeline->mutex = al_create_mutex ();
+    pipeline->cond = al_create_cond ();
+
+    pipeline->thread = al_create_thread (pipeline_thread, pipeline);
+    if (!pipeline->thread) {
+        debug ("Failed to create pipeline thread.");
+        al_destroy_cond (pipeline->cond);
+        al_destroy_mutex (pipeline->mutex);
+        al_free (pipeline);
+        return NULL;
+    }
+
+    al_start_thread (pipeline->thread);
+    return pipeline;
+}
+
+void pipeline_start (PIPELINE *pipeline)
+{
+    assert (pipeline);
+
+    al_lock_mutex (pipeline->mutex);
+    assert (!pipeline->busy);
+    pipeline->busy = true;
+    al_broadcast_cond (pipeline->cond);
+    al_unlock_mutex (pipeline->mutex);
+}
+
+void pipeline_wait (PIPELINE *pipeline)
+{
+    assert (pipeline);
+
+    al_lock_mutex (pipeline->mutex);
+    while (pipeline->busy)
+        al_wait_cond (pipeline->cond, pipeline->mutex);
+    al_unlock_mutex (pipeline->mutex);
+}
+
+void pipeline_free (PIPELINE *pipeline)
+{
+    if (!pipeline)
+        return;
+
+    pipeline_wait (pipeline);
+
+    al_lock_mutex (pipeline->mutex);
+    pipeline->stopping = true;
+    al_broadcast_cond (pipeline->cond);
+    al_unlock_mutex (pipeline->mutex);
+
+    al_join_thread (pipeline->thread, NULL);
+    al_destroy_thread (pipeline->thread);
+    al_destroy_cond (pipeline->cond);
+    al_destroy_mutex (pipeline->mutex);
+    al_free (pipeline);
+}
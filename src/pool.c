@@ -0,0 +1,163 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+/*
+ * Object pool. Spawning used to cost an al_malloc per object and
+ * despawning a free each, scattering objects over the heap. A pool hands
+ * out slots from chunks allocated once: allocation pops the free list,
+ * release pushes onto it, and a chunk is only added when the list runs
+ * dry, so a pool that reached its working size stops allocating.
+ *
+ * Every slot starts with a header holding its index, its generation and
+ * the free list link, padded so the object after it keeps the alignment
+ * al_malloc gives.
+ */
+
+#include "nostos/pool.h"
+
+#include <string.h>
+
+#define POOL_ALIGN 16
+#define POOL_LIVE -2
+
+typedef struct POOL_HEADER {
+    int index;
+    int generation;
+    int next_free;
+} POOL_HEADER;
+
+#define HEADER_SIZE ((sizeof (POOL_HEADER) + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN)
+
+static inline POOL_HEADER *pool_header (const POOL *pool, int index)
+{
+    char *chunk = pool->chunks[index / pool->chunk_size];
+    return (POOL_HEADER *)(chunk + (size_t)(index % pool->chunk_size) * pool->stride);
+}
+
+static inline POOL_HEADER *item_header (const void *item)
+{
+    return (POOL_HEADER *)((char *)item - HEADER_SIZE);
+}
+
+POOL *pool_create (size_t item_size, int chunk_size)
+{
+    assert (item_size > 0);
+    assert (chunk_size > 0);
+
+    POOL *pool = al_calloc (1, sizeof (POOL));
+    pool->item_size = item_size;
+    pool->stride = HEADER_SIZE + (item_size + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN;
+    pool->chunk_size = chunk_size;
+    pool->free_head = HANDLE_INVALID;
+    return pool;
+}
+
+static void pool_grow (POOL *pool)
+{
+    int first = pool->num_chunks * pool->chunk_size;
+    assert (first + pool->chunk_size <= HANDLE_INDEX_MASK + 1);
+
+    pool->chunks = al_realloc (pool->chunks, (pool->num_chunks + 1) * sizeof (char *));
+    pool->chunks[pool->num_chunks++] = al_malloc (pool->chunk_size * pool->stride);
+
+    /* Linked in reverse so the lowest index is handed out first */
+    for (int i = first + pool->chunk_size - 1; i >= first; i--) {
+        POOL_HEADER *header = pool_header (pool, i);
+        header->index = i;
+        header->generation = 0;
+        header->next_free = pool->free_head;
+        pool->free_head = i;
+    }
+}
+
+/* Returns zeroed memory for one object; its handle goes to handle if given. */
+void *pool_alloc (POOL *pool, int *handle)
+{
+    assert (pool);
+
+    if (pool->free_head == HANDLE_INVALID)
+        pool_grow (pool);
+
+    POOL_HEADER *header = pool_header (pool, pool->free_head);
+    pool->free_head = header->next_free;
+    header->next_free = POOL_LIVE;
+    pool->num_items++;
+
+    if (handle)
+        *handle = handle_make (header->index, header->generation);
+
+    void *item = (char *)header + HEADER_SIZE;
+    memset (item, 0, pool->item_size);
+    return item;
+}
+
+void pool_release (POOL *pool, void *item)
+{
+    assert (pool);
+
+    if (!item)
+        return;
+
+    POOL_HEADER *header = item_header (item);
+    assert (header->next_free == POOL_LIVE);
+
+    header->generation = (header->generation + 1) & HANDLE_GENERATION_MASK;
+    header->next_free = pool->free_head;
+    pool->free_head = header->index;
+    pool->num_items--;
+}
+
+/* The object behind handle, or NULL when it was released since. */
+void *pool_get (const POOL *pool, int handle)
+{
+    assert (pool);
+
+    int index = handle_index (handle);
+    if (handle < 0 || index >= pool->num_chunks * pool->chunk_size)
+        return NULL;
+
+    POOL_HEADER *header = pool_header (pool, index);
+    if (header->next_free != POOL_LIVE || header->generation != handle_generation (handle))
+        return NULL;
+
+    return (char *)header + HEADER_SIZE;
+}
+
+int pool_handle (const POOL *pool, const void *item)
+{
+    assert (pool);
+    assert (item);
+
+    POOL_HEADER *header = item_header (item);
+    return handle_make (header->index, header->generation);
+}
+
+/* Slots handed out so far, live or not; the bound for walking with pool_at. */
+int pool_capacity (const POOL *pool)
+{
+    assert (pool);
+    return pool->num_chunks * pool->chunk_size;
+}
+
+/* The object in slot index, or NULL when the slot is free. */
+void *pool_at (const POOL *pool, int index)
+{
+    assert (pool);
+    assert (index >= 0 && index < pool_capacity (pool));
+
+    POOL_HEADER *header = pool_header (pool, index);
+    return header->next_free == POOL_LIVE ? (char *)header + HEADER_SIZE : NULL;
+}
+
+void pool_free (POOL *pool)
+{
+    if (!pool)
+        return;
+
+    for (int i = 0; i < pool->num_chunks; i++)
+        al_free (pool->chunks[i]);
+
+    al_free (pool->chunks);
+    al_free (pool);
+}
@@ -4,19 +4,40 @@
 
 #include "nostos/scene.h"
 
+#define NPC_POOL_CHUNK 64
+
+static void scene_free_npcs (SCENE *scene)
+{
+    POOL *pool = scene->npc_pool;
+    if (!pool)
+        return;
+
+    for (int i = 0; i < pool_capacity (pool); i++) {
+        SPRITE_NPC *npc = pool_at (pool, i);
+        if (npc)
+            scene_despawn_npc (scene, pool_handle (pool, npc));
+    }
+
+    pool_free (pool);
+    scene->npc_pool = NULL;
+}
+
 static void dtor_scene (void *value, void *user_data)
 {
     SCENE *scene = value;
+    scene_free_npcs (scene);
     al_free (scene->name);
     al_free (scene->map_filename);
     al_free (scene->npc_layer_name);
     al_free (scene->collision_layer_name);
+    al_free (scene->collision_property);
     al_free (scene->portal_layer_name);
+    al_free (scene->trigger_layer_name);
     tiled_free_map (scene->map);
-    _al_list_destroy (scene->npcs);
+    actors_free (scene->actors);
     _al_list_destroy (scene->portals);
-    aabb_free (scene->collision_tree);
-    aabb_free (scene->portal_tree);
+    path_free (scene->paths);
+    world_free (scene->world);
     al_free (scene);
 }
 
@@ -50,7 +71,9 @@ SCENES *scene_load_file (const char *filename)
         scene->map_filename = strdup (al_get_config_value (config, section, "map"));
         scene->npc_layer_name = strdup (al_get_config_value (config, section, "npc_layer"));
         scene->collision_layer_name = strdup (al_get_config_value (config, section, "collision_layer"));
+        scene->collision_property = strdup (al_get_config_value (config, section, "collision_property"));
         scene->portal_layer_name = strdup (al_get_config_value (config, section, "portal_layer"));
+        scene->trigger_layer_name = strdup (al_get_config_value (config, section, "trigger_layer"));
 
         scenes->tree = aa_insert (scenes->tree, scene->name, scene, charcmp);
         _al_list_push_back_ex (scenes->scenes, scene, dtor_scene);
@@ -66,7 +89,89 @@ SCENE *scene_get (SCENES *scenes, const char *scene_name)
     return aa_search (scenes->tree, scene_name, charcmp);
 }
 
-SCENE *scene_load (SCENE *scene, SCENES *scenes, SPRITES *sprites)
+/*
+ * Spawns an NPC walking points, which stay the caller's: its slot in the
+ * pool, its actor and its world proxy come and go together. Returns the
+ * handle to keep instead of the NPC itself.
+ */
+int scene_spawn_npc (SCENE *scene, SPRITE *sprite, int action, float *points, int num_points)
+{
+    assert (scene);
+    assert (scene->world);
+
+    int handle;
+    SPRITE_NPC *npc = pool_alloc (scene->npc_pool, &handle);
+    sprite_init_npc (npc, scene->actors, sprite, action, points, num_points);
+    npc->paths = scene->paths;
+
+    BOX box = sprite_npc_box (npc);
+    box.data = NULL;
+    npc->proxy = world_add_dynamic (scene->world, box, WORLD_NPC, handle);
+
+    return handle;
+}
+
+/* Does nothing for an NPC already despawned. */
+void scene_despawn_npc (SCENE *scene, int handle)
+{
+    assert (scene);
+
+    SPRITE_NPC *npc = pool_get (scene->npc_pool, handle);
+    if (!npc)
+        return;
+
+    sprite_clear_npc (npc);
+    world_remove_dynamic (scene->world, npc->proxy);
+    actors_remove (scene->actors, npc->handle);
+    pool_release (scene->npc_pool, npc);
+}
+
+/* The NPC behind handle, or NULL once it is despawned. */
+SPRITE_NPC *scene_get_npc (const SCENE *scene, int handle)
+{
+    assert (scene);
+    return scene->npc_pool ? pool_get (scene->npc_pool, handle) : NULL;
+}
+
+/* Map points mark where a sprite is centered; NPCs walk them by their top left corner. */
+static void scene_load_npcs (SCENE *scene, SPRITES *sprites, const char *layer_name)
+{
+    TILED_LAYER_OBJECT *layer = (TILED_LAYER_OBJECT *)tiled_layer_by_name (scene->map, layer_name);
+
+    if (!layer || !layer->objects)
+        return;
+
+    LIST_ITEM *item = _al_list_front (layer->objects);
+    while (item) {
+        TILED_OBJECT *object = _al_list_item_data (item);
+        switch (object->type) {
+            TILED_OBJECT_GEOM *object_geom;
+            SPRITE *sprite;
+            case OBJECT_TYPE_GEOM:
+                object_geom = (TILED_OBJECT_GEOM *)object;
+                sprite = aa_search (sprites->sprites, aa_search (object->properties, "char", charcmp), charcmp);
+                if (!sprite || object_geom->num_points == 0) {
+                    debug ("FIX: NPC %s has no sprite or no points.", object->name);
+                    break;
+                }
+
+                for (int j = 0; j < object_geom->num_points * 2; j += 2) {
+                    object_geom->points[j] -= sprite->tileset->tile_width / 2;
+                    object_geom->points[j + 1] -= sprite->tileset->tile_height / 2;
+                }
+
+                scene_spawn_npc (scene, sprite, sprite_npc_action (aa_search (object->properties, "action", charcmp)),
+                                 object_geom->points, object_geom->num_points * 2);
+                break;
+            default:
+                debug ("FIX: Found unsupported object in sprites layer. Only geometries (lines and polygons) are supported.");
+                break;
+        }
+        item = _al_list_next (layer->objects, item);
+    }
+}
+
+SCENE *scene_load (SCENE *scene, SCENES *scenes, SPRITES *sprites, JOBS *jobs)
 {
     assert (scene);
     assert (scenes);
@@ -76,43 +181,43 @@ SCENE *scene_load (SCENE *scene, SCENES *scenes, SPRITES *sprites)
     scene->map = tiled_load_tmx_file (filename);
     al_free (filename);
 
-    char *layer_name = scene->npc_layer_name ? scene->npc_layer_name : "npc";
-    scene->npcs = sprite_load_npcs (sprites, scene->map, layer_name);
-
-    int size = _al_list_size (scene->npcs);
-    BOX *boxes = al_malloc (size * sizeof (BOX));
-    LIST_ITEM *item = _al_list_front (scene->npcs);
-    int i = 0;
-    while (item) {
-        SPRITE_NPC *npc = _al_list_item_data (item);
-        boxes[i] = box_scale (npc->actor.box, 5.0f);
-        boxes[i++].data = npc;
-        item = _al_list_next (scene->npcs, item);
-    }
-    scene->npc_tree = aabb_build_tree (boxes, size, 4);
-    al_free (boxes);
+    scene->world = world_create ();
 
-    layer_name = scene->collision_layer_name ? scene->collision_layer_name : "collision";
-    scene->collision_tree = aabb_load_tree (scene->map, layer_name);
+    char *layer_name = scene->collision_layer_name ? scene->collision_layer_name : "collision";
+    world_add_layer (scene->world, scene->map, layer_name, WORLD_SOLID);
+    world_add_tiles (scene->world, scene->map,
+                     scene->collision_property ? scene->collision_property : "solid", WORLD_SOLID);
 
     layer_name = scene->portal_layer_name ? scene->portal_layer_name : "portal";
-    scene->portal_tree = aabb_load_tree (scene->map, layer_name);
-
     scene_load_portals (scene, scenes, layer_name);
 
+    layer_name = scene->trigger_layer_name ? scene->trigger_layer_name : "trigger";
+    world_add_layer (scene->world, scene->map, layer_name, WORLD_TRIGGER);
+
+    world_build (scene->world, jobs);
+
+    scene->paths = path_create (scene->world, scene->map, WORLD_SOLID);
+    scene->actors = actors_create (0);
+    scene->npc_pool = pool_create (sizeof (SPRITE_NPC), NPC_POOL_CHUNK);
+
+    layer_name = scene->npc_layer_name ? scene->npc_layer_name : "npc";
+    scene_load_npcs (scene, sprites, layer_name);
+
     return scene;
 }
 
-void scene_load_scenes (SCENES *scenes, SPRITES *sprites)
+void scene_load_scenes (SCENES *scenes, SPRITES *sprites, JOBS *jobs)
 {
     assert (scenes);
 
     LIST_ITEM *item = _al_list_front (scenes->scenes);
     while (item) {
         SCENE *scene = _al_list_item_data (item);
-        scene_load (scene, scenes, sprites);
+        scene_load (scene, scenes, sprites, jobs);
         item = _al_list_next (scenes->scenes, item);
     }
+
+    scene_link_portals (scenes);
 }
 
 SCENE_PORTAL *scene_get_portal (SCENES *scenes, const char *portal_name)
@@ -130,6 +235,7 @@ void scene_load_portals (SCENE *scene, SCENES *scenes, const char *layer_name)
 
     if (layer && layer->objects) {
         SCENE_PORTAL *portal;
+        BOX box;
         LIST_ITEM *item = _al_list_front (layer->objects);
         scene->portals = _al_list_create_static (_al_list_size (layer->objects));
 
@@ -144,8 +250,13 @@ void scene_load_portals (SCENE *scene, SCENES *scenes, const char *layer_name)
                     portal->name = strdup (object->name);
                     portal->scene = scene;
                     portal->destiny_portal = strdup (aa_search (object->properties, "portal", charcmp));
+                    portal->destiny = NULL;
                     portal->position = (VECTOR2D){object_rect->width / 2.0 + object->x,
                                                   object_rect->height / 2.0 + object->y};
+                    box.extent = (VECTOR2D){object_rect->width / 2.0, object_rect->height / 2.0};
+                    box.center = portal->position;
+                    box.data = portal;
+                    world_add_boxes (scene->world, &box, 1, WORLD_PORTAL, false);
                     debug ("New portal %s", portal->name);
                     scenes->portals = aa_insert (scenes->portals, portal->name, portal, charcmp);
                     _al_list_push_back_ex (scene->portals, portal, dtor_portal);
@@ -160,18 +271,42 @@ void scene_load_portals (SCENE *scene, SCENES *scenes, const char *layer_name)
     }
 }
 
+/*
+ * Resolves every portal's destination once all scenes are loaded, so
+ * walking into a portal is a pointer dereference instead of a name lookup.
+ */
+void scene_link_portals (SCENES *scenes)
+{
+    assert (scenes);
+
+    LIST_ITEM *item = _al_list_front (scenes->scenes);
+    while (item) {
+        SCENE *scene = _al_list_item_data (item);
+        LIST_ITEM *pitem = scene->portals ? _al_list_front (scene->portals) : NULL;
+        while (pitem) {
+            SCENE_PORTAL *portal = _al_list_item_data (pitem);
+            portal->destiny = scene_get_portal (scenes, portal->destiny_portal);
+            if (portal->destiny_portal && !portal->destiny)
+                debug ("FIX: Portal %s leads to unknown portal %s", portal->name, portal->destiny_portal);
+            pitem = _al_list_next (scene->portals, pitem);
+        }
+        item = _al_list_next (scenes->scenes, item);
+    }
+}
+
 SCENE *scene_unload (SCENE *scene)
 {
     assert (scene);
 
+    scene_free_npcs (scene);
     tiled_free_map (scene->map);
-    _al_list_destroy (scene->npcs);
-    aabb_free (scene->collision_tree);
-    aabb_free (scene->portal_tree);
+    actors_free (scene->actors);
+    path_free (scene->paths);
+    world_free (scene->world);
     scene->map = NULL;
-    scene->npcs = NULL;
-    scene->collision_tree = NULL;
-    scene->portal_tree = NULL;
+    scene->actors = NULL;
+    scene->paths = NULL;
+    scene->world = NULL;
 
     return scene;
 }
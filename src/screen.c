@@ -73,6 +73,7 @@ void screen_center (SCREEN *screen, VECTOR2D focus, TILED_MAP *map)
     screen->position.x = CLAMP (0, round (screen->position.x), map->width * map->tile_width - screen->width);
     screen->position.y = CLAMP (0, round (screen->position.y), map->height * map->tile_height - screen->height);
     screen->movement = (VECTOR2D){0.0f, 0.0f};
+    screen->previous_position = screen->position;
 }
 
 BOX screen_box (SCREEN *screen)
@@ -83,3 +84,15 @@ BOX screen_box (SCREEN *screen)
     return box;
 }
 
+/*
+ * The screen as seen alpha of the way from the previous simulation step
+ * to the current one, on whole pixels like the steps themselves.
+ */
+SCREEN screen_interpolate (const SCREEN *screen, float alpha)
+{
+    SCREEN view = *screen;
+    VECTOR2D position = vlerp (screen->previous_position, screen->position, alpha);
+    view.position = (VECTOR2D){round (position.x), round (position.y)};
+    return view;
+}
+
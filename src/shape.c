@@ -0,0 +1,389 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+#include "nostos/shape.h"
+#include "nostos/utils.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SHAPE_EPSILON 1e-3f
+#define SHAPE_LINE_RADIUS 2.0f
+
+static SHAPE *new_shape (int num_points, int num_normals, float radius, void *data)
+{
+    SHAPE *shape = al_malloc (sizeof (SHAPE) + (num_points + num_normals) * sizeof (VECTOR2D));
+    shape->points = (VECTOR2D *)(shape + 1);
+    shape->normals = shape->points + num_points;
+    shape->num_points = num_points;
+    shape->num_normals = num_normals;
+    shape->radius = radius;
+    shape->data = data;
+    return shape;
+}
+
+static void fit_bounds (SHAPE *shape)
+{
+    VECTOR2D bmin = shape->points[0];
+    VECTOR2D bmax = shape->points[0];
+
+    for (int i = 1; i < shape->num_points; i++) {
+        bmin.x = MIN (bmin.x, shape->points[i].x);
+        bmin.y = MIN (bmin.y, shape->points[i].y);
+        bmax.x = MAX (bmax.x, shape->points[i].x);
+        bmax.y = MAX (bmax.y, shape->points[i].y);
+    }
+
+    VECTOR2D r = {shape->radius, shape->radius};
+    shape->bounds.center = vmulf (vadd (bmin, bmax), 0.5f);
+    shape->bounds.extent = vadd (vmulf (vsub (bmax, bmin), 0.5f), r);
+    shape->bounds.data = shape->data;
+}
+
+static int point_cmp (const void *a, const void *b)
+{
+    const VECTOR2D *p = a, *q = b;
+    if (p->x != q->x)
+        return p->x < q->x ? -1 : 1;
+    if (p->y != q->y)
+        return p->y < q->y ? -1 : 1;
+    return 0;
+}
+
+static inline float cross (VECTOR2D o, VECTOR2D a, VECTOR2D b)
+{
+    return (a.x - o.x) * (b.y - o.y) - (a.y - o.y) * (b.x - o.x);
+}
+
+/*
+ * Monotone chain convex hull, hull needs room for 2 * num_points points.
+ * Returns the number of hull points.
+ */
+static int convex_hull (VECTOR2D *points, int num_points, VECTOR2D *hull)
+{
+    int k = 0;
+
+    qsort (points, num_points, sizeof (VECTOR2D), point_cmp);
+
+    for (int i = 0; i < num_points; i++) {
+        while (k >= 2 && cross (hull[k - 2], hull[k - 1], points[i]) <= 0)
+            k--;
+        hull[k++] = points[i];
+    }
+
+    for (int i = num_points - 2, lower = k + 1; i >= 0; i--) {
+        while (k >= lower && cross (hull[k - 2], hull[k - 1], points[i]) <= 0)
+            k--;
+        hull[k++] = points[i];
+    }
+
+    return k - 1;
+}
+
+/*
+ * Polygon from Tiled style x, y pairs. Concave outlines are replaced by
+ * their convex hull.
+ */
+SHAPE *shape_polygon (const float *points, int num_points, void *data)
+{
+    assert (points);
+
+    if (num_points < 3)
+        return NULL;
+
+    VECTOR2D *sorted = al_malloc (num_points * sizeof (VECTOR2D));
+    VECTOR2D *hull = al_malloc (2 * num_points * sizeof (VECTOR2D));
+    memcpy (sorted, points, num_points * sizeof (VECTOR2D));
+
+    int n = convex_hull (sorted, num_points, hull);
+    al_free (sorted);
+
+    if (n < 3) {
+        al_free (hull);
+        return NULL;
+    }
+
+    if (n != num_points)
+        debug ("FIX: Polygon with %d points is not convex, using its %d point hull.", num_points, n);
+
+    SHAPE *shape = new_shape (n, n, 0, data);
+    memcpy (shape->points, hull, n * sizeof (VECTOR2D));
+    al_free (hull);
+
+    for (int i = 0; i < n; i++) {
+        VECTOR2D edge = vsub (shape->points[(i + 1) % n], shape->points[i]);
+        shape->normals[i] = vnormalize ((VECTOR2D){edge.y, -edge.x});
+    }
+
+    fit_bounds (shape);
+    return shape;
+}
+
+SHAPE *shape_capsule (VECTOR2D p1, VECTOR2D p2, float radius, void *data)
+{
+    VECTOR2D dir = vsub (p2, p1);
+
+    if (vsqlen (dir) == 0)
+        return NULL;
+
+    dir = vnormalize (dir);
+
+    SHAPE *shape = new_shape (2, 2, radius, data);
+    shape->points[0] = p1;
+    shape->points[1] = p2;
+    shape->normals[0] = (VECTOR2D){dir.y, -dir.x};
+    shape->normals[1] = dir;
+
+    fit_bounds (shape);
+    return shape;
+}
+
+/*
+ * Shapes for the polygon and polyline objects of a layer: one per polygon
+ * and one capsule per polyline segment, with the object's "radius"
+ * property or SHAPE_LINE_RADIUS. Shape data is the object.
+ */
+SHAPE **shape_load (TILED_MAP *map, const char *layer_name, int *num_shapes)
+{
+    TILED_LAYER_OBJECT *layer = (TILED_LAYER_OBJECT *)tiled_layer_by_name (map, layer_name);
+    *num_shapes = 0;
+
+    if (!layer || layer->layer.type != LAYER_TYPE_OBJECT || !layer->objects)
+        return NULL;
+
+    VECTOR shapes;
+    _al_vector_init (&shapes, sizeof (SHAPE *));
+
+    LIST_ITEM *item = _al_list_front (layer->objects);
+    while (item) {
+        TILED_OBJECT *object = _al_list_item_data (item);
+        item = _al_list_next (layer->objects, item);
+
+        if (object->type != OBJECT_TYPE_GEOM)
+            continue;
+
+        TILED_OBJECT_GEOM *geom = (TILED_OBJECT_GEOM *)object;
+        if (!geom->points)
+            continue;
+
+        if (geom->type == GEOM_TYPE_POLYGON) {
+            SHAPE *shape = shape_polygon (geom->points, geom->num_points, object);
+            if (shape)
+                *(SHAPE **)_al_vector_alloc_back (&shapes) = shape;
+            continue;
+        }
+
+        const char *radius_str = aa_search (object->properties, "radius", charcmp);
+        float radius = radius_str ? atof (radius_str) : SHAPE_LINE_RADIUS;
+
+        for (int i = 0; i + 1 < geom->num_points; i++) {
+            VECTOR2D p1 = {geom->points[i * 2], geom->points[i * 2 + 1]};
+            VECTOR2D p2 = {geom->points[i * 2 + 2], geom->points[i * 2 + 3]};
+            SHAPE *shape = shape_capsule (p1, p2, radius, object);
+            if (shape)
+                *(SHAPE **)_al_vector_alloc_back (&shapes) = shape;
+        }
+    }
+
+    *num_shapes = _al_vector_size (&shapes);
+    SHAPE **result = NULL;
+    if (*num_shapes > 0) {
+        result = al_malloc (*num_shapes * sizeof (SHAPE *));
+        memcpy (result, _al_vector_ref_front (&shapes), *num_shapes * sizeof (SHAPE *));
+    }
+    _al_vector_free (&shapes);
+
+    return result;
+}
+
+static inline void project_shape (const SHAPE *shape, VECTOR2D axis, float *min, float *max)
+{
+    *min = *max = vdot (shape->points[0], axis);
+    for (int i = 1; i < shape->num_points; i++) {
+        float d = vdot (shape->points[i], axis);
+        *min = MIN (*min, d);
+        *max = MAX (*max, d);
+    }
+    *min -= shape->radius;
+    *max += shape->radius;
+}
+
+static inline void project_box (BOX b, VECTOR2D axis, float *min, float *max)
+{
+    float c = vdot (b.center, axis);
+    float r = fabsf (axis.x) * b.extent.x + fabsf (axis.y) * b.extent.y;
+    *min = c - r;
+    *max = c + r;
+}
+
+/*
+ * Separating axes against a box: the box axes, the shape's edge normals
+ * and, for rounded shapes, the direction from each end point to the
+ * closest point of the box. Extra axes never cause false contacts, so the
+ * end point axes taken at the start of a sweep only make the round caps
+ * slightly blunter later in the move.
+ */
+static inline int num_axes (const SHAPE *shape)
+{
+    return 2 + shape->num_normals + (shape->radius > 0 ? shape->num_points : 0);
+}
+
+static bool get_axis (const SHAPE *shape, BOX b, int i, VECTOR2D *axis)
+{
+    if (i < 2) {
+        *axis = i == 0 ? (VECTOR2D){1, 0} : (VECTOR2D){0, 1};
+        return true;
+    }
+
+    i -= 2;
+    if (i < shape->num_normals) {
+        *axis = shape->normals[i];
+        return true;
+    }
+
+    VECTOR2D p = shape->points[i - shape->num_normals];
+    VECTOR2D bmin = box_get_min (b);
+    VECTOR2D bmax = box_get_max (b);
+    VECTOR2D closest = {CLAMP (bmin.x, p.x, bmax.x), CLAMP (bmin.y, p.y, bmax.y)};
+    VECTOR2D d = vsub (p, closest);
+
+    if (vsqlen (d) < SHAPE_EPSILON * SHAPE_EPSILON)
+        return false;
+
+    *axis = vnormalize (d);
+    return true;
+}
+
+/*
+ * Separating axis test, shapes are apart when some axis shows a gap of
+ * more than tolerance; a negative tolerance treats shallow overlaps as
+ * apart too. On contact hit gets the minimum translation that pushes the
+ * box out: the normal points away from the shape.
+ */
+static bool sat_overlap (const SHAPE *shape, BOX b, float tolerance, BOX_HIT *hit)
+{
+    float best = FLT_MAX;
+    VECTOR2D normal = {0, 0};
+    int n = num_axes (shape);
+
+    for (int i = 0; i < n; i++) {
+        VECTOR2D axis;
+        float bmin, bmax, smin, smax;
+
+        if (!get_axis (shape, b, i, &axis))
+            continue;
+
+        project_box (b, axis, &bmin, &bmax);
+        project_shape (shape, axis, &smin, &smax);
+
+        if (MIN (bmax, smax) - MAX (bmin, smin) < -tolerance)
+            return false;
+
+        if (smax - bmin < best) {
+            best = smax - bmin;
+            normal = axis;
+        }
+        if (bmax - smin < best) {
+            best = bmax - smin;
+            normal = vmulf (axis, -1);
+        }
+    }
+
+    if (hit) {
+        hit->time = 0;
+        hit->normal = normal;
+        hit->penetration = best;
+    }
+
+    return true;
+}
+
+/* Touching counts, as in box_overlap. */
+bool shape_overlap (const SHAPE *shape, BOX b, BOX_HIT *hit)
+{
+    assert (shape);
+    return sat_overlap (shape, b, 0, hit);
+}
+
+/*
+ * Same contract as box_sweep with a shape as the obstacle: the box starts
+ * overlapping (time 0, push out data) or the latest entry over all axes
+ * is the time of impact, with that axis facing the move as the normal.
+ */
+bool shape_sweep (BOX b, VECTOR2D delta, const SHAPE *shape, BOX_HIT *hit)
+{
+    assert (shape);
+    assert (hit);
+
+    /* Overlaps within SHAPE_EPSILON are contacts, as in box_sweep */
+    if (sat_overlap (shape, b, -SHAPE_EPSILON, hit))
+        return true;
+
+    float enter = -INFINITY, exit = INFINITY;
+    VECTOR2D normal = {0, 0};
+    int n = num_axes (shape);
+
+    for (int i = 0; i < n; i++) {
+        VECTOR2D axis;
+        float bmin, bmax, smin, smax;
+
+        if (!get_axis (shape, b, i, &axis))
+            continue;
+
+        project_box (b, axis, &bmin, &bmax);
+        project_shape (shape, axis, &smin, &smax);
+        float speed = vdot (delta, axis);
+
+        if (speed == 0) {
+            if (bmax <= smin || bmin >= smax)
+                return false;
+            continue;
+        }
+
+        float t1 = (smin - bmax) / speed;
+        float t2 = (smax - bmin) / speed;
+        float axis_enter = MIN (t1, t2);
+        float axis_exit = MAX (t1, t2);
+
+        if (axis_enter > enter) {
+            enter = axis_enter;
+            normal = speed > 0 ? vmulf (axis, -1) : axis;
+        }
+        exit = MIN (exit, axis_exit);
+    }
+
+    if (enter >= exit || enter < 0 || enter >= 1)
+        return false;
+
+    hit->time = enter;
+    hit->normal = normal;
+    hit->penetration = 0;
+
+    return true;
+}
+
+void shape_free (SHAPE *shape)
+{
+    al_free (shape);
+}
+
+/* Polygon edges, or a capsule's segment and its two sides. */
+void shape_debug_draw (const SHAPE *shape, DEBUG_DRAW *dd, ALLEGRO_COLOR color)
+{
+    if (!box_overlap (shape->bounds, dd->view))
+        return;
+
+    if (shape->num_points == 2) {
+        VECTOR2D side = vmulf (shape->normals[0], shape->radius);
+        debug_draw_line (dd, shape->points[0], shape->points[1], color);
+        debug_draw_line (dd, vadd (shape->points[0], side), vadd (shape->points[1], side), color);
+        debug_draw_line (dd, vsub (shape->points[0], side), vsub (shape->points[1], side), color);
+        return;
+    }
+
+    for (int i = 0; i < shape->num_points; i++)
+        debug_draw_line (dd, shape->points[i], shape->points[(i + 1) % shape->num_points], color);
+}
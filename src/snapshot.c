@@ -0,0 +1,109 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+/*
+ * Render snapshots decouple drawing from the simulation. The simulation
+ * copies out what a frame needs once its steps are done; the renderer
+ * only reads the snapshot, the map and the sprite sheets, which never
+ * change while the game runs. With two snapshots the next frame can be
+ * simulated while the previous one is drawn.
+ *
+ * The UI belongs to the renderer: dialog changes made during the steps
+ * are kept here and applied when the snapshot is drawn. Only the last
+ * change of a frame matters, as each one replaces the dialog.
+ */
+
+#include "nostos/snapshot.h"
+#include "nostos/actors.h"
+
+#include <string.h>
+
+void snapshot_init (RENDER_SNAPSHOT *snapshot)
+{
+    assert (snapshot);
+
+    memset (snapshot, 0, sizeof (RENDER_SNAPSHOT));
+    _al_vector_init (&snapshot->sprites, sizeof (SNAPSHOT_SPRITE));
+    snapshot->debug_draw = debug_draw_create ();
+    snapshot->dialog_speaker = al_ustr_new ("");
+    snapshot->dialog_text = al_ustr_new ("");
+}
+
+void snapshot_begin (RENDER_SNAPSHOT *snapshot)
+{
+    assert (snapshot);
+
+    vector_shrink (&snapshot->sprites, _al_vector_size (&snapshot->sprites));
+    snapshot->show_arrow = false;
+    snapshot->dialog_changed = false;
+}
+
+static void add_sprite (RENDER_SNAPSHOT *snapshot, SPRITE *sprite, int animation, int frame, VECTOR2D position)
+{
+    SNAPSHOT_SPRITE *s = _al_vector_alloc_back (&snapshot->sprites);
+    s->sprite = sprite;
+    s->animation = animation;
+    s->frame = frame;
+    s->position = position;
+}
+
+void snapshot_add_actor (RENDER_SNAPSHOT *snapshot, const SPRITE_ACTOR *actor, float alpha)
+{
+    add_sprite (snapshot, actor->sprite, actor->current_animation, actor->current_frame,
+                vlerp (actor->previous_position, actor->position, alpha));
+}
+
+void snapshot_add_npc (RENDER_SNAPSHOT *snapshot, const SPRITE_NPC *npc, float alpha)
+{
+    const ACTORS *actors = npc->actors;
+    int i = actors_index (actors, npc->handle);
+    add_sprite (snapshot, actors->sprite[i], actors->animation[i], actors->frame[i],
+                vlerp (actors->previous[i], actors->position[i], alpha));
+}
+
+/* Shows a dialog once the snapshot is drawn, or hides it when text is NULL. */
+void snapshot_set_dialog (RENDER_SNAPSHOT *snapshot, const char *speaker, const char *text)
+{
+    assert (snapshot);
+
+    snapshot->dialog_changed = true;
+    al_ustr_assign_cstr (snapshot->dialog_speaker, speaker ? speaker : "");
+    al_ustr_assign_cstr (snapshot->dialog_text, text ? text : "");
+}
+
+void snapshot_batch (RENDER_SNAPSHOT *snapshot, SPRITE_BATCH *batch)
+{
+    assert (snapshot);
+
+    for (int i = 0; i < _al_vector_size (&snapshot->sprites); i++) {
+        SNAPSHOT_SPRITE *s = _al_vector_ref (&snapshot->sprites, i);
+        sprite_batch_frame (batch, s->sprite, s->animation, s->frame, s->position, &snapshot->view);
+    }
+}
+
+void snapshot_apply_ui (RENDER_SNAPSHOT *snapshot, UI *ui)
+{
+    assert (snapshot);
+
+    if (!snapshot->dialog_changed)
+        return;
+
+    if (al_ustr_size (snapshot->dialog_text) == 0)
+        ui_show_dialog (ui, NULL, NULL);
+    else
+        ui_show_dialog (ui, snapshot->dialog_speaker, snapshot->dialog_text);
+
+    snapshot->dialog_changed = false;
+}
+
+void snapshot_free (RENDER_SNAPSHOT *snapshot)
+{
+    if (!snapshot)
+        return;
+
+    _al_vector_free (&snapshot->sprites);
+    debug_draw_free (snapshot->debug_draw);
+    al_ustr_free (snapshot->dialog_speaker);
+    al_ustr_free (snapshot->dialog_text);
+}
@@ -0,0 +1,315 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+#include "nostos/spatialgrid.h"
+#include "nostos/utils.h"
+
+#include <float.h>
+#include <math.h>
+
+/*
+ * Uniform grid broadphase. Box indices are bucketed per cell in one flat
+ * array (cell_start holds the offsets), so building is two linear passes
+ * and a query only touches the cells under the query box.
+ */
+
+static inline int cell_x (const SPATIAL_GRID *grid, float x)
+{
+    return CLAMP (0, (int) floorf ((x - grid->origin.x) / grid->cell_size), grid->width - 1);
+}
+
+static inline int cell_y (const SPATIAL_GRID *grid, float y)
+{
+    return CLAMP (0, (int) floorf ((y - grid->origin.y) / grid->cell_size), grid->height - 1);
+}
+
+SPATIAL_GRID *grid_build (BOX *boxes, int num_boxes, float cell_size)
+{
+    assert (boxes);
+    assert (num_boxes > 0);
+    assert (cell_size > 0);
+
+    SPATIAL_GRID *grid = al_malloc (sizeof (SPATIAL_GRID));
+
+    VECTOR2D bmin = (VECTOR2D){FLT_MAX, FLT_MAX};
+    VECTOR2D bmax = (VECTOR2D){-FLT_MAX, -FLT_MAX};
+
+    for (int i = 0; i < num_boxes; i++) {
+        VECTOR2D min = box_get_min (boxes[i]);
+        VECTOR2D max = box_get_max (boxes[i]);
+        bmin.x = MIN (bmin.x, min.x);
+        bmin.y = MIN (bmin.y, min.y);
+        bmax.x = MAX (bmax.x, max.x);
+        bmax.y = MAX (bmax.y, max.y);
+    }
+
+    grid->origin = bmin;
+    grid->cell_size = cell_size;
+    grid->width = (int) floorf ((bmax.x - bmin.x) / cell_size) + 1;
+    grid->height = (int) floorf ((bmax.y - bmin.y) / cell_size) + 1;
+    grid->num_boxes = num_boxes;
+    grid->boxes = al_malloc (num_boxes * sizeof (BOX));
+    memcpy (grid->boxes, boxes, num_boxes * sizeof (BOX));
+
+    int num_cells = grid->width * grid->height;
+    grid->cell_start = al_calloc (num_cells + 1, sizeof (int));
+
+    int num_refs = 0;
+    for (int i = 0; i < num_boxes; i++) {
+        VECTOR2D min = box_get_min (boxes[i]);
+        VECTOR2D max = box_get_max (boxes[i]);
+        int x0 = cell_x (grid, min.x), x1 = cell_x (grid, max.x);
+        int y0 = cell_y (grid, min.y), y1 = cell_y (grid, max.y);
+
+        for (int y = y0; y <= y1; y++)
+            for (int x = x0; x <= x1; x++)
+                grid->cell_start[y * grid->width + x + 1]++;
+
+        num_refs += (x1 - x0 + 1) * (y1 - y0 + 1);
+    }
+
+    for (int c = 0; c < num_cells; c++)
+        grid->cell_start[c + 1] += grid->cell_start[c];
+
+    int *cursor = al_malloc (num_cells * sizeof (int));
+    memcpy (cursor, grid->cell_start, num_cells * sizeof (int));
+    grid->cell_boxes = al_malloc (MAX (num_refs, 1) * sizeof (int));
+
+    for (int i = 0; i < num_boxes; i++) {
+        VECTOR2D min = box_get_min (boxes[i]);
+        VECTOR2D max = box_get_max (boxes[i]);
+        int x0 = cell_x (grid, min.x), x1 = cell_x (grid, max.x);
+        int y0 = cell_y (grid, min.y), y1 = cell_y (grid, max.y);
+
+        for (int y = y0; y <= y1; y++)
+            for (int x = x0; x <= x1; x++)
+                grid->cell_boxes[cursor[y * grid->width + x]++] = i;
+    }
+
+    al_free (cursor);
+
+    debug ("Grid %dx%d cells of %.1f, boxes: %d, references: %d",
+           grid->width, grid->height, cell_size, num_boxes, num_refs);
+
+    return grid;
+}
+
+/*
+ * A box spanning several cells is listed in each of them. It is reported
+ * only from the cell holding the min corner of its overlap with the query,
+ * which dedups without any per-query marks, so queries stay reentrant.
+ */
+void grid_query_visit (const SPATIAL_GRID *grid, const BOX *box, AABB_VISIT_FN visit, void *user)
+{
+    assert (grid);
+    assert (box);
+    assert (visit);
+
+    VECTOR2D qmin = box_get_min (*box);
+    VECTOR2D qmax = box_get_max (*box);
+
+    if (qmax.x < grid->origin.x || qmax.y < grid->origin.y ||
+        qmin.x > grid->origin.x + grid->width * grid->cell_size ||
+        qmin.y > grid->origin.y + grid->height * grid->cell_size)
+        return;
+
+    int x0 = cell_x (grid, qmin.x), x1 = cell_x (grid, qmax.x);
+    int y0 = cell_y (grid, qmin.y), y1 = cell_y (grid, qmax.y);
+
+    for (int y = y0; y <= y1; y++) {
+        for (int x = x0; x <= x1; x++) {
+            int c = y * grid->width + x;
+            for (int k = grid->cell_start[c]; k < grid->cell_start[c + 1]; k++) {
+                BOX *b = &grid->boxes[grid->cell_boxes[k]];
+
+                if (!box_overlap (*box, *b))
+                    continue;
+
+                VECTOR2D bmin = box_get_min (*b);
+                if (cell_x (grid, MAX (bmin.x, qmin.x)) != x || cell_y (grid, MAX (bmin.y, qmin.y)) != y)
+                    continue;
+
+                if (!visit (b, user))
+                    return;
+            }
+        }
+    }
+}
+
+/* Time the segment leaves a box it hits, clipped to the segment end. */
+static float segment_exit (VECTOR2D from, VECTOR2D delta, const BOX *box)
+{
+    VECTOR2D min = box_get_min (*box);
+    VECTOR2D max = box_get_max (*box);
+    float exit = 1.0f;
+
+    if (delta.x != 0)
+        exit = MIN (exit, MAX ((min.x - from.x) / delta.x, (max.x - from.x) / delta.x));
+    if (delta.y != 0)
+        exit = MIN (exit, MAX ((min.y - from.y) / delta.y, (max.y - from.y) / delta.y));
+
+    return exit;
+}
+
+/*
+ * Walks the cells under the segment in order (Amanatides and Woo) and
+ * calls visit for every box the segment hits, until it returns false.
+ * Each cell covers a span of segment times; a box listed in several cells
+ * is reported from the one whose span holds the middle of the part of the
+ * segment inside the box.
+ */
+void grid_query_segment (const SPATIAL_GRID *grid, VECTOR2D from, VECTOR2D to, AABB_VISIT_FN visit, void *user)
+{
+    assert (grid);
+    assert (visit);
+
+    VECTOR2D delta = vsub (to, from);
+    VECTOR2D gmax = {grid->origin.x + grid->width * grid->cell_size,
+                     grid->origin.y + grid->height * grid->cell_size};
+    BOX bounds = {vmulf (vadd (grid->origin, gmax), 0.5f), vmulf (vsub (gmax, grid->origin), 0.5f), NULL};
+    BOX point = {from, {0, 0}, NULL};
+    BOX_HIT hit;
+
+    if (!box_sweep (point, delta, bounds, &hit))
+        return;
+
+    float t = hit.time;
+    float t_end = segment_exit (from, delta, &bounds);
+    VECTOR2D start = vadd (from, vmulf (delta, t));
+    int x = cell_x (grid, start.x);
+    int y = cell_y (grid, start.y);
+
+    int step_x = delta.x > 0 ? 1 : -1;
+    int step_y = delta.y > 0 ? 1 : -1;
+    float next_x = FLT_MAX, next_y = FLT_MAX;
+    float span_x = FLT_MAX, span_y = FLT_MAX;
+
+    if (delta.x != 0) {
+        next_x = (grid->origin.x + (x + (step_x > 0)) * grid->cell_size - from.x) / delta.x;
+        span_x = grid->cell_size / fabsf (delta.x);
+    }
+    if (delta.y != 0) {
+        next_y = (grid->origin.y + (y + (step_y > 0)) * grid->cell_size - from.y) / delta.y;
+        span_y = grid->cell_size / fabsf (delta.y);
+    }
+
+    while (true) {
+        float t_next = MIN (MIN (next_x, next_y), t_end);
+        bool last = t_next >= t_end;
+        int c = y * grid->width + x;
+
+        for (int k = grid->cell_start[c]; k < grid->cell_start[c + 1]; k++) {
+            BOX *b = &grid->boxes[grid->cell_boxes[k]];
+
+            if (!box_sweep (point, delta, *b, &hit))
+                continue;
+
+            float middle = (hit.time + segment_exit (from, delta, b)) * 0.5f;
+            if (middle < t || (middle >= t_next && !last))
+                continue;
+
+            if (!visit (b, user))
+                return;
+        }
+
+        if (last)
+            return;
+
+        if (next_x < next_y) {
+            x += step_x;
+            t = next_x;
+            next_x += span_x;
+        } else {
+            y += step_y;
+            t = next_y;
+            next_y += span_y;
+        }
+
+        if (x < 0 || x >= grid->width || y < 0 || y >= grid->height)
+            return;
+    }
+}
+
+static bool visit_any (BOX *box, void *user)
+{
+    *(bool *)user = true;
+    return false;
+}
+
+static bool visit_fill (BOX *box, void *user)
+{
+    AABB_COLLISIONS *collisions = user;
+    collisions->num_collisions++;
+    *(BOX **)_al_vector_alloc_back (&collisions->boxes) = box;
+    return true;
+}
+
+bool grid_collide (const SPATIAL_GRID *grid, const BOX *box)
+{
+    bool hit = false;
+    grid_query_visit (grid, box, visit_any, &hit);
+    return hit;
+}
+
+void grid_collide_fill (const SPATIAL_GRID *grid, const BOX *box, AABB_COLLISIONS *collisions)
+{
+    assert (collisions);
+
+    collisions->query_box = *box;
+    aabb_clear_collisions (collisions);
+    grid_query_visit (grid, box, visit_fill, collisions);
+}
+
+void grid_free (SPATIAL_GRID *grid)
+{
+    if (!grid)
+        return;
+
+    al_free (grid->cell_start);
+    al_free (grid->cell_boxes);
+    al_free (grid->boxes);
+    al_free (grid);
+}
+
+void grid_draw (SPATIAL_GRID *grid, SCREEN *s, ALLEGRO_COLOR color)
+{
+    for (int i = 0; i < grid->num_boxes; i++)
+        box_draw (grid->boxes[i], s->position, color);
+}
+
+/* Cell lines inside the view, standing in for the tree levels. */
+void grid_debug_draw (const SPATIAL_GRID *grid, DEBUG_DRAW *dd)
+{
+    assert (grid);
+    assert (dd);
+
+    if (!debug_draw_enabled (dd, DEBUG_DRAW_NODES))
+        return;
+
+    ALLEGRO_COLOR color = dd->colors[DEBUG_DRAW_NODES];
+    VECTOR2D vmin = box_get_min (dd->view);
+    VECTOR2D vmax = box_get_max (dd->view);
+    VECTOR2D gmax = {grid->origin.x + grid->width * grid->cell_size,
+                     grid->origin.y + grid->height * grid->cell_size};
+    float top = MAX (vmin.y, grid->origin.y), bottom = MIN (vmax.y, gmax.y);
+    float left = MAX (vmin.x, grid->origin.x), right = MIN (vmax.x, gmax.x);
+
+    if (top > bottom || left > right)
+        return;
+
+    int x0 = CLAMP (0, (int)((left - grid->origin.x) / grid->cell_size), grid->width);
+    int x1 = CLAMP (0, (int)ceilf ((right - grid->origin.x) / grid->cell_size), grid->width);
+    int y0 = CLAMP (0, (int)((top - grid->origin.y) / grid->cell_size), grid->height);
+    int y1 = CLAMP (0, (int)ceilf ((bottom - grid->origin.y) / grid->cell_size), grid->height);
+
+    for (int x = x0; x <= x1; x++) {
+        float px = grid->origin.x + x * grid->cell_size;
+        debug_draw_line (dd, (VECTOR2D){px, top}, (VECTOR2D){px, bottom}, color);
+    }
+
+    for (int y = y0; y <= y1; y++) {
+        float py = grid->origin.y + y * grid->cell_size;
+        debug_draw_line (dd, (VECTOR2D){left, py}, (VECTOR2D){right, py}, color);
+    }
+}
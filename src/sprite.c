@@ -3,6 +3,7 @@
  */
 
 #include "nostos/sprite.h"
+#include "nostos/actors.h"
 #include "nostos/utils.h"
 
 #include <allegro5/allegro_primitives.h>
@@ -74,11 +75,14 @@ void sprite_free_actor (void *value, void *user_data)
     al_free (actor);
 }
 
-void sprite_free_npc (void *value, void *user_data)
+/* NPCs live in the scene's pool and their points in the map, only the route is theirs. */
+void sprite_clear_npc (SPRITE_NPC *npc)
 {
-    SPRITE_NPC *actor = value;
-    al_free (actor->points);
-    al_free (actor);
+    assert (npc);
+
+    if (npc->paths)
+        path_cancel (npc->paths, &npc->route);
+    path_clear (&npc->route);
 }
 
 static inline int * get_int_array (const char *str, int *num)
@@ -292,45 +296,51 @@ static inline VECTOR2D sprite_next_point (SPRITE_NPC *npc)
     return (VECTOR2D) {npc->points[npc->next_point], npc->points[npc->next_point + 1]};
 }
 
-static inline bool sprite_point_is_equal (SPRITE_ACTOR *actor, VECTOR2D v1, VECTOR2D v2, float dt)
+static inline bool sprite_point_is_equal (VECTOR2D v1, VECTOR2D v2, float limit)
 {
     VECTOR2D diff = vabs (vsub (v1, v2));
-    float limit = dt * actor->movement_max;
-
     return (diff.x < limit && diff.y < limit);
 }
 
+/* Walking animation facing the movement, or the standing one when still. */
+int sprite_select_animation (VECTOR2D movement, int current)
+{
+    bool down = movement.y > 0;
+    bool right = movement.x > 0;
+    bool more_vertical = abs (movement.x) < abs (movement.y);
+
+    if (!movement.x && !movement.y) {
+        switch (current) {
+            case ANI_WALK_FRONT: return ANI_STAND_FRONT;
+            case ANI_WALK_BACK: return ANI_STAND_BACK;
+            case ANI_WALK_LEFT: return ANI_STAND_LEFT;
+            case ANI_WALK_RIGHT: return ANI_STAND_RIGHT;
+            default: return current;
+        }
+    }
+    else if (right && down)
+        return more_vertical ? ANI_WALK_FRONT : ANI_WALK_RIGHT;
+    else if (right)
+        return more_vertical ? ANI_WALK_BACK : ANI_WALK_RIGHT;
+    else if (down)
+        return more_vertical ? ANI_WALK_FRONT : ANI_WALK_LEFT;
+    else
+        return more_vertical ? ANI_WALK_BACK : ANI_WALK_LEFT;
+}
+
 void sprite_update (SPRITE_ACTOR *actor, float dt, float t)
 {
     assert (actor);
 
     bool down = actor->movement.y > 0;
     bool right = actor->movement.x > 0;
-    bool more_vertical = abs (actor->movement.x) < abs (actor->movement.y);
 
     int previous_animation = actor->current_animation;
+    actor->current_animation = sprite_select_animation (actor->movement, actor->current_animation);
 
-    if (!actor->movement.x && !actor->movement.y) {
-        switch (actor->current_animation) {
-            case ANI_WALK_FRONT: actor->current_animation = ANI_STAND_FRONT; break;
-            case ANI_WALK_BACK: actor->current_animation = ANI_STAND_BACK; break;
-            case ANI_WALK_LEFT: actor->current_animation = ANI_STAND_LEFT; break;
-            case ANI_WALK_RIGHT: actor->current_animation = ANI_STAND_RIGHT; break;
-        }
-    }
-    else if (right && down)
-        actor->current_animation = more_vertical ? ANI_WALK_FRONT : ANI_WALK_RIGHT;
-    else if (right)
-        actor->current_animation = more_vertical ? ANI_WALK_BACK : ANI_WALK_RIGHT;
-    else if (down)
-        actor->current_animation = more_vertical ? ANI_WALK_FRONT : ANI_WALK_LEFT;
-    else
-        actor->current_animation = more_vertical ? ANI_WALK_BACK : ANI_WALK_LEFT;
-
-    actor->position.x += actor->movement.x * dt;
-    actor->position.y += actor->movement.y * dt;
-    actor->box.center.x += actor->movement.x * dt;
-    actor->box.center.y += actor->movement.y * dt;
+    VECTOR2D step = vmulf (actor->movement, dt);
+    actor->position = vadd (actor->position, step);
+    actor->box.center = vadd (actor->box.center, step);
 
     if (actor->type == ACTOR_TYPE_MAIN) {
         float deaccel = actor->movement_deaccel * dt;
@@ -351,145 +361,288 @@ void sprite_update (SPRITE_ACTOR *actor, float dt, float t)
     }
 
     if (previous_animation == actor->current_animation) {
+        float duration = actor->sprite->duration;
         actor->current_duration += t;
-        if (actor->current_duration > actor->sprite->duration) {
-            actor->current_duration = 0.0;
-            actor->current_frame = (actor->current_frame + 1) %
+        if (actor->current_duration > duration) {
+            int frames = duration > 0 ? (int)(actor->current_duration / duration) : 1;
+            actor->current_duration = duration > 0 ? actor->current_duration - frames * duration : 0;
+            actor->current_frame = (actor->current_frame + frames) %
                                     actor->sprite->animations[actor->current_animation].num_frames;
         }
     } else {
         actor->current_duration = actor->current_frame = 0;
     }
+}
 
-    if (actor->type == ACTOR_TYPE_NPC) {
-        SPRITE_NPC *npc = (SPRITE_NPC *)actor;
-        VECTOR2D next_point = sprite_next_point (npc);
-        switch (npc->action) {
-            case NPC_ACTION_MOVE:
-                if (sprite_is_paused (npc, t))
-                    break;
-
-                if (sprite_point_is_equal (actor, actor->position, next_point, dt)) {
-                    npc->current_point = npc->next_point;
-                    actor->movement = (VECTOR2D){0, 0};
-
-                    npc->next_point += npc->direction;
-                    if ((npc->next_point + npc->direction) == npc->num_points || npc->next_point == 0)
-                        npc->direction = -npc->direction;
-
-                    if (npc->current_point == 0 || npc->current_point + 2 == npc->num_points)
-                        npc->paused = true;
-                } else {
-                    sprite_move_to (actor, next_point.x, next_point.y, dt);
-                }
+/* xorshift32, so NPCs can be updated on any thread in any order. */
+static inline uint32_t npc_random (SPRITE_NPC *npc)
+{
+    uint32_t x = npc->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return npc->random = x;
+}
 
+static void npc_move_to (SPRITE_NPC *npc, VECTOR2D *movement, VECTOR2D position, VECTOR2D target)
+{
+    *movement = vmulf (vnormalize (vsub (target, position)), npc->movement_max);
+}
+
+/*
+ * Heads for target along the route when there is one, standing still
+ * while it, or the next stretch of it, is being searched. Without a
+ * route, or when none was found, it walks the straight line.
+ */
+static void npc_follow (SPRITE_NPC *npc, VECTOR2D *movement, VECTOR2D position, VECTOR2D target, float limit)
+{
+    VECTOR2D waypoint;
+    bool routed = path_next (npc->paths, &npc->route, vadd (position, npc->offset), limit, &waypoint);
+
+    if (npc->route.status == PATH_PENDING) {
+        *movement = (VECTOR2D){0, 0};
+        return;
+    }
+
+    if (routed)
+        target = vsub (waypoint, npc->offset);
+
+    npc_move_to (npc, movement, position, target);
+}
+
+/* Path following, deciding the movement the next update integrates. */
+static void sprite_update_npc (SPRITE_NPC *npc, VECTOR2D position, VECTOR2D *movement, float dt, float t)
+{
+    VECTOR2D next_point = sprite_next_point (npc);
+    float limit = dt * npc->movement_max;
+
+    switch (npc->action) {
+        case NPC_ACTION_MOVE:
+            if (sprite_is_paused (npc, t))
                 break;
-            case NPC_ACTION_MOVE_RANDOM:
-                if (sprite_is_paused (npc, t))
-                    break;
-
-                if (sprite_point_is_equal (actor, actor->position, next_point, dt)) {
-                    npc->current_point = npc->next_point;
-                    npc->next_point = 2 * (rand () % ((npc->num_points / 2) - 1));
-                    actor->movement = (VECTOR2D){0, 0};
+
+            if (sprite_point_is_equal (position, next_point, limit)) {
+                npc->current_point = npc->next_point;
+                *movement = (VECTOR2D){0, 0};
+
+                npc->next_point += npc->direction;
+                if ((npc->next_point + npc->direction) == npc->num_points || npc->next_point == 0)
+                    npc->direction = -npc->direction;
+
+                if (npc->current_point == 0 || npc->current_point + 2 == npc->num_points)
                     npc->paused = true;
-                } else {
-                    sprite_move_to (actor, next_point.x, next_point.y, dt);
-                }
+            } else {
+                npc_move_to (npc, movement, position, next_point);
+            }
 
+            break;
+        case NPC_ACTION_MOVE_RANDOM:
+            if (sprite_is_paused (npc, t))
                 break;
-            default:
-                break;
-        }
+
+            if (sprite_point_is_equal (position, next_point, limit)) {
+                npc->current_point = npc->next_point;
+                npc->next_point = 2 * (npc_random (npc) % ((npc->num_points / 2) - 1));
+                *movement = (VECTOR2D){0, 0};
+                npc->paused = true;
+
+                /* Searched while the NPC waits */
+                if (npc->paths)
+                    path_request (npc->paths, &npc->route, vadd (position, npc->offset),
+                                  vadd (sprite_next_point (npc), npc->offset));
+            } else {
+                npc_follow (npc, movement, position, next_point, limit);
+            }
+
+            break;
+        default:
+            break;
     }
 }
 
+/* Items per job when NPC updates are spread over the job system */
+#define NPC_DECIDE_GRAIN 64
+#define NPC_STEP_GRAIN 256
+
+typedef struct NPC_UPDATE {
+    ACTORS *actors;
+    float dt;
+    float t;
+    double start;
+    double budget;
+} NPC_UPDATE;
+
+static void decide_npcs (void *data, int begin, int end)
+{
+    NPC_UPDATE *update = data;
+    ACTORS *actors = update->actors;
+
+    for (int j = begin; j < end; j++) {
+        if (update->budget > 0 && al_get_time () - update->start > update->budget)
+            break;
+
+        int i = actors->due[j];
+        int ticks = actors->waiting[i];
+        sprite_update_npc (actors->data[i], actors->position[i], &actors->movement[i],
+                           update->dt * ticks, update->t * ticks);
+        actors->ticks[i] = ticks;
+        actors->waiting[i] = 0;
+    }
+}
+
+static void step_npcs (void *data, int begin, int end)
+{
+    NPC_UPDATE *update = data;
+    actors_update_range (update->actors, begin, end, update->dt, update->t);
+}
+
+/*
+ * Lets each NPC the store scheduled pick its movement over the ticks it
+ * has been waiting, then moves and animates them in bulk, both spread
+ * over jobs (run here when it is NULL). Every NPC only touches its own
+ * state and draws from its own random sequence, so the outcome does not
+ * depend on how the work was split.
+ *
+ * The decisions stop once budget seconds are spent (none when it is 0);
+ * the NPCs left out stay put and catch up on their next turn, at the
+ * front of the queue. Returns how many NPCs were updated.
+ */
+int sprite_update_npcs (JOBS *jobs, ACTORS *actors, float dt, float t, double budget)
+{
+    assert (actors);
+
+    NPC_UPDATE update = {actors, dt, t, al_get_time (), budget};
+
+    jobs_parallel_for (jobs, actors->num_due, NPC_DECIDE_GRAIN, decide_npcs, &update);
+    jobs_parallel_for (jobs, actors->num_actors, NPC_STEP_GRAIN, step_npcs, &update);
+
+    int num_updated = 0;
+    for (int j = 0; j < actors->num_due; j++)
+        num_updated += actors->ticks[actors->due[j]] > 0;
+
+    return num_updated;
+}
+
+void sprite_batch_npc (SPRITE_BATCH *batch, const SPRITE_NPC *npc, float alpha, SCREEN *screen)
+{
+    const ACTORS *actors = npc->actors;
+    int i = actors_index (actors, npc->handle);
+    sprite_batch_frame (batch, actors->sprite[i], actors->animation[i], actors->frame[i],
+                        vlerp (actors->previous[i], actors->position[i], alpha), screen);
+}
+
+static void sprite_frame_quad (SPRITE *sprite, int animation, int frame, VECTOR2D position, SCREEN *screen,
+                               ALLEGRO_VERTEX *v)
+{
+    int x = round (position.x - screen->position.x) + 0.5;
+    int y = round (position.y - screen->position.y) + 0.5;
+    int w = sprite->tileset->tile_width;
+    int h = sprite->tileset->tile_height;
+
+    SPRITE_ANIMATION *anim = &sprite->animations[animation];
+    VECTOR2D *tile = &sprite->tileset->tiles[anim->frames[frame]];
+    v[0] = (ALLEGRO_VERTEX){.x = x,     .y = y,     .u = tile->x,     .v = tile->y,     .color = screen->tint};
+    v[1] = (ALLEGRO_VERTEX){.x = x,     .y = y + h, .u = tile->x,     .v = tile->y + h, .color = screen->tint};
+    v[2] = (ALLEGRO_VERTEX){.x = x + w, .y = y + h, .u = tile->x + w, .v = tile->y + h, .color = screen->tint};
+    v[3] = (ALLEGRO_VERTEX){.x = x + w, .y = y,     .u = tile->x + w, .v = tile->y,     .color = screen->tint};
+}
+
+void sprite_draw_frame (SPRITE *sprite, int animation, int frame, VECTOR2D position, SCREEN *screen)
+{
+    ALLEGRO_VERTEX v[4];
+    sprite_frame_quad (sprite, animation, frame, position, screen, v);
+    al_draw_prim (v, NULL, sprite->tileset->bitmap, 0, 4, ALLEGRO_PRIM_TRIANGLE_FAN);
+}
+
+/* Queues the frame if any of it is on screen, ordered by where its feet are. */
+void sprite_batch_frame (SPRITE_BATCH *batch, SPRITE *sprite, int animation, int frame, VECTOR2D position,
+                         SCREEN *screen)
+{
+    VECTOR2D p = vsub (position, screen->position);
+    if (p.x >= screen->width || p.y >= screen->height ||
+        p.x + sprite->tileset->tile_width <= 0 || p.y + sprite->tileset->tile_height <= 0)
+        return;
+
+    ALLEGRO_VERTEX v[4];
+    sprite_frame_quad (sprite, animation, frame, position, screen, v);
+    sprite_batch_add (batch, sprite->tileset->bitmap, v, p.y + sprite->tileset->tile_height);
+}
+
 void sprite_draw (SPRITE_ACTOR *actor, SCREEN *screen)
 {
-    int x = round (actor->position.x - screen->position.x) + 0.5;
-    int y = round (actor->position.y - screen->position.y) + 0.5;
-    int w = actor->sprite->tileset->tile_width;
-    int h = actor->sprite->tileset->tile_height;
-    float z = y / (float)screen->height;
-
-    SPRITE_ANIMATION *anim = &actor->sprite->animations[actor->current_animation];
-    VECTOR2D *tile = &actor->sprite->tileset->tiles[anim->frames[actor->current_frame]];
-    ALLEGRO_VERTEX v[] = {
-        {.x = x,     .y = y,     .z = z, .u = tile->x,     .v = tile->y,     .color = screen->tint},
-        {.x = x,     .y = y + h, .z = z, .u = tile->x,     .v = tile->y + h, .color = screen->tint},
-        {.x = x + w, .y = y + h, .z = z, .u = tile->x + w, .v = tile->y + h, .color = screen->tint},
-        {.x = x + w, .y = y,     .z = z, .u = tile->x + w, .v = tile->y,     .color = screen->tint},
-    };
-    al_draw_prim (v, NULL, actor->sprite->tileset->bitmap, 0, 4, ALLEGRO_PRIM_TRIANGLE_FAN);
+    sprite_draw_frame (actor->sprite, actor->current_animation, actor->current_frame, actor->position, screen);
     //box_draw (actor->box, screen->position, al_map_rgb_f (1, 1, 1));
 }
 
-LIST *sprite_load_npcs (SPRITES *sprites, TILED_MAP *map, const char *layer_name)
+/* Drawn alpha of the way from its previous step to its current one. */
+void sprite_batch_actor (SPRITE_BATCH *batch, SPRITE_ACTOR *actor, float alpha, SCREEN *screen)
 {
-    TILED_LAYER_OBJECT *layer = (TILED_LAYER_OBJECT *)tiled_layer_by_name (map, layer_name);
-    LIST *npcs = _al_list_create ();
+    sprite_batch_frame (batch, actor->sprite, actor->current_animation, actor->current_frame,
+                        vlerp (actor->previous_position, actor->position, alpha), screen);
+}
 
-    if (layer && layer->objects) {
-        LIST_ITEM *item = _al_list_front (layer->objects);
+/* The action named in a map, standing for names it does not know. */
+int sprite_npc_action (const char *name)
+{
+    for (int i = 0; name && i < NUM_ACTIONS; i++) {
+        if (!strcmp (name, str_npc_actions[i]))
+            return i;
+    }
 
-        while (item) {
-            TILED_OBJECT *object = _al_list_item_data (item);
-            SPRITE_NPC *npc = al_malloc (sizeof (SPRITE_NPC));
-            npc->actor = sprite_init_copy ();
-            npc->actor.type = ACTOR_TYPE_NPC;
-
-            switch (object->type) {
-                TILED_OBJECT_GEOM *object_geom;
-                case OBJECT_TYPE_GEOM:
-                    object_geom = (TILED_OBJECT_GEOM *)object;
-
-                    const char *actionstr = aa_search (object_geom->object.properties, "action", charcmp);
-                    const char *charstr = aa_search (object_geom->object.properties, "char", charcmp);
-
-                    for (int i = 0; i < NUM_ACTIONS; i++) {
-                        if (!strcmp (actionstr, str_npc_actions[i])) {
-                            npc->action = i;
-                            npc->points = object_geom->points;
-                            npc->num_points = object_geom->num_points * 2;
-                            break;
-                        }
-                    }
-
-                    sprite_init_actor (sprites, &npc->actor, charstr);
-                    for (int j = 0; j < npc->num_points; j+=2) {
-                        npc->points[j] -= npc->actor.sprite->tileset->tile_width / 2;
-                        npc->points[j + 1] -= npc->actor.sprite->tileset->tile_height / 2;
-                    }
-
-                    npc->actor.position.x = npc->points[0];
-                    npc->actor.position.y = npc->points[1];
-                    npc->actor.box.center.x = npc->points[0] + npc->actor.sprite->box.center.x;
-                    npc->actor.box.center.y = npc->points[1] + npc->actor.sprite->box.center.y;
-                    npc->current_point = 0;
-                    npc->paused = false;
-                    npc->pause_duration = 3;
-                    npc->current_pause_duration = 0;
-                    npc->direction = 2;
-                    if (npc->num_points > 2) {
-                        npc->next_point = npc->direction;
-                        if (npc->next_point == npc->num_points - 2)
-                            npc->direction = -npc->direction;
-                    } else {
-                        npc->next_point = 0;
-                        npc->action = NPC_ACTION_STAND;
-                    }
-                    break;
-                default:
-                    debug ("FIX: Found unsupported object in sprites layer. Only geometries (lines and polygons) are supported.");
-                    break;
-            }
+    return NPC_ACTION_STAND;
+}
 
-            _al_list_push_back_ex (npcs, npc, sprite_free_actor);
-            item = _al_list_next (layer->objects, item);
-        }
+/*
+ * Sets up an NPC walking points, num_points floats that stay the caller's,
+ * and adds its actor. The NPC is left without paths and outside any world.
+ */
+void sprite_init_npc (SPRITE_NPC *npc, ACTORS *actors, SPRITE *sprite, int action, float *points, int num_points)
+{
+    assert (npc);
+    assert (actors);
+    assert (sprite);
+    assert (points && num_points >= 2);
+
+    npc->actors = actors;
+    npc->handle = actors_add (actors, sprite, (VECTOR2D){points[0], points[1]}, npc);
+    npc->proxy = HANDLE_INVALID;
+    npc->action = action;
+    npc->points = points;
+    npc->num_points = num_points;
+    npc->movement_max = sprite_init_copy ().movement_max;
+    /* Seeded from where it starts, so a scene plays out the same every time */
+    npc->random = ((uint32_t)npc->handle + 1) * 2654435761u ^
+                  ((uint32_t)(int32_t)points[0] << 16 | ((uint32_t)(int32_t)points[1] & 0xFFFF));
+    if (!npc->random)
+        npc->random = 1;
+    npc->current_point = 0;
+    npc->paused = false;
+    npc->pause_duration = 3;
+    npc->current_pause_duration = 0;
+    npc->direction = 2;
+    npc->paths = NULL;
+    npc->offset = sprite->box.center;
+    path_init (&npc->route, npc->handle);
+    if (num_points > 2) {
+        npc->next_point = npc->direction;
+        if (npc->next_point == num_points - 2)
+            npc->direction = -npc->direction;
+    } else {
+        npc->next_point = 0;
+        npc->action = NPC_ACTION_STAND;
     }
+}
 
-    return npcs;
+BOX sprite_npc_box (const SPRITE_NPC *npc)
+{
+    return actors_box (npc->actors, npc->handle);
+}
+
+VECTOR2D sprite_npc_position (const SPRITE_NPC *npc, float alpha)
+{
+    const ACTORS *actors = npc->actors;
+    int i = actors_index (actors, npc->handle);
+    return vlerp (actors->previous[i], actors->position[i], alpha);
 }
 
 void sprite_center (SPRITE_ACTOR *actor, VECTOR2D *v)
@@ -498,5 +651,6 @@ void sprite_center (SPRITE_ACTOR *actor, VECTOR2D *v)
     VECTOR2D dim = {actor->sprite->tileset->tile_width * 0.5f, actor->sprite->tileset->tile_height * 0.5f};
     actor->position = vsub (actor->position, dim);
     actor->box.center = vadd (actor->position, actor->sprite->box.center);
+    actor->previous_position = actor->position;
 }
 
@@ -0,0 +1,167 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+/*
+ * Sprite batching with painter's ordering. Each quad is queued with a
+ * depth, for sprites the screen y of their feet, and the queue is sorted
+ * back to front at flush time: whatever stands lower on screen is drawn
+ * later and covers what stands behind it. This replaces the depth buffer
+ * and the alpha test the sprite pass used to need, which also dropped the
+ * half transparent edges of every frame.
+ *
+ * The sort is a stable LSD radix sort on the depth turned into an
+ * unsigned key, one pass per byte. Most frames keep every depth within a
+ * screen, so the high bytes agree across the whole queue and those passes
+ * are skipped. Quads tied on depth keep the order they were added in.
+ *
+ * Runs of quads on the same texture after sorting go out in a single
+ * indexed triangle list; all arrays are kept between frames and only grow.
+ */
+
+#include "nostos/spritebatch.h"
+
+#define SORT_RADIX 256
+
+typedef struct BATCH_ITEM {
+    ALLEGRO_BITMAP *bitmap;
+    ALLEGRO_VERTEX quad[4];
+    uint32_t key;
+} BATCH_ITEM;
+
+/* Maps floats to unsigned keys with the same order, negatives included. */
+static uint32_t depth_key (float depth)
+{
+    union { float f; uint32_t u; } bits = {depth};
+    return (bits.u & 0x80000000u) ? ~bits.u : bits.u | 0x80000000u;
+}
+
+SPRITE_BATCH *sprite_batch_create ()
+{
+    SPRITE_BATCH *batch = al_calloc (1, sizeof (SPRITE_BATCH));
+    _al_vector_init (&batch->items, sizeof (BATCH_ITEM));
+    _al_vector_init (&batch->vertices, sizeof (ALLEGRO_VERTEX));
+    _al_vector_init (&batch->indices, sizeof (int));
+    return batch;
+}
+
+void sprite_batch_begin (SPRITE_BATCH *batch)
+{
+    assert (batch);
+
+    vector_shrink (&batch->items, _al_vector_size (&batch->items));
+    vector_shrink (&batch->vertices, _al_vector_size (&batch->vertices));
+    vector_shrink (&batch->indices, _al_vector_size (&batch->indices));
+}
+
+/* Quad vertices in triangle fan order, as sprite_draw_frame builds them. */
+void sprite_batch_add (SPRITE_BATCH *batch, ALLEGRO_BITMAP *bitmap, const ALLEGRO_VERTEX *quad, float depth)
+{
+    assert (batch);
+    assert (quad);
+
+    BATCH_ITEM *item = _al_vector_alloc_back (&batch->items);
+    item->bitmap = bitmap;
+    item->key = depth_key (depth);
+    for (int i = 0; i < 4; i++)
+        item->quad[i] = quad[i];
+}
+
+/* Leaves batch->order holding the item indices by ascending key. */
+static void sort_items (SPRITE_BATCH *batch, int num)
+{
+    if (num > batch->order_capacity) {
+        batch->order_capacity = MAX (num, batch->order_capacity * 2);
+        batch->order = al_realloc (batch->order, batch->order_capacity * sizeof (int));
+        batch->scratch = al_realloc (batch->scratch, batch->order_capacity * sizeof (int));
+    }
+
+    BATCH_ITEM *items = _al_vector_ref_front (&batch->items);
+    int *order = batch->order;
+    int *scratch = batch->scratch;
+
+    for (int i = 0; i < num; i++)
+        order[i] = i;
+
+    for (int shift = 0; shift < 32; shift += 8) {
+        int count[SORT_RADIX] = {0};
+        for (int i = 0; i < num; i++)
+            count[(items[order[i]].key >> shift) & 0xFF]++;
+
+        if (count[(items[order[0]].key >> shift) & 0xFF] == num)
+            continue;
+
+        int sum = 0;
+        for (int b = 0; b < SORT_RADIX; b++) {
+            int c = count[b];
+            count[b] = sum;
+            sum += c;
+        }
+
+        for (int i = 0; i < num; i++)
+            scratch[count[(items[order[i]].key >> shift) & 0xFF]++] = order[i];
+
+        int *swap = order;
+        order = scratch;
+        scratch = swap;
+    }
+
+    batch->order = order;
+    batch->scratch = scratch;
+}
+
+void sprite_batch_flush (SPRITE_BATCH *batch)
+{
+    assert (batch);
+
+    int num = _al_vector_size (&batch->items);
+
+    batch->num_quads = num;
+    batch->num_vertices = num * 4;
+    batch->num_draw_calls = 0;
+
+    if (num == 0)
+        return;
+
+    sort_items (batch, num);
+
+    static const int fan[6] = {0, 1, 2, 0, 2, 3};
+    for (int i = 0; i < num; i++) {
+        BATCH_ITEM *item = _al_vector_ref (&batch->items, batch->order[i]);
+        for (int k = 0; k < 4; k++)
+            *(ALLEGRO_VERTEX *)_al_vector_alloc_back (&batch->vertices) = item->quad[k];
+        for (int k = 0; k < 6; k++)
+            *(int *)_al_vector_alloc_back (&batch->indices) = i * 4 + fan[k];
+    }
+
+    ALLEGRO_VERTEX *vertices = _al_vector_ref_front (&batch->vertices);
+    int *indices = _al_vector_ref_front (&batch->indices);
+
+    int first = 0;
+    while (first < num) {
+        ALLEGRO_BITMAP *bitmap = ((BATCH_ITEM *)_al_vector_ref (&batch->items, batch->order[first]))->bitmap;
+        int last = first + 1;
+        while (last < num && ((BATCH_ITEM *)_al_vector_ref (&batch->items, batch->order[last]))->bitmap == bitmap)
+            last++;
+
+        al_draw_indexed_prim (vertices, NULL, bitmap, indices + first * 6, (last - first) * 6,
+                              ALLEGRO_PRIM_TRIANGLE_LIST);
+        batch->num_draw_calls++;
+        first = last;
+    }
+
+    sprite_batch_begin (batch);
+}
+
+void sprite_batch_free (SPRITE_BATCH *batch)
+{
+    if (!batch)
+        return;
+
+    _al_vector_free (&batch->items);
+    _al_vector_free (&batch->vertices);
+    _al_vector_free (&batch->indices);
+    al_free (batch->order);
+    al_free (batch->scratch);
+    al_free (batch);
+}
@@ -80,6 +80,7 @@ void tiled_free_map (TILED_MAP *map)
     aa_free (map->properties);
     _al_list_destroy(map->strings);
     aa_free (map->tiles);
+    al_free (map->tile_flags);
     al_free(map);
 }
 
@@ -113,6 +114,7 @@ static void dtor_layer(void *value, void *user_data)
             for (int i = 0; i < layer->height; i++)
                 al_free (tile_layer->tiles[i]);
             al_free (tile_layer->tiles);
+            al_free (tile_layer->flag_bits);
             break;
         case LAYER_TYPE_OBJECT:
             object_layer = (TILED_LAYER_OBJECT *) layer;
@@ -252,6 +254,71 @@ static AATREE *get_properties (xmlNode *node, TILED_MAP *map)
 }
 
 
+static const char *flag_names[TILED_NUM_FLAGS] = {"solid", "water", "slow", "trigger", "opaque"};
+
+/*
+ * Flattens the tile properties naming a flag into one word per gid, so
+ * cell checks never go through the property trees.
+ */
+static void load_tile_flags (TILED_MAP *map)
+{
+    map->num_gids = 1;
+    LIST_ITEM *item = _al_list_front (map->tilesets);
+    while (item) {
+        TILED_TILESET *tileset = _al_list_item_data (item);
+        map->num_gids = MAX (map->num_gids, tileset->first_gid + tileset->num_tiles);
+        item = _al_list_next (map->tilesets, item);
+    }
+
+    map->tile_flags = al_calloc (map->num_gids, sizeof (unsigned int));
+
+    item = _al_list_front (map->tilesets);
+    while (item) {
+        TILED_TILESET *tileset = _al_list_item_data (item);
+        for (int i = 0; i < tileset->num_tiles; i++) {
+            TILED_TILE *tile = &tileset->tiles[i];
+            if (!tile->properties)
+                continue;
+
+            for (int f = 0; f < TILED_NUM_FLAGS; f++) {
+                const char *value = aa_search (tile->properties, flag_names[f], charcmp);
+                if (value && strcmp (value, "0") && strcmp (value, "false"))
+                    map->tile_flags[tile->gid] |= 1u << f;
+            }
+        }
+        item = _al_list_next (map->tilesets, item);
+    }
+}
+
+/*
+ * One bitset per flag with a row of 32 bit words per tile row, laid out
+ * flag by flag. Rectangle queries then test 32 cells per word.
+ */
+static void load_layer_flags (TILED_MAP *map, TILED_LAYER_TILE *tile_layer)
+{
+    TILED_LAYER *layer = &tile_layer->layer;
+
+    tile_layer->flags = 0;
+    tile_layer->flag_words = (layer->width + 31) / 32;
+    tile_layer->flag_bits = al_calloc (TILED_NUM_FLAGS * layer->height * tile_layer->flag_words,
+                                       sizeof (uint32_t));
+
+    for (int j = 0; j < layer->height; j++) {
+        for (int i = 0; i < layer->width; i++) {
+            TILED_TILE *tile = tile_layer->tiles[j][i];
+            unsigned int flags = tile ? map->tile_flags[tile->gid] : 0;
+
+            tile_layer->flags |= flags;
+            for (int f = 0; flags; f++, flags >>= 1) {
+                if (flags & 1) {
+                    uint32_t *row = tile_layer->flag_bits + (f * layer->height + j) * tile_layer->flag_words;
+                    row[i / 32] |= 1u << (i % 32);
+                }
+            }
+        }
+    }
+}
+
 TILED_MAP* tiled_load_tmx_file (const char *filename)
 {
     TILED_MAP *map;
@@ -287,6 +354,7 @@ TILED_MAP* tiled_load_tmx_file (const char *filename)
     map->strings = _al_list_create ();
     map->properties = get_properties (root, map);
     map->tiles = NULL;
+    map->tile_flags = NULL;
 
     str = get_xml_attribute (root, "orientation");
     if (!strcmp (str, "orthogonal"))
@@ -360,6 +428,8 @@ TILED_MAP* tiled_load_tmx_file (const char *filename)
 
     _al_list_destroy (tileset_nodes);
 
+    load_tile_flags (map);
+
     // Layers
     LIST *layer_nodes = get_children_for_name (root, 2, "layer", "objectgroup");
     map->layers = create_list (_al_list_size (layer_nodes));
@@ -385,6 +455,7 @@ TILED_MAP* tiled_load_tmx_file (const char *filename)
         layer->width = get_int (layer_node, "width", 0);
         layer->height = get_int (layer_node, "height", 0);
         layer->opacity = get_float (layer_node, "opacity", 1.0);
+        layer->visible = get_int (layer_node, "visible", 1);
         layer->map = map;
         layer->properties = get_properties (layer_node, map);
 
@@ -415,6 +486,8 @@ TILED_MAP* tiled_load_tmx_file (const char *filename)
                 }
             }
             _al_list_destroy (tile_nodes);
+
+            load_layer_flags (map, tile_layer);
         } else if (layer->type == LAYER_TYPE_OBJECT) {
             TILED_LAYER_OBJECT *object_layer = (TILED_LAYER_OBJECT *)layer;
 
@@ -447,16 +520,21 @@ TILED_MAP* tiled_load_tmx_file (const char *filename)
                 } else {
                     TILED_OBJECT_GEOM *obj = al_malloc (sizeof (TILED_OBJECT_GEOM));
                     obj->object.type = OBJECT_TYPE_GEOM;
+                    obj->points = NULL;
+                    obj->num_points = 0;
 
                     xmlNode *poly_node = get_first_child_for_name (object_node, "polyline");
                     if (poly_node) {
+                        obj->type = GEOM_TYPE_POLYLINE;
                         obj->points = get_float_points (poly_node, "points", &obj->num_points);
                         offset_points (px, py, obj->points, obj->num_points);
                     } else {
                         poly_node = get_first_child_for_name (object_node, "polygon");
-                        if (poly_node)
+                        obj->type = GEOM_TYPE_POLYGON;
+                        if (poly_node) {
                             obj->points = get_float_points (poly_node, "points", &obj->num_points);
                             offset_points (px, py, obj->points, obj->num_points);
+                        }
                     }
                     cobj = (TILED_OBJECT *) obj;
                 }
@@ -507,6 +585,62 @@ void tiled_draw_map_fore (TILED_MAP *map, ALLEGRO_COLOR tint, float sx, float sy
     tiled_draw_layers (map->layers_fore, tint, sx, sy, sw, sh, dx, dy, flags);
 }
 
+/*
+ * Queues the tile objects of the visible back object layers, so they are
+ * ordered with the sprites. Tiled anchors tile objects at their bottom
+ * left corner, which is also their depth. Quads are cut from the tileset
+ * image rather than the tile sub-bitmap to keep one texture per tileset.
+ */
+void tiled_batch_objects (TILED_MAP *map, SPRITE_BATCH *batch, ALLEGRO_COLOR tint, float sx, float sy, float sw, float sh)
+{
+    assert (map);
+    assert (batch);
+
+    LIST_ITEM *layer_item = _al_list_front (map->layers_back);
+    while (layer_item) {
+        TILED_LAYER *layer = _al_list_item_data (layer_item);
+        layer_item = _al_list_next (map->layers_back, layer_item);
+
+        if (layer->type != LAYER_TYPE_OBJECT || !layer->visible)
+            continue;
+
+        TILED_LAYER_OBJECT *object_layer = (TILED_LAYER_OBJECT*) layer;
+        LIST_ITEM *object_item = _al_list_front (object_layer->objects);
+        while (object_item) {
+            TILED_OBJECT *object = _al_list_item_data (object_item);
+            object_item = _al_list_next (object_layer->objects, object_item);
+
+            if (object->type != OBJECT_TYPE_TILE)
+                continue;
+
+            TILED_TILE *tile = ((TILED_OBJECT_TILE*) object)->tile;
+            if (!tile)
+                continue;
+
+            TILED_TILESET *tileset = tile->tileset;
+            float w = tileset->tile_width;
+            float h = tileset->tile_height;
+            float x = object->x - sx;
+            float y = object->y - h - sy;
+
+            if (x >= sw || y >= sh || x + w <= 0 || y + h <= 0)
+                continue;
+
+            int tiles_per_row = tileset->image_width / tileset->tile_width;
+            float u = (tile->id % tiles_per_row) * w;
+            float v = (tile->id / tiles_per_row) * h;
+
+            ALLEGRO_VERTEX quad[4] = {
+                {.x = x,     .y = y,     .u = u,     .v = v,     .color = tint},
+                {.x = x,     .y = y + h, .u = u,     .v = v + h, .color = tint},
+                {.x = x + w, .y = y + h, .u = u + w, .v = v + h, .color = tint},
+                {.x = x + w, .y = y,     .u = u + w, .v = v,     .color = tint}
+            };
+            sprite_batch_add (batch, tileset->bitmap, quad, y + h);
+        }
+    }
+}
+
 void tiled_draw_layers (LIST *layers, ALLEGRO_COLOR tint, float sx, float sy, float sw, float sh, float dx, float dy, int flags)
 {
     assert (layers);
@@ -567,3 +701,75 @@ TILED_LAYER* tiled_layer_by_name (TILED_MAP *map, const char *name)
     return NULL;
 }
 
+/* The flag a tile property sets, 0 when the name is not one of them. */
+unsigned int tiled_flag_by_name (const char *name)
+{
+    assert (name);
+
+    for (int f = 0; f < TILED_NUM_FLAGS; f++) {
+        if (!strcmp (name, flag_names[f]))
+            return 1u << f;
+    }
+
+    return 0;
+}
+
+unsigned int tiled_cell_flags (TILED_MAP *map, TILED_LAYER *layer, int x, int y)
+{
+    assert (map);
+
+    if (!layer || layer->type != LAYER_TYPE_TILE ||
+        x < 0 || y < 0 || x >= layer->width || y >= layer->height)
+        return 0;
+
+    TILED_TILE *tile = ((TILED_LAYER_TILE *)layer)->tiles[y][x];
+    return tile ? map->tile_flags[tile->gid] : 0;
+}
+
+/*
+ * OR of the flags of every cell in the w x h tile rectangle at (x, y),
+ * clipped to the layer.
+ */
+unsigned int tiled_rect_flags (TILED_MAP *map, TILED_LAYER *layer, int x, int y, int w, int h)
+{
+    assert (map);
+
+    if (!layer || layer->type != LAYER_TYPE_TILE)
+        return 0;
+
+    TILED_LAYER_TILE *tile_layer = (TILED_LAYER_TILE *)layer;
+    int x0 = MAX (x, 0), y0 = MAX (y, 0);
+    int x1 = MIN (x + w, layer->width), y1 = MIN (y + h, layer->height);
+
+    if (x0 >= x1 || y0 >= y1)
+        return 0;
+
+    int first = x0 / 32, last = (x1 - 1) / 32;
+    uint32_t first_mask = ~0u << (x0 % 32);
+    uint32_t last_mask = ~0u >> (31 - (x1 - 1) % 32);
+    unsigned int result = 0;
+
+    for (int f = 0; f < TILED_NUM_FLAGS; f++) {
+        if (!(tile_layer->flags & (1u << f)))
+            continue;
+
+        const uint32_t *bits = tile_layer->flag_bits + f * layer->height * tile_layer->flag_words;
+        for (int j = y0; j < y1 && !(result & (1u << f)); j++) {
+            const uint32_t *row = bits + j * tile_layer->flag_words;
+            uint32_t any;
+
+            if (first == last) {
+                any = row[first] & first_mask & last_mask;
+            } else {
+                any = (row[first] & first_mask) | (row[last] & last_mask);
+                for (int k = first + 1; k < last && !any; k++)
+                    any = row[k];
+            }
+
+            if (any)
+                result |= 1u << f;
+        }
+    }
+
+    return result;
+}
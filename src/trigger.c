@@ -0,0 +1,152 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+/*
+ * Trigger volumes: instead of acting on every overlap every tick, each
+ * actor keeps the set of trigger proxies it was inside on the last update
+ * and only hears about the difference. The collisions an update takes are
+ * the ones world_move or world_collide_fill already left for the actor, so
+ * the cost is a sort of those few proxies and one merge against the old
+ * set; events are only produced when something changes, plus a stay event
+ * per overlap when the set asks for them.
+ */
+
+#include "nostos/trigger.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+static int proxycmp (const void *a, const void *b)
+{
+    uintptr_t pa = (uintptr_t)*(WORLD_PROXY * const *)a;
+    uintptr_t pb = (uintptr_t)*(WORLD_PROXY * const *)b;
+
+    return (pa > pb) - (pa < pb);
+}
+
+static void push_event (TRIGGER_SET *set, int type, const WORLD_PROXY *proxy)
+{
+    TRIGGER_EVENT *event = _al_vector_alloc_back (&set->events);
+    event->type = type;
+    event->category = proxy->category;
+    event->data = proxy->data;
+}
+
+/* Sorted, duplicate free proxies in mask from the collisions. */
+static void collect (TRIGGER_SET *set, const AABB_COLLISIONS *collisions)
+{
+    VECTOR *current = &set->current;
+    int size = 0;
+
+    vector_shrink (current, _al_vector_size (current));
+    if (!collisions)
+        return;
+
+    for (int i = 0; i < collisions->num_collisions; i++) {
+        BOX *box = *(BOX **)_al_vector_ref (&collisions->boxes, i);
+        WORLD_PROXY *proxy = world_proxy (box);
+        if (proxy->category & set->mask)
+            *(WORLD_PROXY **)_al_vector_alloc_back (current) = proxy;
+    }
+
+    if (_al_vector_is_empty (current))
+        return;
+
+    WORLD_PROXY **proxies = _al_vector_ref_front (current);
+    int count = _al_vector_size (current);
+    qsort (proxies, count, sizeof (WORLD_PROXY *), proxycmp);
+
+    for (int i = 0; i < count; i++) {
+        if (size == 0 || proxies[size - 1] != proxies[i])
+            proxies[size++] = proxies[i];
+    }
+    vector_shrink (current, count - size);
+}
+
+static void swap_sets (TRIGGER_SET *set)
+{
+    VECTOR tmp = set->inside;
+    set->inside = set->current;
+    set->current = tmp;
+}
+
+void trigger_init_set (TRIGGER_SET *set, unsigned int mask, bool report_stay)
+{
+    assert (set);
+
+    _al_vector_init (&set->inside, sizeof (WORLD_PROXY *));
+    _al_vector_init (&set->current, sizeof (WORLD_PROXY *));
+    _al_vector_init (&set->events, sizeof (TRIGGER_EVENT));
+    set->mask = mask;
+    set->report_stay = report_stay;
+}
+
+/*
+ * Merges the proxies in the collisions with the ones from the last update,
+ * both sorted by address. Returns the number of events.
+ */
+int trigger_update (TRIGGER_SET *set, const AABB_COLLISIONS *collisions)
+{
+    assert (set);
+
+    vector_shrink (&set->events, _al_vector_size (&set->events));
+    collect (set, collisions);
+
+    int num_old = _al_vector_size (&set->inside);
+    int num_new = _al_vector_size (&set->current);
+    int i = 0, j = 0;
+
+    while (i < num_old || j < num_new) {
+        WORLD_PROXY *old = i < num_old ? *(WORLD_PROXY **)_al_vector_ref (&set->inside, i) : NULL;
+        WORLD_PROXY *new = j < num_new ? *(WORLD_PROXY **)_al_vector_ref (&set->current, j) : NULL;
+
+        if (old == new) {
+            if (set->report_stay)
+                push_event (set, TRIGGER_STAY, new);
+            i++;
+            j++;
+        } else if (!new || (old && (uintptr_t)old < (uintptr_t)new)) {
+            push_event (set, TRIGGER_EXIT, old);
+            i++;
+        } else {
+            push_event (set, TRIGGER_ENTER, new);
+            j++;
+        }
+    }
+
+    swap_sets (set);
+    return _al_vector_size (&set->events);
+}
+
+/*
+ * Takes the collisions as the current state without producing events.
+ * Used after teleporting, where the proxies of the old scene are gone and
+ * whatever the actor lands on should not fire. NULL empties the set.
+ */
+void trigger_reset (TRIGGER_SET *set, const AABB_COLLISIONS *collisions)
+{
+    assert (set);
+
+    vector_shrink (&set->events, _al_vector_size (&set->events));
+    collect (set, collisions);
+    swap_sets (set);
+}
+
+TRIGGER_EVENT *trigger_event (TRIGGER_SET *set, int index)
+{
+    assert (set);
+    assert (index >= 0 && index < _al_vector_size (&set->events));
+
+    return _al_vector_ref (&set->events, index);
+}
+
+void trigger_free_set (TRIGGER_SET *set)
+{
+    if (!set)
+        return;
+
+    _al_vector_free (&set->inside);
+    _al_vector_free (&set->current);
+    _al_vector_free (&set->events);
+}
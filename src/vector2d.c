@@ -9,79 +9,39 @@
 
 #include "nostos/utils.h"
 
-VECTOR2D vadd (VECTOR2D v1, VECTOR2D v2)
-{
-    return (VECTOR2D) { .x = v1.x + v2.x, .y = v1.y + v2.y };
-}
-
-VECTOR2D vsub (VECTOR2D v1, VECTOR2D v2)
-{
-    return (VECTOR2D) { .x = v1.x - v2.x, .y = v1.y - v2.y };
-}
-
-VECTOR2D vmul (VECTOR2D v1, VECTOR2D v2)
-{
-    return (VECTOR2D) { .x = v1.x * v2.x, .y = v1.y * v2.y };
-}
-
-VECTOR2D vmulf (VECTOR2D v1, float f)
-{
-    return (VECTOR2D) { .x = v1.x * f, .y = v1.y * f };
-}
-
-VECTOR2D vdiv (VECTOR2D v1, VECTOR2D v2)
-{
-    return (VECTOR2D) { .x = v1.x / v2.x, .y = v1.y / v2.y };
-}
-
-VECTOR2D vdivf (VECTOR2D v1, float f)
-{
-    float m = 1.0f / f;
-    return (VECTOR2D) { .x = v1.x * m, .y = v1.y * m };
-}
-
-float vsqlen (VECTOR2D v)
-{
-    return v.x * v.x + v.y * v.y;
-}
+#if defined(__SSE2__) && !defined(NOSTOS_NO_SIMD)
+#include <emmintrin.h>
+#define VECTOR2D_SSE2
+#endif
 
-float vlen (VECTOR2D v)
-{
-    return (float) sqrt (vsqlen (v));
-}
-
-float vdot (VECTOR2D v1, VECTOR2D v2)
-{
-    return v1.x * v2.x + v1.y * v2.y;
-}
-
-VECTOR2D vnormalize (VECTOR2D v)
-{
-    float len = vlen (v);
-    if (!len) return v;
-
-    float div = 1.0f / len;
-    return (VECTOR2D) { .x = v.x * div, .y = v.y * div };
-}
+/*
+ * Batches work two vectors per SSE register; VECTOR2D is two packed
+ * floats, so an array of them loads as is. Odd counts and builds without
+ * SSE2 take the scalar path, which gives the same results.
+ */
 
-VECTOR2D vabs (VECTOR2D v)
+/*
+ * out[i] += v[i] * (f * steps[i]), the position update for items that
+ * each advance their own number of steps; those with none stay put.
+ */
+void vmuladd_steps_batch (VECTOR2D *out, const VECTOR2D *v, float f, const int *steps, int num)
 {
-    return (VECTOR2D) { .x = fabs (v.x), .y = fabs (v.y) };
-}
+    int i = 0;
 
-float vdistance (VECTOR2D v1, VECTOR2D v2)
-{
-    return vlen (vsub (v1, v2));
-}
+#ifdef VECTOR2D_SSE2
+    for (; i + 2 <= num; i += 2) {
+        float f0 = f * steps[i];
+        float f1 = f * steps[i + 1];
+        __m128 step = _mm_mul_ps (_mm_loadu_ps (&v[i].x), _mm_setr_ps (f0, f0, f1, f1));
+        _mm_storeu_ps (&out[i].x, _mm_add_ps (_mm_loadu_ps (&out[i].x), step));
+    }
+#endif
 
-float vsqdistance (VECTOR2D v1, VECTOR2D v2)
-{
-    return vsqlen (vsub (v1, v2));
+    for (; i < num; i++)
+        out[i] = vadd (out[i], vmulf (v[i], f * steps[i]));
 }
 
 void vdebug (VECTOR2D v)
 {
     debug ("Vector2D x: %f, y: %f", v.x, v.y);
 }
-
-
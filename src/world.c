@@ -0,0 +1,627 @@
+/*
+ * See LICENSE for copyright information.
+ */
+
+/*
+ * Collision world: every object layer of a scene in one place. Each box
+ * gets a proxy holding its category bit and the object it stands for, and
+ * queries take a mask of the categories they care about. Static proxies
+ * (walls, portals, triggers) share one broadphase, proxies that move (NPCs)
+ * go to a tree refitted as they move. Box data in query results points to
+ * the proxy, world_proxy_data gives back the object.
+ *
+ * Dynamic proxies can come and go after the build. They live in a pool
+ * and are named by handle. Adding one inserts it into the tree; removing
+ * one takes it out of every category at once, and the next refit drops
+ * its leaf entry and only then gives its slot back, so no leaf ever points
+ * at a reused one. Neither allocates once the pool and the leaves have
+ * held their peak population. The tree is only rebuilt when the number of
+ * proxies doubles since it was last built, so insertions far from where
+ * it was built do not wear it down for good.
+ *
+ * Polygons and polylines enter the broadphase by their bounds and carry
+ * their SHAPE in the proxy; every query runs the separating axis test on
+ * them before reporting or sweeping, so callers only ever see real hits.
+ */
+
+#include "nostos/world.h"
+#include "nostos/utils.h"
+
+#define MOVE_MARGIN 1.0f
+#define DYNAMIC_POOL_CHUNK 64
+
+typedef struct PENDING {
+    BOX box;
+    unsigned int category;
+    SHAPE *shape;
+} PENDING;
+
+/* The proxy comes first, so leaves point at both. */
+typedef struct DYNAMIC_PROXY {
+    WORLD_PROXY proxy;
+    BOX box;
+} DYNAMIC_PROXY;
+
+typedef struct DYNAMIC_REFIT {
+    POOL *pool;
+    AABB_REFIT_FN refit;
+    void *user;
+} DYNAMIC_REFIT;
+
+typedef struct FILTER {
+    const BOX *box;
+    unsigned int mask;
+    AABB_VISIT_FN visit;
+    void *user;
+    bool stopped;
+} FILTER;
+
+WORLD *world_create ()
+{
+    WORLD *world = al_calloc (1, sizeof (WORLD));
+    _al_vector_init (&world->pending_static, sizeof (PENDING));
+    _al_vector_init (&world->shapes, sizeof (SHAPE *));
+    world->dynamic_proxies = pool_create (sizeof (DYNAMIC_PROXY), DYNAMIC_POOL_CHUNK);
+    return world;
+}
+
+/* Dynamic boxes can be added at any time, static ones only before the build. */
+void world_add_boxes (WORLD *world, const BOX *boxes, int num_boxes, unsigned int category, bool dynamic)
+{
+    assert (world);
+
+    if (dynamic) {
+        for (int i = 0; i < num_boxes; i++)
+            world_add_dynamic (world, boxes[i], category, HANDLE_INVALID);
+        return;
+    }
+
+    assert (!world->proxies);
+
+    for (int i = 0; i < num_boxes; i++) {
+        PENDING *p = _al_vector_alloc_back (&world->pending_static);
+        p->box = boxes[i];
+        p->category = category;
+        p->shape = NULL;
+    }
+}
+
+/* The world takes ownership of the shapes, not of the array. */
+void world_add_shapes (WORLD *world, SHAPE **shapes, int num_shapes, unsigned int category)
+{
+    assert (world);
+    assert (!world->proxies);
+
+    for (int i = 0; i < num_shapes; i++) {
+        PENDING *p = _al_vector_alloc_back (&world->pending_static);
+        p->box = shapes[i]->bounds;
+        p->category = category;
+        p->shape = shapes[i];
+        *(SHAPE **)_al_vector_alloc_back (&world->shapes) = shapes[i];
+    }
+}
+
+int world_add_layer (WORLD *world, TILED_MAP *map, const char *layer_name, unsigned int category)
+{
+    int num_boxes, num_shapes;
+    BOX *boxes = aabb_load_boxes (map, layer_name, &num_boxes);
+    SHAPE **shapes = shape_load (map, layer_name, &num_shapes);
+
+    if (boxes)
+        world_add_boxes (world, boxes, num_boxes, category, false);
+    if (shapes)
+        world_add_shapes (world, shapes, num_shapes, category);
+
+    al_free (boxes);
+    al_free (shapes);
+    return num_boxes + num_shapes;
+}
+
+int world_add_tiles (WORLD *world, TILED_MAP *map, const char *property, unsigned int category)
+{
+    int num_boxes;
+    BOX *boxes = aabb_load_tile_boxes (map, property, &num_boxes);
+
+    if (!boxes)
+        return 0;
+
+    world_add_boxes (world, boxes, num_boxes, category, false);
+    al_free (boxes);
+    return num_boxes;
+}
+
+static BOX *take_pending (VECTOR *pending, WORLD_PROXY *proxies, unsigned int *categories)
+{
+    int size = _al_vector_size (pending);
+    BOX *boxes = al_malloc (size * sizeof (BOX));
+
+    for (int i = 0; i < size; i++) {
+        PENDING *p = _al_vector_ref (pending, i);
+        proxies[i] = (WORLD_PROXY){p->category, p->box.data, p->shape, HANDLE_INVALID};
+        boxes[i] = p->box;
+        boxes[i].data = &proxies[i];
+        *categories |= p->category;
+    }
+
+    _al_vector_free (pending);
+    return boxes;
+}
+
+/*
+ * Frees the old tree, which lets go of the removed proxies, and builds a
+ * new one over the rest. With refit given each box is brought up to date
+ * first; without, the boxes must not have moved since they were added.
+ */
+static void build_dynamics (WORLD *world, JOBS *jobs, AABB_REFIT_FN refit, void *user)
+{
+    POOL *pool = world->dynamic_proxies;
+
+    aabb_free (world->dynamics);
+    world->dynamics = NULL;
+    world->dynamics_dirty = false;
+    world->num_removed = 0;
+    world->num_built = 0;
+
+    for (int i = 0; i < pool_capacity (pool); i++) {
+        DYNAMIC_PROXY *dynamic = pool_at (pool, i);
+        if (dynamic && !dynamic->proxy.category)
+            pool_release (pool, dynamic);
+    }
+
+    if (pool->num_items == 0)
+        return;
+
+    BOX *boxes = al_malloc (pool->num_items * sizeof (BOX));
+
+    for (int i = 0; i < pool_capacity (pool); i++) {
+        DYNAMIC_PROXY *dynamic = pool_at (pool, i);
+        if (!dynamic)
+            continue;
+
+        if (refit)
+            refit (&dynamic->box, user);
+        boxes[world->num_built++] = dynamic->box;
+    }
+
+    world->dynamics = aabb_build_tree_auto (jobs, boxes, world->num_built);
+    al_free (boxes);
+}
+
+/*
+ * Adds a dynamic proxy for box, whose data becomes the proxy's. handle is
+ * kept for whoever owns the object, to look it up from query results.
+ * Returns the proxy's own handle, for world_remove_dynamic.
+ */
+int world_add_dynamic (WORLD *world, BOX box, unsigned int category, int handle)
+{
+    assert (world);
+    assert (category);
+
+    POOL *pool = world->dynamic_proxies;
+    int proxy;
+    DYNAMIC_PROXY *dynamic = pool_alloc (pool, &proxy);
+    dynamic->proxy = (WORLD_PROXY){category, box.data, NULL, handle};
+    dynamic->box = box;
+    dynamic->box.data = &dynamic->proxy;
+    world->dynamic_categories |= category;
+
+    /* Before the build everything goes in at once */
+    if (world->dynamics) {
+        aabb_insert (world->dynamics, dynamic->box);
+        if (pool->num_items > 2 * world->num_built)
+            world->dynamics_dirty = true;
+    } else if (world->proxies) {
+        build_dynamics (world, NULL, NULL, NULL);
+    }
+
+    return proxy;
+}
+
+/* Does nothing for a proxy already removed. */
+void world_remove_dynamic (WORLD *world, int proxy)
+{
+    assert (world);
+
+    DYNAMIC_PROXY *dynamic = pool_get (world->dynamic_proxies, proxy);
+    if (!dynamic || !dynamic->proxy.category)
+        return;
+
+    dynamic->proxy.category = 0;
+    world->num_removed++;
+}
+
+/* Drops removed proxies from their leaf, passes the rest on to refit. */
+static void refit_dynamic (BOX *box, void *user)
+{
+    DYNAMIC_REFIT *dynamic_refit = user;
+    DYNAMIC_PROXY *dynamic = (DYNAMIC_PROXY *)world_proxy (box);
+
+    if (!dynamic->proxy.category) {
+        pool_release (dynamic_refit->pool, dynamic);
+        box->data = NULL;
+        return;
+    }
+
+    dynamic_refit->refit (box, dynamic_refit->user);
+    dynamic->box = *box;
+}
+
+/* Turns everything added so far into the query structures. */
+void world_build (WORLD *world, JOBS *jobs)
+{
+    assert (world);
+    assert (!world->proxies);
+
+    int num_static = _al_vector_size (&world->pending_static);
+
+    world->num_proxies = num_static;
+    world->proxies = al_malloc (MAX (world->num_proxies, 1) * sizeof (WORLD_PROXY));
+
+    BOX *boxes = take_pending (&world->pending_static, world->proxies, &world->static_categories);
+    if (num_static > 0)
+        world->statics = broadphase_build (jobs, boxes, num_static);
+    al_free (boxes);
+
+    build_dynamics (world, jobs, NULL, NULL);
+
+    debug ("World: %d static and %d dynamic proxies", num_static, world->dynamic_proxies->num_items);
+}
+
+/*
+ * Brings the dynamic boxes up to date through refit, which is only called
+ * for proxies that were not removed, and drops the removed ones. Once the
+ * proxies have doubled since the last build the tree is rebuilt instead.
+ */
+void world_refit (WORLD *world, AABB_REFIT_FN refit, void *user)
+{
+    assert (world);
+    assert (refit);
+
+    if (world->dynamics_dirty) {
+        build_dynamics (world, NULL, refit, user);
+    } else if (world->dynamics) {
+        DYNAMIC_REFIT dynamic_refit = {world->dynamic_proxies, refit, user};
+        aabb_refit (world->dynamics, refit_dynamic, &dynamic_refit);
+        world->num_removed = 0;
+    }
+}
+
+static bool filter_visit (BOX *box, void *user)
+{
+    FILTER *filter = user;
+
+    WORLD_PROXY *proxy = world_proxy (box);
+
+    if (!(proxy->category & filter->mask))
+        return true;
+
+    if (proxy->shape && !shape_overlap (proxy->shape, *filter->box, NULL))
+        return true;
+
+    if (!filter->visit (box, filter->user)) {
+        filter->stopped = true;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Calls visit for every proxy in mask overlapping the box, statics first.
+ * The cache in collisions, when given, only serves the static broadphase.
+ */
+void world_query_visit (const WORLD *world, const BOX *box, unsigned int mask, AABB_COLLISIONS *collisions,
+                        AABB_VISIT_FN visit, void *user)
+{
+    assert (world);
+    assert (box);
+    assert (visit);
+
+    FILTER filter = {box, mask, visit, user, false};
+
+    if (world->statics && (world->static_categories & mask)) {
+        if (collisions)
+            broadphase_query_visit_with_cache (world->statics, box, collisions, filter_visit, &filter);
+        else
+            broadphase_query_visit (world->statics, box, filter_visit, &filter);
+    }
+
+    if (!filter.stopped && world->dynamics && (world->dynamic_categories & mask))
+        aabb_query_visit (world->dynamics, box, filter_visit, &filter);
+}
+
+static bool fill_visit (BOX *box, void *user)
+{
+    AABB_COLLISIONS *collisions = user;
+    collisions->num_collisions++;
+    *(BOX **)_al_vector_alloc_back (&collisions->boxes) = box;
+    return true;
+}
+
+int world_collide_fill (const WORLD *world, const BOX *box, unsigned int mask, AABB_COLLISIONS *collisions)
+{
+    assert (collisions);
+
+    aabb_clear_collisions (collisions);
+    world_query_visit (world, box, mask, collisions, fill_visit, collisions);
+    return collisions->num_collisions;
+}
+
+typedef struct SWEEP_QUERY {
+    BOX box;
+    VECTOR2D delta;
+    BOX_HIT *best;
+} SWEEP_QUERY;
+
+static inline bool proxy_sweep (BOX b, VECTOR2D delta, const BOX *box, BOX_HIT *hit)
+{
+    const SHAPE *shape = world_proxy (box)->shape;
+    return shape ? shape_sweep (b, delta, shape, hit) : box_sweep (b, delta, *box, hit);
+}
+
+static void sweep_test (SWEEP_QUERY *query, BOX *box)
+{
+    BOX_HIT hit;
+
+    if (proxy_sweep (query->box, query->delta, box, &hit)) {
+        BOX_HIT *best = query->best;
+        if (!best->box || hit.time < best->time ||
+            (hit.time == best->time && hit.penetration > best->penetration)) {
+            *best = hit;
+            best->box = box;
+        }
+    }
+}
+
+static bool sweep_visit (BOX *box, void *user)
+{
+    sweep_test (user, box);
+    return true;
+}
+
+bool world_sweep (const WORLD *world, const BOX *box, VECTOR2D delta, unsigned int mask, BOX_HIT *hit)
+{
+    assert (world);
+    assert (box);
+    assert (hit);
+
+    BOX end = *box;
+    end.center = vadd (end.center, delta);
+    BOX bounds = box_merge (*box, end);
+    SWEEP_QUERY query = {*box, delta, hit};
+
+    hit->box = NULL;
+    world_query_visit (world, &bounds, mask, NULL, sweep_visit, &query);
+    return hit->box != NULL;
+}
+
+typedef struct MOVE_QUERY {
+    const WORLD *world;
+    unsigned int mask;
+    AABB_COLLISIONS *collisions;
+    BOX reach;
+} MOVE_QUERY;
+
+static void gather (MOVE_QUERY *move, const BOX *box, VECTOR2D delta)
+{
+    BOX end = *box;
+    end.center = vadd (end.center, delta);
+    move->reach = box_merge (*box, end);
+    move->reach.extent = vadd (move->reach.extent, (VECTOR2D){MOVE_MARGIN, MOVE_MARGIN});
+    world_collide_fill (move->world, &move->reach, move->mask, move->collisions);
+}
+
+static bool gathered_sweep (const BOX *box, VECTOR2D delta, BOX_HIT *hit, void *user)
+{
+    MOVE_QUERY *move = user;
+    SWEEP_QUERY query = {*box, delta, hit};
+
+    BOX end = *box;
+    end.center = vadd (end.center, delta);
+    if (!box_inside_box (box_merge (*box, end), move->reach))
+        gather (move, box, delta);
+
+    hit->box = NULL;
+    for (int i = 0; i < _al_vector_size (&move->collisions->boxes); i++) {
+        BOX *candidate = *(BOX **)_al_vector_ref (&move->collisions->boxes, i);
+        if (world_proxy (candidate)->category & WORLD_SOLID)
+            sweep_test (&query, candidate);
+    }
+
+    return hit->box != NULL;
+}
+
+/*
+ * Moves an actor box with a single traversal: everything in mask the box
+ * can reach this step is gathered once, the move slides against the solid
+ * proxies among them, and collisions is left holding the non-solid ones
+ * overlapping the box where it ends up (portals, triggers...). Only a box
+ * pushed out of a wall far enough to leave the gathered area queries again.
+ */
+VECTOR2D world_move (const WORLD *world, const BOX *box, VECTOR2D delta, unsigned int mask,
+                     AABB_COLLISIONS *collisions, VECTOR2D *blocked)
+{
+    assert (world);
+    assert (box);
+    assert (collisions);
+
+    MOVE_QUERY move = {world, mask, collisions};
+    gather (&move, box, delta);
+
+    VECTOR2D moved = box_slide (*box, delta, gathered_sweep, &move, blocked);
+    BOX end = *box;
+    end.center = vadd (box->center, moved);
+
+    if (!box_inside_box (end, move.reach))
+        gather (&move, &end, (VECTOR2D){0, 0});
+
+    int size = _al_vector_size (&collisions->boxes);
+    int kept = 0;
+    for (int i = 0; i < size; i++) {
+        BOX *candidate = *(BOX **)_al_vector_ref (&collisions->boxes, i);
+        WORLD_PROXY *proxy = world_proxy (candidate);
+        if (proxy->category & WORLD_SOLID)
+            continue;
+
+        if (proxy->shape ? shape_overlap (proxy->shape, end, NULL) : box_overlap (end, *candidate))
+            *(BOX **)_al_vector_ref (&collisions->boxes, kept++) = candidate;
+    }
+    vector_shrink (&collisions->boxes, size - kept);
+    collisions->num_collisions = kept;
+
+    return moved;
+}
+
+typedef struct SIGHT_QUERY {
+    BOX origin;
+    VECTOR2D delta;
+    unsigned int mask;
+    bool blocked;
+} SIGHT_QUERY;
+
+static bool blocks_sight (BOX *box, void *user)
+{
+    SIGHT_QUERY *query = user;
+    BOX_HIT hit;
+
+    if (!(world_proxy (box)->category & query->mask))
+        return true;
+
+    if (proxy_sweep (query->origin, query->delta, box, &hit)) {
+        query->blocked = true;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Only visits proxies whose boxes the segment crosses: the tree prunes
+ * nodes along the segment and the grid walks the cells under it, so long
+ * diagonal checks do not pay for everything in their bounding box.
+ */
+bool world_line_of_sight (const WORLD *world, VECTOR2D from, VECTOR2D to, unsigned int mask)
+{
+    assert (world);
+
+    SIGHT_QUERY query = {{from, {0, 0}, NULL}, vsub (to, from), mask, false};
+
+    if (world->statics && (world->static_categories & mask))
+        broadphase_query_segment (world->statics, from, to, blocks_sight, &query);
+
+    if (!query.blocked && world->dynamics && (world->dynamic_categories & mask))
+        aabb_query_segment (world->dynamics, from, to, blocks_sight, &query);
+
+    return !query.blocked;
+}
+
+/*
+ * Nearest dynamic proxies in mask, nearest first. The search itself does
+ * not filter, so fewer than k come back when other dynamic categories, or
+ * proxies removed since the last refit, are closer.
+ */
+int world_query_nearest (const WORLD *world, VECTOR2D point, int k, float max_distance, unsigned int mask,
+                         AABB_COLLISIONS *collisions)
+{
+    assert (world);
+    assert (collisions);
+
+    if (!world->dynamics || !(world->dynamic_categories & mask)) {
+        aabb_clear_collisions (collisions);
+        return 0;
+    }
+
+    aabb_query_nearest (world->dynamics, point, k, max_distance, collisions);
+
+    if (!world->num_removed && (world->dynamic_categories & mask) == world->dynamic_categories)
+        return collisions->num_collisions;
+
+    int size = _al_vector_size (&collisions->boxes);
+    int kept = 0;
+    for (int i = 0; i < size; i++) {
+        BOX *box = *(BOX **)_al_vector_ref (&collisions->boxes, i);
+        if (world_proxy (box)->category & mask)
+            *(BOX **)_al_vector_ref (&collisions->boxes, kept++) = box;
+    }
+    vector_shrink (&collisions->boxes, size - kept);
+    collisions->num_collisions = kept;
+
+    return kept;
+}
+
+void world_free (WORLD *world)
+{
+    if (!world)
+        return;
+
+    _al_vector_free (&world->pending_static);
+
+    for (int i = 0; i < _al_vector_size (&world->shapes); i++)
+        shape_free (*(SHAPE **)_al_vector_ref (&world->shapes, i));
+    _al_vector_free (&world->shapes);
+
+    broadphase_free (world->statics);
+    aabb_free (world->dynamics);
+    pool_free (world->dynamic_proxies);
+    al_free (world->proxies);
+    al_free (world);
+}
+
+WORLD_PROXY *world_proxy (const BOX *box)
+{
+    return box->data;
+}
+
+void *world_proxy_data (const BOX *box)
+{
+    return world_proxy (box)->data;
+}
+
+/* The owner's handle given to world_add_dynamic, HANDLE_INVALID for the rest. */
+int world_proxy_handle (const BOX *box)
+{
+    return world_proxy (box)->handle;
+}
+
+static bool draw_visit (BOX *box, void *user)
+{
+    DEBUG_DRAW *dd = user;
+    WORLD_PROXY *proxy = world_proxy (box);
+    int category = proxy->category & (WORLD_PORTAL | WORLD_TRIGGER) ? DEBUG_DRAW_TRIGGERS : DEBUG_DRAW_LEAVES;
+
+    if (proxy->shape) {
+        if (debug_draw_enabled (dd, DEBUG_DRAW_SHAPES))
+            shape_debug_draw (proxy->shape, dd, dd->colors[DEBUG_DRAW_SHAPES]);
+        if (category == DEBUG_DRAW_LEAVES)
+            return true;
+    }
+
+    if (debug_draw_enabled (dd, category))
+        debug_draw_box (dd, *box, dd->colors[category]);
+
+    return true;
+}
+
+/*
+ * Tree levels of both structures, then every proxy in the view: walls and
+ * NPCs as leaves, portals and triggers in their own color, shapes as their
+ * outline.
+ */
+void world_debug_draw (const WORLD *world, DEBUG_DRAW *dd)
+{
+    assert (world);
+    assert (dd);
+
+    if (world->statics)
+        broadphase_debug_draw (world->statics, dd);
+    if (world->dynamics)
+        aabb_debug_draw (world->dynamics, dd);
+
+    if (debug_draw_enabled (dd, DEBUG_DRAW_LEAVES) || debug_draw_enabled (dd, DEBUG_DRAW_TRIGGERS) ||
+        debug_draw_enabled (dd, DEBUG_DRAW_SHAPES)) {
+        if (world->statics)
+            broadphase_query_visit (world->statics, &dd->view, draw_visit, dd);
+        if (world->dynamics)
+            aabb_query_visit (world->dynamics, &dd->view, draw_visit, dd);
+    }
+}
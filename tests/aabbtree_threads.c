@@ -0,0 +1,174 @@
+/*
+ * Runs the same queries against one AABB tree from several threads at
+ * once, each with its own AABB_COLLISIONS, and checks every thread gets
+ * what a serial run got. Covers both builders, the LBVH one also built
+ * over jobs, and the query cache.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <nostos/aabbtree.h>
+
+#define NUM_BOXES 40000
+#define NUM_QUERIES 20000
+#define NUM_THREADS 8
+#define AREA 4000
+
+typedef struct RESULT {
+    int count;
+    intptr_t sum;
+} RESULT;
+
+typedef struct WORKER {
+    const AABB_TREE *tree;
+    const BOX *queries;
+    RESULT *fill;
+    RESULT *visit;
+    int first;
+} WORKER;
+
+static unsigned int next_random (unsigned int *state)
+{
+    *state = *state * 1103515245u + 12345u;
+    return (*state >> 16) & 0x7fff;
+}
+
+static bool add_hit (BOX *box, void *user)
+{
+    RESULT *result = user;
+    result->count++;
+    result->sum += (intptr_t)box->data;
+    return true;
+}
+
+static void run_query (const AABB_TREE *tree, const BOX *query, AABB_COLLISIONS *collisions,
+                       RESULT *fill, RESULT *visit)
+{
+    aabb_collide_fill_cache (tree, query, collisions);
+    fill->count = collisions->num_collisions;
+    fill->sum = 0;
+    for (int i = 0; i < collisions->num_collisions; i++) {
+        BOX *box = *(BOX **)_al_vector_ref (&collisions->boxes, i);
+        fill->sum += (intptr_t)box->data;
+    }
+
+    *visit = (RESULT){0, 0};
+    aabb_query_visit (tree, query, add_hit, visit);
+}
+
+/*
+ * Each thread starts at a different query so neighbouring threads are not
+ * walking the same nodes in lockstep.
+ */
+static void *worker_run (ALLEGRO_THREAD *thread, void *arg)
+{
+    WORKER *worker = arg;
+    AABB_COLLISIONS collisions;
+    aabb_init_collisions (&collisions);
+
+    for (int n = 0; n < NUM_QUERIES; n++) {
+        int i = (worker->first + n) % NUM_QUERIES;
+        run_query (worker->tree, &worker->queries[i], &collisions, &worker->fill[i], &worker->visit[i]);
+    }
+
+    aabb_free_collisions (&collisions);
+    return NULL;
+}
+
+static int check_tree (const char *name, const AABB_TREE *tree, const BOX *queries)
+{
+    RESULT *expected = al_malloc (NUM_QUERIES * sizeof (RESULT));
+    RESULT *unused = al_malloc (NUM_QUERIES * sizeof (RESULT));
+    AABB_COLLISIONS collisions;
+
+    aabb_init_collisions (&collisions);
+    for (int i = 0; i < NUM_QUERIES; i++) {
+        run_query (tree, &queries[i], &collisions, &expected[i], &unused[i]);
+        if (expected[i].count != unused[i].count || expected[i].sum != unused[i].sum) {
+            printf ("%s: query %d: fill and visit disagree\n", name, i);
+            return 1;
+        }
+    }
+    aabb_free_collisions (&collisions);
+    al_free (unused);
+
+    WORKER workers[NUM_THREADS];
+    ALLEGRO_THREAD *threads[NUM_THREADS];
+    for (int t = 0; t < NUM_THREADS; t++) {
+        workers[t].tree = tree;
+        workers[t].queries = queries;
+        workers[t].fill = al_malloc (NUM_QUERIES * sizeof (RESULT));
+        workers[t].visit = al_malloc (NUM_QUERIES * sizeof (RESULT));
+        workers[t].first = t * (NUM_QUERIES / NUM_THREADS);
+        threads[t] = al_create_thread (worker_run, &workers[t]);
+    }
+    for (int t = 0; t < NUM_THREADS; t++)
+        al_start_thread (threads[t]);
+    for (int t = 0; t < NUM_THREADS; t++) {
+        al_join_thread (threads[t], NULL);
+        al_destroy_thread (threads[t]);
+    }
+
+    int failures = 0;
+    for (int t = 0; t < NUM_THREADS; t++) {
+        for (int i = 0; i < NUM_QUERIES; i++) {
+            const RESULT *fill = &workers[t].fill[i];
+            const RESULT *visit = &workers[t].visit[i];
+            if (fill->count != expected[i].count || fill->sum != expected[i].sum ||
+                visit->count != expected[i].count || visit->sum != expected[i].sum) {
+                if (failures++ < 10)
+                    printf ("%s: thread %d query %d: %d hits, serial run %d\n",
+                            name, t, i, fill->count, expected[i].count);
+            }
+        }
+        al_free (workers[t].fill);
+        al_free (workers[t].visit);
+    }
+
+    al_free (expected);
+    printf ("%s: %d threads x %d queries, %d mismatches\n", name, NUM_THREADS, NUM_QUERIES, failures);
+    return failures ? 1 : 0;
+}
+
+int main (int argc, char **argv)
+{
+    if (!al_init ()) {
+        printf ("Could not initialize allegro\n");
+        return 1;
+    }
+
+    unsigned int state = 1;
+    BOX *boxes = al_malloc (NUM_BOXES * sizeof (BOX));
+    for (int i = 0; i < NUM_BOXES; i++) {
+        boxes[i].center = (VECTOR2D){next_random (&state) % AREA, next_random (&state) % AREA};
+        boxes[i].extent = (VECTOR2D){4 + next_random (&state) % 28, 4 + next_random (&state) % 28};
+        boxes[i].data = (void *)(intptr_t)(i + 1);
+    }
+
+    BOX *queries = al_malloc (NUM_QUERIES * sizeof (BOX));
+    for (int i = 0; i < NUM_QUERIES; i++) {
+        queries[i].center = (VECTOR2D){next_random (&state) % AREA, next_random (&state) % AREA};
+        queries[i].extent = (VECTOR2D){8 + next_random (&state) % 56, 8 + next_random (&state) % 56};
+        queries[i].data = NULL;
+    }
+
+    int failed = 0;
+
+    AABB_TREE *tree = aabb_build_tree (boxes, NUM_BOXES, 12);
+    failed |= check_tree ("median split", tree, queries);
+    aabb_free (tree);
+
+    tree = aabb_build_tree_lbvh (NULL, boxes, NUM_BOXES, 4);
+    failed |= check_tree ("lbvh", tree, queries);
+    aabb_free (tree);
+
+    JOBS *jobs = jobs_create (4);
+    tree = aabb_build_tree_lbvh (jobs, boxes, NUM_BOXES, 4);
+    failed |= check_tree ("lbvh over jobs", tree, queries);
+    aabb_free (tree);
+    jobs_free (jobs);
+
+    al_free (queries);
+    al_free (boxes);
+    return failed;
+}
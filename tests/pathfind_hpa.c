@@ -0,0 +1,339 @@
+/*
+ * Checks routes planned through the cluster graph on random maps cut up
+ * by long walls, some with gaps and some without. For requests far enough
+ * apart to go through the clusters, a route must come back exactly when
+ * a plain Dijkstra over the grid finds one, as a corridor of entrances.
+ * Walking it with path_next, refining leg by leg, must reach the target
+ * in clear straight or diagonal steps. The walked routes must be within a
+ * few percent of the cheapest on average, and no single one far off it.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <nostos/pathfind.h>
+
+#define TILE 16
+#define MIN_SIZE 60
+#define MAX_SIZE 200
+#define NUM_MAPS 12
+#define NUM_REQUESTS 40
+#define BUDGET 512
+#define MAX_UPDATES 200000
+
+/* What walked routes may cost over the cheapest, on average and at worst */
+#define MAX_MEAN_RATIO 1.05
+#define MAX_RATIO 1.30
+
+typedef struct HEAP_ENTRY {
+    float cost;
+    int cell;
+} HEAP_ENTRY;
+
+typedef struct WALKER {
+    PATH path;
+    int start;
+    int goal;
+    VECTOR2D position;
+    float walked;
+    bool done;
+    bool failed;
+} WALKER;
+
+static int width, height;
+static bool blocked[MAX_SIZE * MAX_SIZE];
+static float cost[MAX_SIZE * MAX_SIZE];
+static HEAP_ENTRY heap[8 * MAX_SIZE * MAX_SIZE];
+
+static unsigned int next_random (unsigned int *state)
+{
+    *state = *state * 1103515245u + 12345u;
+    return (*state >> 16) & 0x7fff;
+}
+
+static inline bool walkable (int x, int y)
+{
+    return x >= 0 && y >= 0 && x < width && y < height && !blocked[y * width + x];
+}
+
+static void heap_push (int *size, float c, int cell)
+{
+    int i = (*size)++;
+    while (i > 0 && heap[(i - 1) / 2].cost > c) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = (HEAP_ENTRY){c, cell};
+}
+
+static HEAP_ENTRY heap_pop (int *size)
+{
+    HEAP_ENTRY top = heap[0], last = heap[--(*size)];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= *size)
+            break;
+        if (child + 1 < *size && heap[child + 1].cost < heap[child].cost)
+            child++;
+        if (last.cost <= heap[child].cost)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+/* Cheapest cost from start to every cell, diagonals not cutting corners. */
+static void dijkstra (int start)
+{
+    int size = 0;
+
+    for (int i = 0; i < width * height; i++)
+        cost[i] = INFINITY;
+
+    cost[start] = 0;
+    heap_push (&size, 0, start);
+
+    while (size > 0) {
+        HEAP_ENTRY entry = heap_pop (&size);
+        int cell = entry.cell;
+        if (entry.cost > cost[cell])
+            continue;
+
+        int x = cell % width, y = cell / width;
+
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                if ((!dx && !dy) || !walkable (x + dx, y + dy))
+                    continue;
+                if (dx && dy && (!walkable (x + dx, y) || !walkable (x, y + dy)))
+                    continue;
+
+                int next = (y + dy) * width + x + dx;
+                float c = cost[cell] + (dx && dy ? 1.41421356f : 1.0f);
+                if (c < cost[next]) {
+                    cost[next] = c;
+                    heap_push (&size, c, next);
+                }
+            }
+        }
+    }
+}
+
+static void make_map (unsigned int *state)
+{
+    width = MIN_SIZE + next_random (state) % (MAX_SIZE - MIN_SIZE + 1);
+    height = MIN_SIZE + next_random (state) % (MAX_SIZE - MIN_SIZE + 1);
+    int density = next_random (state) % 20;
+
+    for (int i = 0; i < width * height; i++)
+        blocked[i] = next_random (state) % 100 < density;
+
+    /* Walls with one cell in eight open, and a few with none */
+    for (int k = 0; k < width / 30; k++) {
+        int x = next_random (state) % width;
+        bool sealed = next_random (state) % 6 == 0;
+        for (int y = 0; y < height; y++)
+            blocked[y * width + x] |= sealed || next_random (state) % 8 != 0;
+    }
+    for (int k = 0; k < height / 30; k++) {
+        int y = next_random (state) % height;
+        bool sealed = next_random (state) % 6 == 0;
+        for (int x = 0; x < width; x++)
+            blocked[y * width + x] |= sealed || next_random (state) % 8 != 0;
+    }
+}
+
+static PATHFINDER *make_pathfinder (WORLD **world)
+{
+    static BOX boxes[MAX_SIZE * MAX_SIZE];
+    int num_boxes = 0;
+
+    *world = world_create ();
+    for (int i = 0; i < width * height; i++) {
+        if (blocked[i])
+            boxes[num_boxes++] = (BOX){{(i % width + 0.5f) * TILE, (i / width + 0.5f) * TILE}, {TILE / 2, TILE / 2}, NULL};
+    }
+    if (num_boxes)
+        world_add_boxes (*world, boxes, num_boxes, WORLD_SOLID, false);
+    world_build (*world, NULL);
+
+    TILED_MAP map = {0};
+    map.width = width;
+    map.height = height;
+    map.tile_width = TILE;
+    map.tile_height = TILE;
+    return path_create (*world, &map, WORLD_SOLID);
+}
+
+static int random_open_cell (unsigned int *state)
+{
+    int cell;
+    do {
+        cell = (next_random (state) << 15 | next_random (state)) % (width * height);
+    } while (blocked[cell]);
+    return cell;
+}
+
+static inline VECTOR2D cell_center (int cell)
+{
+    return (VECTOR2D){(cell % width + 0.5f) * TILE, (cell / width + 0.5f) * TILE};
+}
+
+/* Same test the pathfinder makes for sending a request through the clusters. */
+static bool far_apart (const PATHFINDER *paths, int a, int b)
+{
+    int size = paths->cluster_size;
+    int ax = a % width, ay = a / width, bx = b % width, by = b / width;
+    int dx = abs (ax - bx), dy = abs (ay - by);
+    float octile = dx + dy + (1.41421356f - 2) * (dx < dy ? dx : dy);
+    return (ax / size != bx / size || ay / size != by / size) && octile > 2 * size;
+}
+
+/* Moves the walker to waypoint cell by cell, false if a step is not allowed. */
+static bool step_to (WALKER *walker, VECTOR2D waypoint)
+{
+    int x = (int)(walker->position.x / TILE), y = (int)(walker->position.y / TILE);
+    int tx = (int)(waypoint.x / TILE), ty = (int)(waypoint.y / TILE);
+    int dx = (tx > x) - (tx < x), dy = (ty > y) - (ty < y);
+
+    if (dx && dy && abs (tx - x) != abs (ty - y))
+        return false;
+
+    while (x != tx || y != ty) {
+        if (dx && dy && (!walkable (x + dx, y) || !walkable (x, y + dy)))
+            return false;
+        x += dx;
+        y += dy;
+        if (!walkable (x, y))
+            return false;
+        walker->walked += dx && dy ? 1.41421356f : 1.0f;
+    }
+
+    walker->position = waypoint;
+    return true;
+}
+
+static bool arrived (const WALKER *walker)
+{
+    const PATH *path = &walker->path;
+    VECTOR2D target = cell_center (walker->goal);
+
+    return path->status == PATH_FOUND && !path->refining &&
+           path->leg >= (int)_al_vector_size (&path->corridor) - 1 &&
+           walker->position.x == target.x && walker->position.y == target.y;
+}
+
+int main (int argc, char **argv)
+{
+    static WALKER walkers[NUM_REQUESTS];
+    unsigned int state = 11;
+    int failures = 0, num_far = 0, num_found = 0;
+    double sum_ratio = 0, worst_ratio = 1;
+
+    for (int m = 0; m < NUM_MAPS; m++) {
+        make_map (&state);
+
+        WORLD *world;
+        PATHFINDER *paths = make_pathfinder (&world);
+
+        for (int k = 0; k < NUM_REQUESTS; k++) {
+            WALKER *walker = &walkers[k];
+            do {
+                walker->start = random_open_cell (&state);
+                walker->goal = random_open_cell (&state);
+            } while (!far_apart (paths, walker->start, walker->goal));
+
+            walker->position = cell_center (walker->start);
+            walker->walked = 0;
+            walker->done = walker->failed = false;
+            path_init (&walker->path, k);
+            path_request (paths, &walker->path, walker->position, cell_center (walker->goal));
+        }
+
+        int active = NUM_REQUESTS;
+        for (int i = 0; i < MAX_UPDATES && active; i++) {
+            path_update (paths, BUDGET);
+
+            for (int k = 0; k < NUM_REQUESTS; k++) {
+                WALKER *walker = &walkers[k];
+                VECTOR2D waypoint;
+
+                if (walker->done)
+                    continue;
+
+                if (walker->path.status == PATH_FAILED) {
+                    walker->done = walker->failed = true;
+                    active--;
+                    continue;
+                }
+
+                if (!path_next (paths, &walker->path, walker->position, 1.0f, &waypoint))
+                    continue;
+
+                if (!step_to (walker, waypoint)) {
+                    if (failures++ < 10)
+                        printf ("map %d request %d: refined route is not walkable\n", m, k);
+                    walker->done = walker->failed = true;
+                    active--;
+                } else if (arrived (walker)) {
+                    walker->done = true;
+                    active--;
+                }
+            }
+        }
+
+        if (active) {
+            printf ("map %d: %d routes never reached their target\n", m, active);
+            failures++;
+        }
+
+        for (int k = 0; k < NUM_REQUESTS; k++) {
+            WALKER *walker = &walkers[k];
+            float cheapest;
+
+            dijkstra (walker->start);
+            cheapest = cost[walker->goal];
+            num_far++;
+
+            if (walker->failed != (cheapest == INFINITY) && failures++ < 10)
+                printf ("map %d request %d: route %s, grid route %s\n", m, k,
+                        walker->failed ? "missing" : "found", cheapest == INFINITY ? "missing" : "found");
+
+            if (!walker->failed && _al_vector_size (&walker->path.corridor) == 0 && failures++ < 10)
+                printf ("map %d request %d: long route came back without a corridor\n", m, k);
+
+            if (walker->done && !walker->failed && cheapest < INFINITY) {
+                double ratio = walker->walked / cheapest;
+                num_found++;
+                sum_ratio += ratio;
+                worst_ratio = ratio > worst_ratio ? ratio : worst_ratio;
+
+                if ((ratio > MAX_RATIO || ratio < 0.999) && failures++ < 10)
+                    printf ("map %d request %d: walked %f, cheapest %f\n", m, k, walker->walked, cheapest);
+            }
+
+            path_clear (&walker->path);
+        }
+
+        path_free (paths);
+        world_free (world);
+    }
+
+    double mean_ratio = num_found ? sum_ratio / num_found : 1;
+    if (mean_ratio > MAX_MEAN_RATIO) {
+        printf ("walked routes cost %.3f times the cheapest on average\n", mean_ratio);
+        failures++;
+    }
+
+    if (num_found < num_far / 5) {
+        printf ("only %d of %d routes found, the maps are too closed\n", num_found, num_far);
+        failures++;
+    }
+
+    printf ("%d long routes, %d found, mean ratio %.3f, worst %.3f, %d failures\n",
+            num_far, num_found, mean_ratio, worst_ratio, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,304 @@
+/*
+ * Checks the jump point searches against a plain Dijkstra over the eight
+ * connected grid, on random maps. Every route found must run through open
+ * cells in straight or diagonal segments without cutting corners, cost
+ * what the cheapest route does and end on the target; no route may be
+ * missed. Asking again must come out of the cache with the same points,
+ * and a second pathfinder served one unit of work per call, so that every
+ * search is cut short and resumed, must hand back the same points too.
+ * Routes long enough to go through the clusters are left to the HPA* test.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <nostos/pathfind.h>
+
+#define TILE 16
+#define MAX_SIZE 40
+#define NUM_MAPS 150
+#define NUM_REQUESTS 24
+#define MAX_UPDATES 1000000
+
+typedef struct HEAP_ENTRY {
+    float cost;
+    int cell;
+} HEAP_ENTRY;
+
+static int width, height;
+static bool blocked[MAX_SIZE * MAX_SIZE];
+static float cost[MAX_SIZE * MAX_SIZE];
+static HEAP_ENTRY heap[8 * MAX_SIZE * MAX_SIZE];
+
+static unsigned int next_random (unsigned int *state)
+{
+    *state = *state * 1103515245u + 12345u;
+    return (*state >> 16) & 0x7fff;
+}
+
+static inline bool walkable (int x, int y)
+{
+    return x >= 0 && y >= 0 && x < width && y < height && !blocked[y * width + x];
+}
+
+static void heap_push (int *size, float c, int cell)
+{
+    int i = (*size)++;
+    while (i > 0 && heap[(i - 1) / 2].cost > c) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = (HEAP_ENTRY){c, cell};
+}
+
+static HEAP_ENTRY heap_pop (int *size)
+{
+    HEAP_ENTRY top = heap[0], last = heap[--(*size)];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= *size)
+            break;
+        if (child + 1 < *size && heap[child + 1].cost < heap[child].cost)
+            child++;
+        if (last.cost <= heap[child].cost)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+/* Cheapest cost from start to every cell, diagonals not cutting corners. */
+static void dijkstra (int start)
+{
+    int size = 0;
+
+    for (int i = 0; i < width * height; i++)
+        cost[i] = INFINITY;
+    if (blocked[start])
+        return;
+
+    cost[start] = 0;
+    heap_push (&size, 0, start);
+
+    while (size > 0) {
+        HEAP_ENTRY entry = heap_pop (&size);
+        int cell = entry.cell;
+        if (entry.cost > cost[cell])
+            continue;
+
+        int x = cell % width, y = cell / width;
+
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                if ((!dx && !dy) || !walkable (x + dx, y + dy))
+                    continue;
+                if (dx && dy && (!walkable (x + dx, y) || !walkable (x, y + dy)))
+                    continue;
+
+                int next = (y + dy) * width + x + dx;
+                float c = cost[cell] + (dx && dy ? 1.41421356f : 1.0f);
+                if (c < cost[next]) {
+                    cost[next] = c;
+                    heap_push (&size, c, next);
+                }
+            }
+        }
+    }
+}
+
+static void make_map (unsigned int *state)
+{
+    width = 4 + next_random (state) % (MAX_SIZE - 3);
+    height = 4 + next_random (state) % (MAX_SIZE - 3);
+    int density = next_random (state) % 40;
+
+    for (int i = 0; i < width * height; i++)
+        blocked[i] = next_random (state) % 100 < density;
+
+    /* A wall across with a gap or two makes for long detours */
+    if (next_random (state) % 2) {
+        int x = next_random (state) % width;
+        for (int y = 0; y < height; y++)
+            blocked[y * width + x] = next_random (state) % 8 != 0;
+    }
+}
+
+static PATHFINDER *make_pathfinder (WORLD **world)
+{
+    static BOX boxes[MAX_SIZE * MAX_SIZE];
+    int num_boxes = 0;
+
+    *world = world_create ();
+    for (int i = 0; i < width * height; i++) {
+        if (blocked[i])
+            boxes[num_boxes++] = (BOX){{(i % width + 0.5f) * TILE, (i / width + 0.5f) * TILE}, {TILE / 2, TILE / 2}, NULL};
+    }
+    if (num_boxes)
+        world_add_boxes (*world, boxes, num_boxes, WORLD_SOLID, false);
+    world_build (*world, NULL);
+
+    TILED_MAP map = {0};
+    map.width = width;
+    map.height = height;
+    map.tile_width = TILE;
+    map.tile_height = TILE;
+    return path_create (*world, &map, WORLD_SOLID);
+}
+
+static bool serve (PATHFINDER *paths, int budget)
+{
+    for (int i = 0; i < MAX_UPDATES; i++) {
+        if (!path_update (paths, budget))
+            return true;
+    }
+    return false;
+}
+
+/* Walks the waypoints from start, returning the cost or -1 if a step is not allowed. */
+static float walk (const PATH *path, int start, VECTOR2D target)
+{
+    int x = start % width, y = start / width;
+    int num = _al_vector_size (&path->points);
+    float total = 0;
+
+    for (int i = 0; i < num; i++) {
+        VECTOR2D p = *(VECTOR2D *)_al_vector_ref (&path->points, i);
+        int tx = (int)(p.x / TILE), ty = (int)(p.y / TILE);
+        int dx = (tx > x) - (tx < x), dy = (ty > y) - (ty < y);
+
+        if (dx && dy && abs (tx - x) != abs (ty - y))
+            return -1;
+
+        while (x != tx || y != ty) {
+            if (dx && dy && (!walkable (x + dx, y) || !walkable (x, y + dy)))
+                return -1;
+            x += dx;
+            y += dy;
+            if (!walkable (x, y))
+                return -1;
+            total += dx && dy ? 1.41421356f : 1.0f;
+        }
+    }
+
+    VECTOR2D last = num ? *(VECTOR2D *)_al_vector_ref (&path->points, num - 1) : (VECTOR2D){-1, -1};
+    if (last.x != target.x || last.y != target.y)
+        return -1;
+
+    return total;
+}
+
+static bool same_points (const PATH *a, const PATH *b)
+{
+    int num = _al_vector_size (&a->points);
+    if (a->status != b->status || num != (int)_al_vector_size (&b->points))
+        return false;
+
+    for (int i = 0; i < num; i++) {
+        VECTOR2D pa = *(VECTOR2D *)_al_vector_ref (&a->points, i);
+        VECTOR2D pb = *(VECTOR2D *)_al_vector_ref (&b->points, i);
+        if (pa.x != pb.x || pa.y != pb.y)
+            return false;
+    }
+    return true;
+}
+
+int main (int argc, char **argv)
+{
+    unsigned int state = 5;
+    int failures = 0, num_checked = 0, num_found = 0;
+
+    for (int m = 0; m < NUM_MAPS; m++) {
+        make_map (&state);
+
+        WORLD *world, *resumed_world;
+        PATHFINDER *paths = make_pathfinder (&world);
+        PATHFINDER *resumed = make_pathfinder (&resumed_world);
+
+        int starts[NUM_REQUESTS];
+        VECTOR2D targets[NUM_REQUESTS];
+        PATH routes[NUM_REQUESTS], cached[NUM_REQUESTS], budgeted[NUM_REQUESTS];
+
+        for (int r = 0; r < NUM_REQUESTS; r++) {
+            int start = next_random (&state) % (width * height);
+            int goal = next_random (&state) % (width * height);
+            VECTOR2D from = {(start % width + 0.5f) * TILE, (start / width + 0.5f) * TILE};
+
+            starts[r] = start;
+            targets[r] = (VECTOR2D){(goal % width) * TILE + 3, (goal / width) * TILE + 11};
+
+            path_init (&routes[r], r);
+            path_init (&cached[r], r);
+            path_init (&budgeted[r], r);
+            path_request (paths, &routes[r], from, targets[r]);
+            path_request (resumed, &budgeted[r], from, targets[r]);
+        }
+
+        if (!serve (paths, 1000) || !serve (resumed, 1)) {
+            printf ("map %d: requests never finished\n", m);
+            return 1;
+        }
+
+        int hits = paths->cache_hits;
+        for (int r = 0; r < NUM_REQUESTS; r++) {
+            VECTOR2D from = {(starts[r] % width + 0.5f) * TILE, (starts[r] / width + 0.5f) * TILE};
+            path_request (paths, &cached[r], from, targets[r]);
+        }
+        serve (paths, 1000);
+
+        /* Corridors ask for their first leg again, from the cache as well */
+        if (paths->cache_hits - hits < NUM_REQUESTS && failures++ < 10)
+            printf ("map %d: %d of %d requests came from the cache\n", m, paths->cache_hits - hits, NUM_REQUESTS);
+
+        for (int r = 0; r < NUM_REQUESTS; r++) {
+            PATH *route = &routes[r];
+            int goal = (int)(targets[r].y / TILE) * width + (int)(targets[r].x / TILE);
+
+            if (!same_points (route, &cached[r]) && failures++ < 10)
+                printf ("map %d request %d: cached answer differs\n", m, r);
+            if (!same_points (route, &budgeted[r]) && failures++ < 10)
+                printf ("map %d request %d: resumed answer differs\n", m, r);
+
+            if (_al_vector_size (&route->corridor) > 0)
+                continue;
+
+            dijkstra (starts[r]);
+            num_checked++;
+
+            if (route->status == PATH_FAILED) {
+                if (cost[goal] < INFINITY && failures++ < 10)
+                    printf ("map %d request %d: no route found, one of %f exists\n", m, r, cost[goal]);
+                continue;
+            }
+
+            num_found++;
+            float total = walk (route, starts[r], targets[r]);
+            if (route->status != PATH_FOUND || total < 0) {
+                if (failures++ < 10)
+                    printf ("map %d request %d: route is not walkable\n", m, r);
+            } else if (fabsf (total - cost[goal]) > 1e-3f && failures++ < 10) {
+                printf ("map %d request %d: route costs %f, cheapest %f\n", m, r, total, cost[goal]);
+            }
+        }
+
+        for (int r = 0; r < NUM_REQUESTS; r++) {
+            path_clear (&routes[r]);
+            path_clear (&cached[r]);
+            path_clear (&budgeted[r]);
+        }
+        path_free (paths);
+        path_free (resumed);
+        world_free (world);
+        world_free (resumed_world);
+    }
+
+    if (num_found < num_checked / 4) {
+        printf ("only %d of %d routes found, the maps are too closed\n", num_found, num_checked);
+        failures++;
+    }
+
+    printf ("%d routes checked, %d found, %d failures\n", num_checked, num_found, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * Checks the segment walks of the tree and the grid against testing every
+ * box: each box the segment hits must be visited exactly once. Segments
+ * run along cell lines, through cell corners, start and end outside the
+ * grid, and some have no length at all.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <nostos/spatialgrid.h>
+
+#define NUM_BOXES 600
+#define NUM_SEGMENTS 3000
+#define NUM_ROUNDS 8
+#define TILE 32
+
+typedef struct VISITS {
+    int *count;
+    const BOX *boxes;
+} VISITS;
+
+static unsigned int next_random (unsigned int *state)
+{
+    *state = *state * 1103515245u + 12345u;
+    return (*state >> 16) & 0x7fff;
+}
+
+static bool count_visit (BOX *box, void *user)
+{
+    VISITS *visits = user;
+    visits->count[(BOX *)box->data - visits->boxes]++;
+    return true;
+}
+
+static VECTOR2D random_point (unsigned int *state)
+{
+    return (VECTOR2D){(int)(next_random (state) % 2400) - 200, (int)(next_random (state) % 2400) - 200};
+}
+
+static VECTOR2D random_end (unsigned int *state, VECTOR2D *from)
+{
+    VECTOR2D to = random_point (state);
+    int d = next_random (state) % 800;
+
+    switch (next_random (state) % 5) {
+        case 0:
+            return (VECTOR2D){from->x, to.y};
+        case 1:
+            return (VECTOR2D){to.x, from->y};
+        case 2:
+            *from = (VECTOR2D){(int)from->x / TILE * TILE, (int)from->y / TILE * TILE};
+            return (VECTOR2D){from->x + d, from->y + (next_random (state) % 2 ? d : -d)};
+        case 3:
+            return *from;
+        default:
+            return (VECTOR2D){to.x + 0.37f, to.y};
+    }
+}
+
+static int check_round (int round, unsigned int *state)
+{
+    BOX *boxes = al_malloc (NUM_BOXES * sizeof (BOX));
+    float cell_sizes[] = {64, 32, 100, 17.5f};
+
+    for (int i = 0; i < NUM_BOXES; i++) {
+        if (round % 2) {
+            int w = 1 + next_random (state) % 4, h = 1 + next_random (state) % 4;
+            boxes[i].extent = (VECTOR2D){w * TILE / 2.0f, h * TILE / 2.0f};
+            boxes[i].center = (VECTOR2D){(next_random (state) % 60) * TILE + boxes[i].extent.x,
+                                         (next_random (state) % 60) * TILE + boxes[i].extent.y};
+        } else {
+            boxes[i].extent = (VECTOR2D){1 + next_random (state) % 40, 1 + next_random (state) % 40};
+            boxes[i].center = (VECTOR2D){next_random (state) % 2000 + 0.25f, next_random (state) % 2000};
+        }
+        boxes[i].data = &boxes[i];
+    }
+
+    AABB_TREE *tree = aabb_build_tree (boxes, NUM_BOXES, 4);
+    SPATIAL_GRID *grid = grid_build (boxes, NUM_BOXES, cell_sizes[round % 4]);
+    int *tree_count = al_malloc (NUM_BOXES * sizeof (int));
+    int *grid_count = al_malloc (NUM_BOXES * sizeof (int));
+    int failures = 0;
+
+    for (int s = 0; s < NUM_SEGMENTS; s++) {
+        VECTOR2D from = random_point (state);
+        VECTOR2D to = random_end (state, &from);
+        VISITS tree_visits = {tree_count, boxes};
+        VISITS grid_visits = {grid_count, boxes};
+
+        memset (tree_count, 0, NUM_BOXES * sizeof (int));
+        memset (grid_count, 0, NUM_BOXES * sizeof (int));
+        aabb_query_segment (tree, from, to, count_visit, &tree_visits);
+        grid_query_segment (grid, from, to, count_visit, &grid_visits);
+
+        for (int i = 0; i < NUM_BOXES; i++) {
+            BOX point = {from, {0, 0}, NULL};
+            BOX_HIT hit;
+            int expected = box_sweep (point, vsub (to, from), boxes[i], &hit) ? 1 : 0;
+
+            if (tree_count[i] != expected || grid_count[i] != expected) {
+                if (failures++ < 10)
+                    printf ("round %d: (%g, %g) -> (%g, %g), box %d: hit %d, tree %d, grid %d\n",
+                            round, from.x, from.y, to.x, to.y, i, expected, tree_count[i], grid_count[i]);
+            }
+        }
+    }
+
+    al_free (tree_count);
+    al_free (grid_count);
+    grid_free (grid);
+    aabb_free (tree);
+    al_free (boxes);
+    return failures;
+}
+
+int main (int argc, char **argv)
+{
+    unsigned int state = 5;
+    int failures = 0;
+
+    for (int round = 0; round < NUM_ROUNDS; round++)
+        failures += check_round (round, &state);
+
+    printf ("%d rounds x %d segments, %d mismatches\n", NUM_ROUNDS, NUM_SEGMENTS, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * Boxes just off the corners of a capsule's round caps are inside its
+ * bounds and project onto both of its sides, so only the axis from the
+ * cap center to the nearest point of the box separates them.
+ */
+
+#include <stdio.h>
+#include <nostos/shape.h>
+
+typedef struct CAP_CASE {
+    VECTOR2D center;
+    bool overlap;
+} CAP_CASE;
+
+int main (int argc, char **argv)
+{
+    SHAPE *capsule = shape_capsule ((VECTOR2D){0, 0}, (VECTOR2D){10, 0}, 2, NULL);
+    CAP_CASE cases[] = {
+        {{-2.5f, -2.5f}, false},
+        {{12.5f, -2.5f}, false},
+        {{12.5f, 2.5f}, false},
+        {{-2.5f, 2.5f}, false},
+        {{-1.5f, -1.5f}, true},
+        {{11.5f, 1.5f}, true},
+        {{5, 2.4f}, true},
+        {{5, 3.6f}, false},
+    };
+    int num_cases = sizeof (cases) / sizeof (cases[0]);
+    int failures = 0;
+
+    for (int i = 0; i < num_cases; i++) {
+        BOX box = {cases[i].center, {0.5f, 0.5f}, NULL};
+        bool overlap = shape_overlap (capsule, box, NULL);
+
+        if (overlap != cases[i].overlap) {
+            printf ("box at (%g, %g): overlap %d, expected %d\n",
+                    cases[i].center.x, cases[i].center.y, overlap, cases[i].overlap);
+            failures++;
+        }
+    }
+
+    shape_free (capsule);
+    printf ("%d cap cases, %d failures\n", num_cases, failures);
+    return failures ? 1 : 0;
+}
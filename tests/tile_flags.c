@@ -0,0 +1,218 @@
+/*
+ * Loads a map whose tiles set the tile flags, including properties set to
+ * "0" and "false", and checks the flag queries against the tiles: every
+ * cell must carry the flags of its tile, every rectangle the OR of its
+ * cells. Rectangles start, end and fit inside one 32 bit word of the
+ * layer's bitsets, span several, and run off the layer edges. The boxes
+ * loaded for a flag must cover exactly the cells carrying it in any layer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <allegro5/allegro.h>
+#include <allegro5/allegro_image.h>
+#include <nostos/aabbtree.h>
+
+#define WIDTH 70
+#define HEIGHT 13
+#define TILE 16
+#define NUM_TILES 8
+#define NUM_RECTS 20000
+
+/* Tile properties by id and the flags they must set */
+static const char *properties[NUM_TILES] = {
+    "    <property name=\"solid\" value=\"1\"/>\n",
+    "    <property name=\"water\" value=\"true\"/>\n",
+    "    <property name=\"slow\" value=\"0\"/>\n",
+    "    <property name=\"trigger\" value=\"1\"/>\n    <property name=\"opaque\" value=\"yes\"/>\n",
+    "    <property name=\"solid\" value=\"false\"/>\n",
+    "    <property name=\"slow\" value=\"1\"/>\n    <property name=\"solid\" value=\"1\"/>\n",
+    "    <property name=\"opaque\" value=\"1\"/>\n",
+    NULL
+};
+
+static const unsigned int expected_flags[NUM_TILES] = {
+    TILE_FLAG_SOLID,
+    TILE_FLAG_WATER,
+    0,
+    TILE_FLAG_TRIGGER | TILE_FLAG_OPAQUE,
+    0,
+    TILE_FLAG_SLOW | TILE_FLAG_SOLID,
+    TILE_FLAG_OPAQUE,
+    0
+};
+
+static int gids[2][HEIGHT][WIDTH];
+
+static unsigned int next_random (unsigned int *state)
+{
+    *state = *state * 1103515245u + 12345u;
+    return (*state >> 16) & 0x7fff;
+}
+
+static bool write_map (const char *filename, const char *image, unsigned int *state)
+{
+    FILE *file = fopen (filename, "w");
+    if (!file)
+        return false;
+
+    /* Indented like Tiled writes it: the loader skips the text before each first child */
+    fprintf (file, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+    fprintf (file, "<map version=\"1.0\" orientation=\"orthogonal\" width=\"%d\" height=\"%d\" "
+                   "tilewidth=\"%d\" tileheight=\"%d\">\n", WIDTH, HEIGHT, TILE, TILE);
+    fprintf (file, " <tileset firstgid=\"1\" name=\"flags\" tilewidth=\"%d\" tileheight=\"%d\">\n", TILE, TILE);
+    fprintf (file, "  <image source=\"%s\" width=\"%d\" height=\"%d\"/>\n", image, TILE * NUM_TILES / 2, TILE * 2);
+    for (int id = 0; id < NUM_TILES; id++) {
+        if (properties[id])
+            fprintf (file, "  <tile id=\"%d\">\n   <properties>\n%s   </properties>\n  </tile>\n",
+                     id, properties[id]);
+    }
+    fprintf (file, " </tileset>\n");
+
+    /* The ground is busy, the top layer mostly empty */
+    for (int l = 0; l < 2; l++) {
+        fprintf (file, " <layer name=\"%s\" width=\"%d\" height=\"%d\">\n  <data>\n",
+                 l ? "top" : "ground", WIDTH, HEIGHT);
+        for (int j = 0; j < HEIGHT; j++) {
+            for (int i = 0; i < WIDTH; i++) {
+                bool set = next_random (state) % 100 < (l ? 4 : 30);
+                gids[l][j][i] = set ? 1 + next_random (state) % NUM_TILES : 0;
+                fprintf (file, "   <tile gid=\"%d\"/>\n", gids[l][j][i]);
+            }
+        }
+        fprintf (file, "  </data>\n </layer>\n");
+    }
+
+    fprintf (file, "</map>\n");
+    fclose (file);
+    return true;
+}
+
+static unsigned int cell_flags (int l, int x, int y)
+{
+    if (x < 0 || y < 0 || x >= WIDTH || y >= HEIGHT || !gids[l][y][x])
+        return 0;
+    return expected_flags[gids[l][y][x] - 1];
+}
+
+static int check_rect (TILED_MAP *map, TILED_LAYER *layer, int l, int x, int y, int w, int h)
+{
+    static int num_printed;
+
+    unsigned int expected = 0;
+    for (int j = y; j < y + h; j++) {
+        for (int i = x; i < x + w; i++)
+            expected |= cell_flags (l, i, j);
+    }
+
+    unsigned int flags = tiled_rect_flags (map, layer, x, y, w, h);
+    if (flags != expected) {
+        if (num_printed++ < 10)
+            printf ("layer %d rect %d,%d %dx%d: flags %x, expected %x\n", l, x, y, w, h, flags, expected);
+        return 1;
+    }
+    return 0;
+}
+
+static int check_tile_boxes (TILED_MAP *map)
+{
+    int num_boxes;
+    int failures = 0;
+    BOX *boxes = aabb_load_tile_boxes (map, "solid", &num_boxes);
+
+    for (int j = 0; j < HEIGHT; j++) {
+        for (int i = 0; i < WIDTH; i++) {
+            VECTOR2D center = {(i + 0.5f) * TILE, (j + 0.5f) * TILE};
+            int covered = 0;
+            for (int b = 0; b < num_boxes; b++)
+                covered += box_inside_vector2d (boxes[b], center);
+
+            int expected = ((cell_flags (0, i, j) | cell_flags (1, i, j)) & TILE_FLAG_SOLID) != 0;
+            if (covered != expected && failures++ < 10)
+                printf ("cell %d,%d: covered by %d tile boxes, expected %d\n", i, j, covered, expected);
+        }
+    }
+
+    al_free (boxes);
+
+    if (aabb_load_tile_boxes (map, "unknown", &num_boxes) || num_boxes) {
+        printf ("tile boxes loaded for a property that is not a flag\n");
+        failures++;
+    }
+
+    return failures;
+}
+
+int main (int argc, char **argv)
+{
+    unsigned int state = 11;
+    int failures = 0;
+
+    if (!al_init () || !al_init_image_addon ()) {
+        fprintf (stderr, "Failed to initialize Allegro.\n");
+        return EXIT_FAILURE;
+    }
+
+    /* The map loader changes to the map's directory */
+    char filename[4096], image[4096];
+    char *cwd = al_get_current_directory ();
+    snprintf (filename, sizeof (filename), "%s/tile_flags.tmx", cwd);
+    snprintf (image, sizeof (image), "%s/tile_flags.bmp", cwd);
+    al_free (cwd);
+
+    ALLEGRO_BITMAP *bitmap = al_create_bitmap (TILE * NUM_TILES / 2, TILE * 2);
+    if (!bitmap || !al_save_bitmap (image, bitmap) || !write_map (filename, "tile_flags.bmp", &state)) {
+        fprintf (stderr, "Failed to write the test map.\n");
+        return EXIT_FAILURE;
+    }
+    al_destroy_bitmap (bitmap);
+
+    TILED_MAP *map = tiled_load_tmx_file (filename);
+    if (!map) {
+        fprintf (stderr, "Failed to load the test map.\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int l = 0; l < 2; l++) {
+        TILED_LAYER *layer = tiled_layer_by_name (map, l ? "top" : "ground");
+
+        for (int j = -1; j <= HEIGHT; j++) {
+            for (int i = -1; i <= WIDTH; i++) {
+                unsigned int flags = tiled_cell_flags (map, layer, i, j);
+                if (flags != cell_flags (l, i, j) && failures++ < 10)
+                    printf ("layer %d cell %d,%d: flags %x, expected %x\n", l, i, j, flags, cell_flags (l, i, j));
+            }
+        }
+
+        /* Inside one word, ending on and starting at word edges, and off the layer */
+        for (int j = 0; j < HEIGHT; j++) {
+            failures += check_rect (map, layer, l, 3, j, 5, 1);
+            failures += check_rect (map, layer, l, 0, j, 32, 1);
+            failures += check_rect (map, layer, l, 31, j, 2, 1);
+            failures += check_rect (map, layer, l, 32, j, 32, 1);
+            failures += check_rect (map, layer, l, 64, j, WIDTH - 64, 1);
+            failures += check_rect (map, layer, l, -5, j, WIDTH + 10, 1);
+        }
+        failures += check_rect (map, layer, l, -10, -10, 5, 5);
+        failures += check_rect (map, layer, l, WIDTH, 0, 8, HEIGHT);
+        failures += check_rect (map, layer, l, 0, HEIGHT, WIDTH, 4);
+        failures += check_rect (map, layer, l, 10, 3, 0, 4);
+
+        for (int r = 0; r < NUM_RECTS; r++) {
+            int w = next_random (&state) % (r % 2 ? 40 : WIDTH + 10);
+            int h = 1 + next_random (&state) % 4;
+            int x = (int)(next_random (&state) % (WIDTH + 20)) - 10;
+            int y = (int)(next_random (&state) % (HEIGHT + 4)) - 2;
+            failures += check_rect (map, layer, l, x, y, w, h);
+        }
+    }
+
+    failures += check_tile_boxes (map);
+
+    tiled_free_map (map);
+    remove (filename);
+    remove (image);
+
+    printf ("%d rects per layer, %d failures\n", NUM_RECTS, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * Adds, moves and removes dynamic proxies after the world is built and
+ * checks queries against testing every live object: between refits no
+ * removed proxy may be reported, and after one every live object in the
+ * query box must be reported exactly once, by the handle it was added with.
+ * Churn at a steady population must be absorbed without rebuilding the
+ * tree: rebuilds only come from the population doubling.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <nostos/world.h>
+
+#define MAX_OBJECTS 1500
+#define NUM_ROUNDS 60
+#define NUM_QUERIES 200
+#define AREA 3000
+#define MAX_REBUILDS 12
+
+typedef struct OBJECT {
+    BOX box;
+    int proxy;
+    bool live;
+} OBJECT;
+
+typedef struct CHECK {
+    const OBJECT *objects;
+    int *count;
+    int dead;
+} CHECK;
+
+static unsigned int next_random (unsigned int *state)
+{
+    *state = *state * 1103515245u + 12345u;
+    return (*state >> 16) & 0x7fff;
+}
+
+static BOX random_box (unsigned int *state)
+{
+    return (BOX){{next_random (state) % AREA + 0.5f, next_random (state) % AREA + 0.5f},
+                 {2 + next_random (state) % 24, 2 + next_random (state) % 24}, NULL};
+}
+
+static void refit_object (BOX *box, void *user)
+{
+    const OBJECT *objects = user;
+    const OBJECT *object = &objects[world_proxy_handle (box)];
+    box->center = object->box.center;
+    box->extent = object->box.extent;
+}
+
+static bool count_visit (BOX *box, void *user)
+{
+    CHECK *check = user;
+    int handle = world_proxy_handle (box);
+
+    if (handle < 0 || handle >= MAX_OBJECTS || !check->objects[handle].live)
+        check->dead++;
+    else
+        check->count[handle]++;
+    return true;
+}
+
+static int check_queries (const WORLD *world, const OBJECT *objects, unsigned int *state, bool refitted)
+{
+    int count[MAX_OBJECTS];
+    int failures = 0;
+
+    for (int q = 0; q < NUM_QUERIES; q++) {
+        BOX query = random_box (state);
+        query.extent = vmulf (query.extent, 8);
+        CHECK check = {objects, count, 0};
+
+        memset (count, 0, sizeof (count));
+        world_query_visit (world, &query, WORLD_NPC, NULL, count_visit, &check);
+
+        if (check.dead && failures++ < 10)
+            printf ("query %d: %d removed proxies reported\n", q, check.dead);
+
+        for (int i = 0; refitted && i < MAX_OBJECTS; i++) {
+            int expected = objects[i].live && box_overlap (query, objects[i].box);
+            if (count[i] != expected && failures++ < 10)
+                printf ("query %d: object %d reported %d times, expected %d\n", q, i, count[i], expected);
+        }
+    }
+
+    return failures;
+}
+
+static int check_nearest (const WORLD *world, const OBJECT *objects, AABB_COLLISIONS *collisions)
+{
+    int failures = 0;
+    world_query_nearest (world, (VECTOR2D){AREA / 2, AREA / 2}, 16, AREA, WORLD_NPC, collisions);
+
+    for (int i = 0; i < collisions->num_collisions; i++) {
+        BOX *box = *(BOX **)_al_vector_ref (&collisions->boxes, i);
+        if (!objects[world_proxy_handle (box)].live && failures++ < 10)
+            printf ("nearest: removed proxy %d reported\n", world_proxy_handle (box));
+    }
+
+    return failures;
+}
+
+int main (int argc, char **argv)
+{
+    unsigned int state = 7;
+    static OBJECT objects[MAX_OBJECTS];
+    AABB_COLLISIONS collisions;
+    int failures = 0;
+    int rebuilds = 0;
+
+    aabb_init_collisions (&collisions);
+
+    WORLD *world = world_create ();
+    for (int i = 0; i < 40; i++) {
+        BOX wall = random_box (&state);
+        world_add_boxes (world, &wall, 1, WORLD_SOLID, false);
+    }
+    world_build (world, NULL);
+
+    for (int round = 0; round < NUM_ROUNDS; round++) {
+        for (int n = 0; n < 120; n++) {
+            int i = next_random (&state) % MAX_OBJECTS;
+            OBJECT *object = &objects[i];
+
+            if (object->live) {
+                int proxy = object->proxy;
+                world_remove_dynamic (world, proxy);
+                world_remove_dynamic (world, proxy);
+                object->live = false;
+            } else if (next_random (&state) % 3) {
+                object->box = random_box (&state);
+                object->proxy = world_add_dynamic (world, object->box, WORLD_NPC, i);
+                object->live = true;
+            }
+        }
+
+        failures += check_queries (world, objects, &state, false);
+        failures += check_nearest (world, objects, &collisions);
+
+        for (int i = 0; i < MAX_OBJECTS; i++) {
+            if (objects[i].live)
+                objects[i].box.center = vadd (objects[i].box.center,
+                                              (VECTOR2D){(int)(next_random (&state) % 9) - 4, 2});
+        }
+
+        rebuilds += world->dynamics_dirty;
+        world_refit (world, refit_object, objects);
+        failures += check_queries (world, objects, &state, true);
+        failures += check_nearest (world, objects, &collisions);
+
+        /* A refit without changes only moves the boxes */
+        world_refit (world, refit_object, objects);
+        failures += check_queries (world, objects, &state, true);
+    }
+
+    int live = 0;
+    for (int i = 0; i < MAX_OBJECTS; i++)
+        live += objects[i].live;
+    if (world->dynamic_proxies->num_items != live) {
+        printf ("%d proxies left for %d live objects\n", world->dynamic_proxies->num_items, live);
+        failures++;
+    }
+
+    if (rebuilds > MAX_REBUILDS) {
+        printf ("%d rebuilds for %d live objects\n", rebuilds, live);
+        failures++;
+    }
+
+    world_free (world);
+    aabb_free_collisions (&collisions);
+    printf ("%d rounds, %d live objects, %d rebuilds, %d failures\n", NUM_ROUNDS, live, rebuilds, failures);
+    return failures ? 1 : 0;
+}